@@ -0,0 +1,493 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+namespace mapnik_print
+{
+
+enum class durability
+{
+    // Leaves flushing to the kernel.
+    none,
+    // Waits for the file data to reach the disk before completing it.
+    data,
+    // Also waits for the metadata of the file and its directory entry.
+    full
+};
+
+inline durability parse_durability(std::string const & name)
+{
+    if (name == "none")
+    {
+        return durability::none;
+    }
+    if (name == "data")
+    {
+        return durability::data;
+    }
+    if (name == "full")
+    {
+        return durability::full;
+    }
+    throw std::runtime_error("Unknown durability: " + name);
+}
+
+struct writer_options
+{
+    // Bytes handed to the writer and not yet written beyond which the
+    // producers wait.
+    std::size_t max_pending = 64 << 20;
+    // Bytes of each buffer handed to the writer.
+    std::size_t chunk_size = 1 << 20;
+    // Disk space reserved ahead of the written data, zero for none.
+    std::size_t preallocate = 0;
+    durability sync = durability::none;
+    // Written data is dropped from the page cache once on its way to the
+    // disk, so that large outputs do not evict everything else.
+    bool drop_cache = true;
+};
+
+// Writes files on a dedicated thread, so that rendering the next output
+// overlaps writing the previous ones to slow storage.
+class file_writer
+{
+public:
+    // Output file being written, completed once its data is written,
+    // synced as configured and the file closed.
+    struct file
+    {
+        const std::string path;
+        const int fd;
+        const bool owns_fd;
+        std::size_t offset = 0;
+        std::size_t allocated = 0;
+        std::size_t dropped = 0;
+        std::exception_ptr error;
+        std::promise<void> done;
+        std::shared_future<void> future = done.get_future().share();
+
+        file(std::string const & path, int fd, bool owns_fd)
+            : path(path), fd(fd), owns_fd(owns_fd)
+        {
+        }
+    };
+
+    using file_ptr = std::shared_ptr<file>;
+
+private:
+    struct task
+    {
+        file_ptr f;
+        std::vector<char> data;
+        bool close;
+    };
+
+    const writer_options options;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<task> tasks;
+    std::size_t pending = 0;
+    std::size_t open_files = 0;
+    std::exception_ptr first_error;
+    bool stopping = false;
+    std::thread worker;
+
+public:
+    explicit file_writer(writer_options const & options)
+        : options(options), worker([this] { run(); })
+    {
+    }
+
+    file_writer(file_writer const &) = delete;
+    file_writer & operator=(file_writer const &) = delete;
+
+    // Finishes writing the files queued before.
+    ~file_writer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        worker.join();
+    }
+
+    writer_options const & get_options() const
+    {
+        return options;
+    }
+
+    // Opens the path for writing, "-" meaning standard output.
+    file_ptr open(std::string const & path)
+    {
+        int fd = STDOUT_FILENO;
+        if (path != "-")
+        {
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                throw std::runtime_error("Cannot open file for writing: " + path +
+                    ": " + std::strerror(errno));
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        open_files++;
+        return std::make_shared<file>(path, fd, path != "-");
+    }
+
+    // Queues the data, waiting while too much is pending.
+    void write(file_ptr const & f, std::vector<char> data)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [&] { return pending == 0 || pending + data.size() <= options.max_pending; });
+        pending += data.size();
+        tasks.push_back({ f, std::move(data), false });
+        lock.unlock();
+        condition.notify_all();
+    }
+
+    std::shared_future<void> close(file_ptr const & f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back({ f, {}, true });
+        }
+        condition.notify_all();
+        return f->future;
+    }
+
+    // Waits until every file opened so far is complete, rethrowing the
+    // first failure since the last wait.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return open_files == 0; });
+        if (first_error)
+        {
+            std::exception_ptr error(first_error);
+            first_error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            task t;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                {
+                    return;
+                }
+                t = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            if (t.close)
+            {
+                finish(*t.f);
+            }
+            else
+            {
+                if (!t.f->error)
+                {
+                    try
+                    {
+                        write_data(*t.f, t.data);
+                    }
+                    catch (...)
+                    {
+                        t.f->error = std::current_exception();
+                    }
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending -= t.data.size();
+                if (t.close)
+                {
+                    open_files--;
+                    if (t.f->error && !first_error)
+                    {
+                        first_error = t.f->error;
+                    }
+                }
+            }
+            condition.notify_all();
+        }
+    }
+
+    [[noreturn]] static void fail(file const & f, char const * operation)
+    {
+        throw std::runtime_error(std::string("Cannot ") + operation + " output: " + f.path +
+            ": " + std::strerror(errno));
+    }
+
+    void write_data(file & f, std::vector<char> const & data)
+    {
+#if defined(__linux__)
+        if (options.preallocate > 0 && f.offset + data.size() > f.allocated && f.owns_fd)
+        {
+            std::size_t size = std::max(options.preallocate, data.size());
+            // Storage which cannot preallocate is written as is.
+            if (::fallocate(f.fd, FALLOC_FL_KEEP_SIZE, f.allocated, size) == 0)
+            {
+                f.allocated += size;
+            }
+            else
+            {
+                f.allocated = std::size_t(-1);
+            }
+        }
+#endif
+        char const * p = data.data();
+        std::size_t size = data.size();
+        while (size > 0)
+        {
+            ssize_t count = ::write(f.fd, p, size);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fail(f, "write");
+            }
+            p += count;
+            size -= count;
+        }
+        std::size_t start = f.offset;
+        f.offset += data.size();
+#if defined(__linux__)
+        if (options.drop_cache && f.owns_fd)
+        {
+            // Starts writing back the new data and drops the data whose
+            // write back started one chunk before, likely complete.
+            ::sync_file_range(f.fd, start, data.size(), SYNC_FILE_RANGE_WRITE);
+            if (start > f.dropped)
+            {
+                ::posix_fadvise(f.fd, f.dropped, start - f.dropped, POSIX_FADV_DONTNEED);
+                f.dropped = start;
+            }
+        }
+#else
+        (void)start;
+#endif
+    }
+
+    void finish(file & f)
+    {
+        try
+        {
+            if (f.error)
+            {
+                std::rethrow_exception(f.error);
+            }
+            if (f.owns_fd)
+            {
+                if (f.allocated > f.offset && ::ftruncate(f.fd, f.offset) < 0)
+                {
+                    fail(f, "truncate");
+                }
+                if (options.sync == durability::data && ::fdatasync(f.fd) < 0)
+                {
+                    fail(f, "sync");
+                }
+                if (options.sync == durability::full && ::fsync(f.fd) < 0)
+                {
+                    fail(f, "sync");
+                }
+                if (options.drop_cache)
+                {
+                    ::posix_fadvise(f.fd, 0, 0, POSIX_FADV_DONTNEED);
+                }
+            }
+        }
+        catch (...)
+        {
+            f.error = std::current_exception();
+        }
+        if (f.owns_fd && ::close(f.fd) < 0 && !f.error)
+        {
+            try
+            {
+                fail(f, "close");
+            }
+            catch (...)
+            {
+                f.error = std::current_exception();
+            }
+        }
+        if (!f.error && f.owns_fd && options.sync == durability::full)
+        {
+            sync_directory(f);
+        }
+        if (f.error)
+        {
+            f.done.set_exception(f.error);
+        }
+        else
+        {
+            f.done.set_value();
+        }
+    }
+
+    static void sync_directory(file & f)
+    {
+        boost::filesystem::path directory(boost::filesystem::absolute(f.path).parent_path());
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+};
+
+// Stream buffer handing the written bytes to the writer in chunks.
+class async_streambuf : public std::streambuf
+{
+    file_writer & writer;
+    const file_writer::file_ptr f;
+    std::vector<char> buffer;
+    std::size_t written = 0;
+    bool closed = false;
+
+public:
+    async_streambuf(file_writer & writer, std::string const & path)
+        : writer(writer), f(writer.open(path))
+    {
+        reset();
+    }
+
+    async_streambuf(async_streambuf const &) = delete;
+    async_streambuf & operator=(async_streambuf const &) = delete;
+
+    ~async_streambuf()
+    {
+        if (!closed)
+        {
+            close();
+        }
+    }
+
+    // Bytes handed to the writer so far.
+    std::size_t bytes_written() const
+    {
+        return written + (pptr() - pbase());
+    }
+
+    std::shared_future<void> close()
+    {
+        submit();
+        closed = true;
+        return writer.close(f);
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        submit();
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char * data, std::streamsize size) override
+    {
+        std::streamsize remaining = size;
+        while (remaining > 0)
+        {
+            if (pptr() == epptr())
+            {
+                submit();
+            }
+            std::streamsize count = std::min<std::streamsize>(remaining, epptr() - pptr());
+            std::memcpy(pptr(), data, count);
+            pbump(static_cast<int>(count));
+            data += count;
+            remaining -= count;
+        }
+        return size;
+    }
+
+    // The data is written in the background: flushing only hands the
+    // buffer over.
+    int sync() override
+    {
+        submit();
+        return 0;
+    }
+
+private:
+    void reset()
+    {
+        buffer.resize(writer.get_options().chunk_size);
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    void submit()
+    {
+        std::size_t size = pptr() - pbase();
+        if (size == 0)
+        {
+            return;
+        }
+        buffer.resize(size);
+        written += size;
+        writer.write(f, std::move(buffer));
+        buffer = std::vector<char>();
+        reset();
+    }
+};
+
+// Output stream for a path written by the writer, "-" meaning standard
+// output. Write errors are reported by the future close returns.
+class async_output_stream : public std::ostream
+{
+    async_streambuf buf;
+
+public:
+    async_output_stream(file_writer & writer, std::string const & path)
+        : std::ostream(nullptr), buf(writer, path)
+    {
+        rdbuf(&buf);
+    }
+
+    std::size_t bytes_written() const
+    {
+        return buf.bytes_written();
+    }
+
+    std::shared_future<void> close()
+    {
+        return buf.close();
+    }
+};
+
+}
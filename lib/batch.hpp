@@ -0,0 +1,349 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <type_traits>
+#include <cctype>
+
+#include <mapnik/map.hpp>
+
+#include "renderer.hpp"
+#include "command_spec.hpp"
+#include "output.hpp"
+#include "vector_quality.hpp"
+#include "scale_styles.hpp"
+
+namespace mapnik_print
+{
+
+enum class manifest_format
+{
+    json_lines,
+    csv
+};
+
+// Parses a flat JSON object of command parameters, numbers pairs being
+// given as arrays: {"center": [1823000, 6140000], "scale": 25000}
+inline void parse_json_spec(std::string const & line, command_spec & spec)
+{
+    std::size_t pos = 0;
+    auto skip_space = [&] {
+        while (pos < line.size() && std::isspace(static_cast<unsigned char>(line[pos])))
+        {
+            pos++;
+        }
+    };
+    auto expect = [&](char c) {
+        skip_space();
+        if (pos >= line.size() || line[pos] != c)
+        {
+            throw std::runtime_error(std::string("Invalid manifest line, expected '") + c + "': " + line);
+        }
+        pos++;
+    };
+    auto parse_string = [&] {
+        expect('"');
+        std::string text;
+        while (pos < line.size() && line[pos] != '"')
+        {
+            if (line[pos] == '\\' && pos + 1 < line.size())
+            {
+                pos++;
+            }
+            text.push_back(line[pos++]);
+        }
+        expect('"');
+        return text;
+    };
+    auto parse_scalar = [&] {
+        skip_space();
+        if (pos < line.size() && line[pos] == '"')
+        {
+            return parse_string();
+        }
+        std::size_t start = pos;
+        while (pos < line.size() && line[pos] != ',' && line[pos] != ']' && line[pos] != '}' &&
+               !std::isspace(static_cast<unsigned char>(line[pos])))
+        {
+            pos++;
+        }
+        return line.substr(start, pos - start);
+    };
+
+    expect('{');
+    skip_space();
+    if (pos < line.size() && line[pos] == '}')
+    {
+        return;
+    }
+    while (true)
+    {
+        std::string key(parse_string());
+        expect(':');
+        skip_space();
+        std::string value;
+        if (pos < line.size() && line[pos] == '[')
+        {
+            pos++;
+            value = parse_scalar();
+            expect(',');
+            value += "," + parse_scalar();
+            expect(']');
+        }
+        else
+        {
+            value = parse_scalar();
+        }
+        set_command_parameter(spec, key, value);
+        skip_space();
+        if (pos < line.size() && line[pos] == ',')
+        {
+            pos++;
+            continue;
+        }
+        expect('}');
+        return;
+    }
+}
+
+// Splits a CSV line, fields containing commas (such as "x,y" pairs)
+// being quoted.
+inline std::vector<std::string> parse_csv_line(std::string const & line)
+{
+    std::vector<std::string> fields(1);
+    bool quoted = false;
+    for (std::size_t i = 0; i < line.size(); i++)
+    {
+        char c = line[i];
+        if (c == '"')
+        {
+            if (quoted && i + 1 < line.size() && line[i + 1] == '"')
+            {
+                fields.back().push_back('"');
+                i++;
+            }
+            else
+            {
+                quoted = !quoted;
+            }
+        }
+        else if (c == ',' && !quoted)
+        {
+            fields.emplace_back();
+        }
+        else if (c != '\r')
+        {
+            fields.back().push_back(c);
+        }
+    }
+    return fields;
+}
+
+// Reads command specs from a manifest, one page per line. JSON lines
+// manifests hold one object per line; CSV manifests start with a header
+// naming the command parameter of each column. Empty lines and lines
+// starting with # are skipped.
+class manifest_reader
+{
+    std::istream & input;
+    const manifest_format format;
+    const command_spec defaults;
+    std::vector<std::string> header;
+    std::size_t line_number = 0;
+
+public:
+    manifest_reader(std::istream & input, manifest_format format, command_spec const & defaults)
+        : input(input), format(format), defaults(defaults)
+    {
+    }
+
+    bool next(command_spec & spec)
+    {
+        std::string line;
+        while (std::getline(input, line))
+        {
+            line_number++;
+            if (line.find_first_not_of(" \t\r") == std::string::npos || line[0] == '#')
+            {
+                continue;
+            }
+            try
+            {
+                if (format == manifest_format::csv && header.empty())
+                {
+                    header = parse_csv_line(line);
+                    continue;
+                }
+                spec = defaults;
+                if (format == manifest_format::csv)
+                {
+                    std::vector<std::string> fields(parse_csv_line(line));
+                    for (std::size_t i = 0; i < fields.size() && i < header.size(); i++)
+                    {
+                        if (!fields[i].empty())
+                        {
+                            set_command_parameter(spec, header[i], fields[i]);
+                        }
+                    }
+                }
+                else
+                {
+                    parse_json_spec(line, spec);
+                }
+                return true;
+            }
+            catch (std::exception const & e)
+            {
+                throw std::runtime_error("Manifest line " + std::to_string(line_number) + ": " + e.what());
+            }
+        }
+        return false;
+    }
+};
+
+struct batch_options
+{
+    // Prefix of the page files, numbered from 1, unless a page names
+    // its own output.
+    std::string output_prefix = "page-";
+    // Single multi-page document for all pages when not empty.
+    std::string document;
+    tile_options tiles;
+    vector_options vector;
+    png_options png;
+    output_cache * cache = nullptr;
+    file_writer * writer = nullptr;
+    image_pool * images = nullptr;
+    render_listener * listener = nullptr;
+    // Simplifies vector output to the device resolution when set.
+    device_maps * device = nullptr;
+    // Specializes the styles to the scale of each page when set.
+    scale_maps * scales = nullptr;
+};
+
+// Calls the function for every page of the manifest with a renderer of
+// the renderer of the page, drawing its map as simplified and specialized
+// for the page. Renderers only hold their settings and are made for each
+// page.
+template <typename Function>
+std::size_t for_each_page(std::map<std::string, shared_map> const & maps,
+                          manifest_reader & manifest,
+                          batch_options const & options,
+                          Function && function)
+{
+    std::size_t pages = 0;
+    command_spec spec;
+    while (manifest.next(spec))
+    {
+        pages++;
+        shared_map map(find_map(maps, spec.map));
+        command cmd(spec.to_command(map->srs()));
+        if (options.device)
+        {
+            map = options.device->for_renderer(spec.renderer, map, cmd.dpi);
+        }
+        if (options.scales)
+        {
+            map = options.scales->get(map, cmd);
+        }
+        dispatch_renderer(spec.renderer, [&](auto tag) {
+            renderer<typename decltype(tag)::type> ren(map, options.tiles);
+            ren.set_listener(options.listener);
+            ren.set_png_options(options.png);
+            ren.set_vector_options(options.vector);
+            ren.set_cache(options.cache);
+            ren.set_writer(options.writer);
+            ren.set_image_pool(options.images);
+            function(ren, cmd, spec, pages);
+        });
+    }
+    return pages;
+}
+
+// Renders every page of the manifest into its own file, with the renderer
+// of the page, or as a page of the document, whose pages must all use
+// the renderer of the document. Every page is reported on the progress
+// stream as soon as it is written.
+template <typename Renderer>
+std::size_t run_batch(std::map<std::string, shared_map> const & maps,
+                      manifest_reader & manifest,
+                      batch_options const & options,
+                      std::ostream & progress)
+{
+    if constexpr (Renderer::support_pages)
+    {
+        if (!options.document.empty())
+        {
+            output_stream stream(options.document);
+            typename Renderer::document document(stream);
+            std::size_t pages = for_each_page(maps, manifest, options,
+                [&](auto & ren, command const & cmd, command_spec const & spec, std::size_t page) {
+                    using renderer_type = typename std::decay<decltype(ren)>::type::renderer_type;
+                    if constexpr (std::is_same<renderer_type, Renderer>::value)
+                    {
+                        ren.render_page(cmd, document);
+                        stream.flush();
+                        progress << page << "\t" << options.document << std::endl;
+                    }
+                    else
+                    {
+                        throw std::runtime_error("Page " + std::to_string(page) + " of the document uses renderer " +
+                                                 spec.renderer + " instead of " + Renderer::name);
+                    }
+                });
+            document.finish();
+            return pages;
+        }
+    }
+    else if (!options.document.empty())
+    {
+        throw std::runtime_error(std::string("Renderer does not support multi-page documents: ") +
+            Renderer::name);
+    }
+
+    // Pages written in the background are reported in order once done.
+    struct written_page
+    {
+        std::size_t page;
+        std::string output;
+        std::shared_future<void> written;
+    };
+    std::deque<written_page> written;
+    auto report = [&](bool wait) {
+        while (!written.empty() &&
+               (wait || written.front().written.wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+        {
+            written.front().written.get();
+            progress << written.front().page << "\t" << written.front().output << std::endl;
+            written.pop_front();
+        }
+    };
+
+    std::size_t pages = for_each_page(maps, manifest, options,
+        [&](auto & ren, command const & cmd, command_spec const & spec, std::size_t page) {
+            using renderer_type = typename std::decay<decltype(ren)>::type::renderer_type;
+            std::string output(spec.output);
+            if (output.empty())
+            {
+                std::ostringstream name;
+                name << options.output_prefix << std::setw(4) << std::setfill('0') << page << renderer_type::ext;
+                output = name.str();
+            }
+            written.push_back({ page, output, ren.render(cmd, boost::filesystem::path(output)) });
+            report(false);
+        });
+    report(true);
+    return pages;
+}
+
+}
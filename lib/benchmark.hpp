@@ -0,0 +1,197 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+#include <algorithm>
+#include <streambuf>
+#include <cmath>
+
+#include <sys/resource.h>
+
+#include <mapnik/map.hpp>
+
+#include "renderer.hpp"
+
+namespace mapnik_print
+{
+
+// Stream buffer discarding everything written to it, counting the bytes.
+class counting_streambuf : public std::streambuf
+{
+    std::size_t count = 0;
+
+public:
+    std::size_t size() const
+    {
+        return count;
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            count++;
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char *, std::streamsize size) override
+    {
+        count += size;
+        return size;
+    }
+};
+
+struct benchmark_sample
+{
+    double wall_time;
+    double cpu_time;
+    std::size_t peak_rss;
+    std::size_t output_bytes;
+};
+
+struct benchmark_statistics
+{
+    double min, median, p95;
+
+    static benchmark_statistics compute(std::vector<double> values)
+    {
+        if (values.empty())
+        {
+            return { 0, 0, 0 };
+        }
+        std::sort(values.begin(), values.end());
+        auto percentile = [&](double p) {
+            std::size_t index = static_cast<std::size_t>(std::ceil(p * values.size())) - 1;
+            return values[std::min(index, values.size() - 1)];
+        };
+        return { values.front(), percentile(0.5), percentile(0.95) };
+    }
+};
+
+struct benchmark_result
+{
+    std::string renderer;
+    std::vector<benchmark_sample> samples;
+
+    template <typename Member>
+    benchmark_statistics statistics(Member member) const
+    {
+        std::vector<double> values;
+        for (benchmark_sample const & sample : samples)
+        {
+            values.push_back(static_cast<double>(sample.*member));
+        }
+        return benchmark_statistics::compute(values);
+    }
+};
+
+inline double cpu_time()
+{
+    rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+// Resets the peak resident set size of the process so that it can be
+// measured per iteration. Only supported on Linux, elsewhere the peak
+// is the one of the whole process.
+inline void reset_peak_rss()
+{
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+}
+
+// Peak resident set size in bytes.
+inline std::size_t peak_rss()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            std::istringstream value(line.substr(6));
+            std::size_t kilobytes = 0;
+            value >> kilobytes;
+            return kilobytes * 1024;
+        }
+    }
+    rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+}
+
+// Renders the command the given number of times, encoding the output
+// into a counting stream so that disk writes are not part of the timing.
+template <typename Renderer>
+benchmark_result run_benchmark(renderer<Renderer> & ren, command const & cmd, std::size_t iterations)
+{
+    using clock = std::chrono::steady_clock;
+    benchmark_result result{ Renderer::name, {} };
+
+    for (std::size_t i = 0; i < iterations; i++)
+    {
+        counting_streambuf counter;
+        std::ostream stream(&counter);
+        reset_peak_rss();
+        double cpu_start = cpu_time();
+        clock::time_point start = clock::now();
+
+        ren.render(cmd, stream);
+
+        std::chrono::duration<double> wall_time = clock::now() - start;
+        result.samples.push_back({ wall_time.count(), cpu_time() - cpu_start,
+                                   peak_rss(), counter.size() });
+    }
+    return result;
+}
+
+inline void write_json(std::ostream & out, std::vector<benchmark_result> const & results)
+{
+    auto write_statistics = [&](char const * name, benchmark_statistics const & s) {
+        out << "\"" << name << "\":{\"min\":" << s.min << ",\"median\":" << s.median
+            << ",\"p95\":" << s.p95 << "}";
+    };
+
+    out << "[";
+    for (std::size_t i = 0; i < results.size(); i++)
+    {
+        benchmark_result const & result = results[i];
+        out << (i ? "," : "") << "\n{\"renderer\":\"" << result.renderer << "\""
+            << ",\"iterations\":" << result.samples.size() << ",";
+        write_statistics("wall_time", result.statistics(&benchmark_sample::wall_time));
+        out << ",";
+        write_statistics("cpu_time", result.statistics(&benchmark_sample::cpu_time));
+        out << ",";
+        write_statistics("peak_rss", result.statistics(&benchmark_sample::peak_rss));
+        out << ",";
+        write_statistics("output_bytes", result.statistics(&benchmark_sample::output_bytes));
+        out << "}";
+    }
+    out << "\n]\n";
+}
+
+inline void write_csv(std::ostream & out, std::vector<benchmark_result> const & results)
+{
+    out << "renderer,metric,iterations,min,median,p95\n";
+    for (benchmark_result const & result : results)
+    {
+        auto write_statistics = [&](char const * name, benchmark_statistics const & s) {
+            out << result.renderer << "," << name << "," << result.samples.size() << ","
+                << s.min << "," << s.median << "," << s.p95 << "\n";
+        };
+        write_statistics("wall_time", result.statistics(&benchmark_sample::wall_time));
+        write_statistics("cpu_time", result.statistics(&benchmark_sample::cpu_time));
+        write_statistics("peak_rss", result.statistics(&benchmark_sample::peak_rss));
+        write_statistics("output_bytes", result.statistics(&benchmark_sample::output_bytes));
+    }
+}
+
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+
+#include <boost/optional.hpp>
+
+#include <mapnik/map.hpp>
+
+#include "renderer.hpp"
+
+namespace mapnik_print
+{
+
+// Textual description of a print job: the command parameters, the
+// renderer to use and where to put the result.
+struct command_spec
+{
+    std::string map;
+    std::string renderer = "cairo-pdf";
+    std::string output;
+    std::string srs;
+    boost::optional<command::point_type> center;
+    boost::optional<map_size> size;
+    boost::optional<double> scale_denom;
+    boost::optional<unsigned> zoom;
+    double dpi = 300.0;
+
+    command to_command(std::string const & map_srs) const
+    {
+        if (!center)
+        {
+            throw std::runtime_error("Missing command parameter: center");
+        }
+        if (!size)
+        {
+            throw std::runtime_error("Missing command parameter: size");
+        }
+        if (!scale_denom)
+        {
+            throw std::runtime_error("Missing command parameter: scale");
+        }
+        if (!zoom)
+        {
+            throw std::runtime_error("Missing command parameter: zoom");
+        }
+        return command(srs.empty() ? map_srs : srs, *center, *size, *scale_denom, *zoom, dpi);
+    }
+};
+
+inline double parse_number(std::string const & key, std::string const & value)
+{
+    char * end = nullptr;
+    double number = std::strtod(value.c_str(), &end);
+    if (value.empty() || *end != '\0')
+    {
+        throw std::runtime_error("Invalid value of " + key + ": " + value);
+    }
+    return number;
+}
+
+inline double parse_positive(std::string const & key, std::string const & value)
+{
+    double number = parse_number(key, value);
+    if (!(number > 0) || !std::isfinite(number))
+    {
+        throw std::runtime_error("Invalid value of " + key + ", expected a positive number: " + value);
+    }
+    return number;
+}
+
+inline std::pair<double, double> parse_pair(std::string const & key, std::string const & value,
+                                            double (*parse)(std::string const &, std::string const &) = parse_number)
+{
+    std::string::size_type comma = value.find(',');
+    if (comma == std::string::npos)
+    {
+        throw std::runtime_error("Invalid value of " + key + ", expected x,y: " + value);
+    }
+    return { parse(key, value.substr(0, comma)),
+             parse(key, value.substr(comma + 1)) };
+}
+
+// Zoom levels beyond which the pixel size of scale_merc is not defined.
+constexpr unsigned max_zoom = 30;
+
+inline void set_command_parameter(command_spec & spec,
+                                  std::string const & key,
+                                  std::string const & value)
+{
+    if (key == "map")
+    {
+        spec.map = value;
+    }
+    else if (key == "renderer")
+    {
+        spec.renderer = value;
+    }
+    else if (key == "output")
+    {
+        spec.output = value;
+    }
+    else if (key == "srs")
+    {
+        spec.srs = value;
+    }
+    else if (key == "center")
+    {
+        std::pair<double, double> center(parse_pair(key, value));
+        if (!std::isfinite(center.first) || !std::isfinite(center.second))
+        {
+            throw std::runtime_error("Invalid value of " + key + ": " + value);
+        }
+        spec.center = command::point_type(center.first, center.second);
+    }
+    else if (key == "size")
+    {
+        std::pair<double, double> size(parse_pair(key, value, parse_positive));
+        spec.size = map_size{ size.first, size.second };
+    }
+    else if (key == "scale")
+    {
+        spec.scale_denom = parse_positive(key, value);
+    }
+    else if (key == "zoom")
+    {
+        double zoom = parse_number(key, value);
+        if (zoom < 0 || zoom > max_zoom || zoom != std::floor(zoom))
+        {
+            throw std::runtime_error("Invalid value of " + key + ", expected a level from 0 to " +
+                                     std::to_string(max_zoom) + ": " + value);
+        }
+        spec.zoom = static_cast<unsigned>(zoom);
+    }
+    else if (key == "dpi")
+    {
+        spec.dpi = parse_positive(key, value);
+    }
+    else
+    {
+        throw std::runtime_error("Unknown command parameter: " + key);
+    }
+}
+
+// Splits the line at whitespace, double quotes grouping whitespace into
+// a token and backslashes escaping the next character, as written by
+// quote_parameter.
+inline std::vector<std::string> split_parameters(std::string const & line)
+{
+    std::vector<std::string> tokens;
+    std::string token;
+    bool in_token = false;
+    bool quoted = false;
+    for (std::size_t i = 0; i < line.size(); i++)
+    {
+        char c = line[i];
+        if (c == '\\' && i + 1 < line.size())
+        {
+            token.push_back(line[++i]);
+            in_token = true;
+        }
+        else if (c == '"')
+        {
+            quoted = !quoted;
+            in_token = true;
+        }
+        else if (!quoted && std::isspace(static_cast<unsigned char>(c)))
+        {
+            if (in_token)
+            {
+                tokens.push_back(token);
+                token.clear();
+                in_token = false;
+            }
+        }
+        else
+        {
+            token.push_back(c);
+            in_token = true;
+        }
+    }
+    if (quoted)
+    {
+        throw std::runtime_error("Unterminated quote in parameters: " + line);
+    }
+    if (in_token)
+    {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+// Token of the parameter as split_parameters reads it back, quoted when
+// the value has whitespace, quotes or backslashes.
+inline std::string quote_parameter(std::string const & token)
+{
+    if (token.find_first_of(" \t\r\n\"\\") == std::string::npos)
+    {
+        return token;
+    }
+    std::string quoted("\"");
+    for (char c : token)
+    {
+        if (c == '"' || c == '\\')
+        {
+            quoted.push_back('\\');
+        }
+        quoted.push_back(c);
+    }
+    return quoted + "\"";
+}
+
+// Parses whitespace separated key=value pairs on top of the defaults,
+// e.g. "center=1823000,6140000 size=0.42,0.297 scale=25000 zoom=15".
+// Values with whitespace are quoted: srs="+proj=merc +datum=WGS84".
+inline command_spec parse_command_spec(std::string const & line,
+                                       command_spec const & defaults)
+{
+    command_spec spec(defaults);
+    for (std::string const & token : split_parameters(line))
+    {
+        std::string::size_type equals = token.find('=');
+        if (equals == std::string::npos)
+        {
+            throw std::runtime_error("Invalid command parameter, expected key=value: " + token);
+        }
+        set_command_parameter(spec, token.substr(0, equals), token.substr(equals + 1));
+    }
+    return spec;
+}
+
+// Parameters reproducing the command of the spec, in full precision and
+// without its output.
+inline std::string format_command_spec(command_spec const & spec)
+{
+    std::ostringstream line;
+    line << std::setprecision(17);
+    if (!spec.map.empty())
+    {
+        line << quote_parameter("map=" + spec.map) << " ";
+    }
+    line << "renderer=" << spec.renderer;
+    if (!spec.srs.empty())
+    {
+        line << " " << quote_parameter("srs=" + spec.srs);
+    }
+    if (spec.center)
+    {
+        line << " center=" << spec.center->x << "," << spec.center->y;
+    }
+    if (spec.size)
+    {
+        line << " size=" << spec.size->width << "," << spec.size->height;
+    }
+    if (spec.scale_denom)
+    {
+        line << " scale=" << *spec.scale_denom;
+    }
+    if (spec.zoom)
+    {
+        line << " zoom=" << *spec.zoom;
+    }
+    line << " dpi=" << spec.dpi;
+    return line.str();
+}
+
+// Map of the given name, which may be omitted when there is only one.
+inline shared_map const & find_map(std::map<std::string, shared_map> const & maps,
+                                   std::string const & name)
+{
+    if (name.empty() && maps.size() == 1)
+    {
+        return maps.begin()->second;
+    }
+    auto it = maps.find(name);
+    if (it == maps.end())
+    {
+        throw std::runtime_error("Unknown map: " + name);
+    }
+    return it->second;
+}
+
+}
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include <zlib.h>
+
+#include <mapnik/image.hpp>
+
+#include "renderer.hpp"
+#include "command_spec.hpp"
+#include "net.hpp"
+#include "output.hpp"
+#include "png_writer.hpp"
+#include "tiling.hpp"
+
+namespace mapnik_print
+{
+
+// Area of a command image rendered by a remote worker. The coordinator
+// sends the overlap along, so that every worker renders the tile the
+// same way whatever its own settings.
+struct tile_region
+{
+    unsigned x, y, width, height;
+    unsigned overlap;
+};
+
+// Parses x,y,width,height.
+inline tile_region parse_tile_region(std::string const & value, unsigned overlap)
+{
+    std::istringstream fields(value);
+    tile_region region;
+    char comma1, comma2, comma3;
+    if (!(fields >> region.x >> comma1 >> region.y >> comma2 >> region.width >> comma3 >> region.height) ||
+        comma1 != ',' || comma2 != ',' || comma3 != ',' || !fields.eof() ||
+        region.width == 0 || region.height == 0)
+    {
+        throw std::runtime_error("Invalid value of tile, expected x,y,width,height: " + value);
+    }
+    region.overlap = overlap;
+    return region;
+}
+
+// Writes the tile area of an image rendered over the tile render area as
+// "TILE <width> <height> <size>\n" followed by size bytes of its straight
+// alpha RGBA rows, deflate compressed.
+inline void write_tile(mapnik::image_rgba8 const & image, tile const & t, std::ostream & stream)
+{
+    std::size_t row_size = std::size_t(t.width) * png_detail::bytes_per_pixel;
+    std::vector<std::uint8_t> pixels(row_size * t.height);
+    for (unsigned row = 0; row < t.height; row++)
+    {
+        png_detail::row_ref ref{ reinterpret_cast<std::uint8_t const *>(
+                                     image.get_row(t.y - t.render_y + row) + (t.x - t.render_x)),
+                                 image.get_premultiplied() };
+        png_detail::load_row(ref, pixels.data() + row * row_size, row_size);
+    }
+    uLongf size = ::compressBound(pixels.size());
+    std::vector<char> data(size);
+    if (::compress2(reinterpret_cast<Bytef *>(data.data()), &size, pixels.data(), pixels.size(),
+                    Z_BEST_SPEED) != Z_OK)
+    {
+        throw std::runtime_error("Cannot compress tile");
+    }
+    stream << "TILE " << t.width << " " << t.height << " " << size << "\n";
+    stream.write(data.data(), size);
+}
+
+struct distributed_options
+{
+    // Addresses of the render servers, see listen_socket.
+    std::vector<std::string> workers;
+    // Tiles each worker renders at the same time.
+    unsigned connections = 2;
+    unsigned tile_size = 2048;
+    // At a scale factor of one, see scaled_overlap.
+    unsigned overlap = 256;
+    // Attempts of a tile before the render fails. A worker failing that
+    // many times in a row is no longer sent tiles.
+    unsigned max_attempts = 3;
+    // Seconds without progress after which a tile request fails, zero
+    // for never.
+    double timeout = 600;
+    // Rows of tiles held in memory ahead of the one being encoded, each
+    // taking the full output width.
+    unsigned max_bands = 4;
+};
+
+// Renders a raster command on remote render servers: its image is split
+// into tiles rendered by the workers, which are stitched into rows of
+// tiles as they come and encoded into a PNG streamed in row order. The
+// tiles of a failing worker go to the others.
+//
+// The workers must have the map loaded under the same name, with the
+// same data.
+template <typename Renderer>
+void render_distributed(shared_map const & map, command_spec const & spec, std::ostream & stream,
+                        distributed_options const & options, png_options const & png = png_options(),
+                        render_listener * listener = nullptr)
+{
+    static_assert(Renderer::support_tiles, "Renderer does not support tiles");
+
+    if (options.workers.empty())
+    {
+        throw std::runtime_error("No worker to render on");
+    }
+    if (options.tile_size == 0)
+    {
+        throw std::runtime_error("Tile size must not be zero");
+    }
+    command cmd(spec.to_command(map->srs()));
+    map_view view(renderer<Renderer>(map).view(cmd));
+    unsigned width = view.req.width();
+    unsigned height = view.req.height();
+    // Workers are sent the overlap in pixels, scaled here once.
+    unsigned overlap = scaled_overlap(*map, view.scale_factor, options.overlap);
+    std::vector<tile> tiles(split_tiles(width, height, options.tile_size, overlap));
+    std::size_t tiles_per_band = (width + options.tile_size - 1) / options.tile_size;
+    std::size_t band_count = (height + options.tile_size - 1) / options.tile_size;
+    std::string parameters(format_command_spec(spec));
+
+    struct band
+    {
+        mapnik::image_rgba8 image;
+        std::size_t remaining;
+    };
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::size_t> queue;
+    std::vector<unsigned> attempts(tiles.size(), 0);
+    std::vector<band> bands(band_count);
+    std::size_t next_band = 0;
+    std::size_t active = 0;
+    std::exception_ptr error;
+
+    for (std::size_t i = 0; i < tiles.size(); i++)
+    {
+        queue.push_back(i);
+    }
+    for (std::size_t b = 0; b < band_count; b++)
+    {
+        bands[b].remaining = std::min(tiles_per_band, tiles.size() - b * tiles_per_band);
+    }
+
+    // Renders the tile on the worker and stitches it into its band.
+    auto fetch = [&](std::string const & address, tile const & t, mapnik::image_rgba8 & image) {
+        int fd = connect_socket(address, options.timeout);
+        output_stream connection(fd, true);
+        connection << parameters << " tile=" << t.x << "," << t.y << "," << t.width << "," << t.height
+                   << " overlap=" << overlap << "\n";
+        if (!connection.flush())
+        {
+            throw std::runtime_error("Cannot send tile request to " + address);
+        }
+        std::istringstream header(read_line(fd, 4096));
+        std::string word;
+        header >> word;
+        if (word != "TILE")
+        {
+            std::string message;
+            std::getline(header, message);
+            throw std::runtime_error(address + ":" + (message.empty() ? " Unexpected answer" : message));
+        }
+        unsigned tile_width = 0, tile_height = 0;
+        std::size_t size = 0;
+        header >> tile_width >> tile_height >> size;
+        if (tile_width != t.width || tile_height != t.height)
+        {
+            throw std::runtime_error(address + ": Tile of unexpected size");
+        }
+        std::vector<char> data(size);
+        read_exact(fd, data.data(), size);
+
+        std::size_t row_size = std::size_t(t.width) * png_detail::bytes_per_pixel;
+        std::vector<std::uint8_t> pixels(row_size * t.height);
+        uLongf length = pixels.size();
+        if (::uncompress(pixels.data(), &length, reinterpret_cast<Bytef const *>(data.data()), size) != Z_OK ||
+            length != pixels.size())
+        {
+            throw std::runtime_error(address + ": Invalid tile data");
+        }
+        unsigned band_y = t.y - t.y % options.tile_size;
+        for (unsigned row = 0; row < t.height; row++)
+        {
+            std::memcpy(image.get_row(t.y - band_y + row) + t.x, pixels.data() + row * row_size, row_size);
+        }
+    };
+
+    auto work = [&](std::string const & address) {
+        unsigned failures = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            condition.wait(lock, [&] {
+                return error || next_band == band_count ||
+                    (!queue.empty() && queue.front() / tiles_per_band < next_band + options.max_bands);
+            });
+            if (error || next_band == band_count)
+            {
+                break;
+            }
+            std::size_t i = queue.front();
+            queue.pop_front();
+            band & b = bands[i / tiles_per_band];
+            if (b.image.width() == 0)
+            {
+                tile const & first = tiles[i - i % tiles_per_band];
+                b.image = mapnik::image_rgba8(width, first.height);
+            }
+            lock.unlock();
+            try
+            {
+                fetch(address, tiles[i], b.image);
+                lock.lock();
+                failures = 0;
+                b.remaining--;
+            }
+            catch (std::exception const & e)
+            {
+                lock.lock();
+                std::clog << "Warning: tile " << tiles[i].x << "," << tiles[i].y << ": " << e.what() << std::endl;
+                if (listener)
+                {
+                    listener->counter("tile_failures", 1);
+                }
+                if (++attempts[i] >= options.max_attempts)
+                {
+                    error = std::make_exception_ptr(std::runtime_error(
+                        "Cannot render tile " + std::to_string(tiles[i].x) + "," +
+                        std::to_string(tiles[i].y) + ": " + e.what()));
+                }
+                else
+                {
+                    queue.push_front(i);
+                }
+                if (++failures >= options.max_attempts)
+                {
+                    std::clog << "Warning: no more tiles for " << address << std::endl;
+                    if (--active == 0 && !error)
+                    {
+                        error = std::make_exception_ptr(std::runtime_error("No worker left"));
+                    }
+                    condition.notify_all();
+                    return;
+                }
+                condition.notify_all();
+                // Other workers take the tile meanwhile.
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::seconds(failures));
+                lock.lock();
+                continue;
+            }
+            condition.notify_all();
+        }
+        active--;
+    };
+
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        active = options.workers.size() * std::max(1u, options.connections);
+    }
+    for (std::string const & address : options.workers)
+    {
+        for (unsigned i = 0; i < std::max(1u, options.connections); i++)
+        {
+            threads.emplace_back(work, address);
+        }
+    }
+
+    try
+    {
+        render_stage stage(listener, "render");
+        png_encoder encoder(stream, width, height, png);
+        for (std::size_t b = 0; b < band_count; b++)
+        {
+            mapnik::image_rgba8 image;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&] { return error || bands[b].remaining == 0; });
+                if (error)
+                {
+                    std::rethrow_exception(error);
+                }
+                image = std::move(bands[b].image);
+            }
+            encoder.add_rows(image, 0, image.height());
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                next_band++;
+            }
+            condition.notify_all();
+        }
+        encoder.finish();
+    }
+    catch (...)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+        condition.notify_all();
+        for (std::thread & thread : threads)
+        {
+            thread.join();
+        }
+        throw;
+    }
+    for (std::thread & thread : threads)
+    {
+        thread.join();
+    }
+}
+
+}
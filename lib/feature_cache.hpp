@@ -0,0 +1,417 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
+
+#include <mapnik/map.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/datasource.hpp>
+#include <mapnik/feature.hpp>
+#include <mapnik/query.hpp>
+
+namespace mapnik_print
+{
+
+struct feature_cache_options
+{
+    // Features kept in memory over all layers.
+    std::size_t max_features = 1000000;
+    // Seconds after which cached features are queried again, zero for
+    // never.
+    double ttl = 0;
+    // Queries partly covered by the cache fetch only the area it misses.
+    // Features of several queries are then told apart by their id, which
+    // the datasources must keep stable across queries: PostGIS layers need
+    // a key field, and CSV, GeoJSON or filtered shapefile ids are not.
+    bool partial = false;
+    // Missing areas beyond which the whole query is sent again.
+    std::size_t max_pieces = 16;
+};
+
+// Featureset iterating features read before.
+class feature_list_featureset : public mapnik::Featureset
+{
+    const std::shared_ptr<const std::vector<mapnik::feature_ptr>> features;
+    std::size_t position = 0;
+
+public:
+    explicit feature_list_featureset(std::shared_ptr<const std::vector<mapnik::feature_ptr>> const & features)
+        : features(features)
+    {
+    }
+
+    mapnik::feature_ptr next() override
+    {
+        return position < features->size() ? (*features)[position++] : mapnik::feature_ptr();
+    }
+};
+
+// Parts of a box outside of another, at most four.
+inline std::vector<mapnik::box2d<double>> subtract(mapnik::box2d<double> const & box,
+                                                   mapnik::box2d<double> const & hole)
+{
+    if (!box.intersects(hole))
+    {
+        return { box };
+    }
+    mapnik::box2d<double> inner(box.intersect(hole));
+    std::vector<mapnik::box2d<double>> pieces;
+    auto add = [&](double minx, double miny, double maxx, double maxy) {
+        if (minx < maxx && miny < maxy)
+        {
+            pieces.emplace_back(minx, miny, maxx, maxy);
+        }
+    };
+    add(box.minx(), box.miny(), box.maxx(), inner.miny());
+    add(box.minx(), inner.maxy(), box.maxx(), box.maxy());
+    add(box.minx(), inner.miny(), inner.minx(), inner.maxy());
+    add(inner.maxx(), inner.miny(), box.maxx(), inner.maxy());
+    return pieces;
+}
+
+// Features of recent queries shared by the datasources of all layers,
+// the least recently used being dropped beyond the feature limit.
+//
+// Queries are cached per layer and per resolution level, a power of two
+// of the query resolution, since datasources may simplify geometries to
+// the resolution, as well as per scale denominator, filter factor and
+// variables, which datasources may use to select the features (such as
+// the !scale_denominator! token of PostGIS queries). The data the
+// datasources read is not watched: the cache must be invalidated when it
+// changes or be given a time to live.
+class feature_cache
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using feature_list = std::shared_ptr<const std::vector<mapnik::feature_ptr>>;
+
+    struct entry
+    {
+        std::size_t source;
+        std::string layer;
+        long level;
+        double scale_denom;
+        double filter_factor;
+        std::string variables;
+        mapnik::box2d<double> bbox;
+        std::set<std::string> property_names;
+        feature_list features;
+        clock::time_point created;
+    };
+
+private:
+    const feature_cache_options options;
+    std::mutex mutex;
+    // Least recently used first.
+    std::list<entry> entries;
+    std::size_t total_features = 0;
+    std::atomic<std::size_t> next_source{ 0 };
+
+public:
+    explicit feature_cache(feature_cache_options const & options)
+        : options(options)
+    {
+    }
+
+    feature_cache_options const & get_options() const
+    {
+        return options;
+    }
+
+    std::size_t new_source()
+    {
+        return next_source++;
+    }
+
+    static long resolution_level(mapnik::query const & q)
+    {
+        return std::lround(std::log2(std::get<0>(q.resolution())));
+    }
+
+    // Variables of the query as the datasources substitute them, as text.
+    static std::string variables_key(mapnik::query const & q)
+    {
+        std::map<std::string, mapnik::value> sorted(q.variables().begin(), q.variables().end());
+        std::string key;
+        for (auto const & variable : sorted)
+        {
+            std::string value(variable.second.to_string());
+            key += std::to_string(variable.first.size()) + ":" + variable.first +
+                   std::to_string(value.size()) + ":" + value;
+        }
+        return key;
+    }
+
+    // Entries of the source for the query parameters intersecting the box
+    // with at least the given properties, most recently used first.
+    std::vector<entry> find(std::size_t source, long level, double scale_denom, double filter_factor,
+                            std::string const & variables, mapnik::box2d<double> const & bbox,
+                            std::set<std::string> const & property_names)
+    {
+        std::vector<std::list<entry>::iterator> matches;
+        clock::time_point now = clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = entries.begin(); it != entries.end();)
+        {
+            auto current = it++;
+            if (expired(*current, now))
+            {
+                remove(current);
+            }
+            else if (current->source == source && current->level == level &&
+                     current->scale_denom == scale_denom && current->filter_factor == filter_factor &&
+                     current->variables == variables &&
+                     current->bbox.intersects(bbox) &&
+                     std::includes(current->property_names.begin(), current->property_names.end(),
+                                   property_names.begin(), property_names.end()))
+            {
+                matches.push_back(current);
+            }
+        }
+        std::vector<entry> found;
+        for (auto it = matches.rbegin(); it != matches.rend(); ++it)
+        {
+            found.push_back(**it);
+        }
+        for (auto match : matches)
+        {
+            entries.splice(entries.end(), entries, match);
+        }
+        return found;
+    }
+
+    void insert(entry e)
+    {
+        if (e.features->size() > options.max_features)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        total_features += e.features->size();
+        entries.push_back(std::move(e));
+        while (total_features > options.max_features)
+        {
+            remove(entries.begin());
+        }
+    }
+
+    void invalidate()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        total_features = 0;
+    }
+
+    // Drops the entries of the layers of that name in every map.
+    void invalidate(std::string const & layer)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = entries.begin(); it != entries.end();)
+        {
+            auto current = it++;
+            if (current->layer == layer)
+            {
+                remove(current);
+            }
+        }
+    }
+
+    std::size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return total_features;
+    }
+
+private:
+    bool expired(entry const & e, clock::time_point now) const
+    {
+        return options.ttl > 0 && std::chrono::duration<double>(now - e.created).count() > options.ttl;
+    }
+
+    void remove(std::list<entry>::iterator it)
+    {
+        total_features -= it->features->size();
+        entries.erase(it);
+    }
+};
+
+// Vector datasource proxy answering queries from the feature cache,
+// fetching only the parts of the query box it does not cover.
+class cached_datasource : public mapnik::datasource
+{
+    const mapnik::datasource_ptr ds;
+    feature_cache & cache;
+    const std::size_t source;
+    const std::string layer_name;
+
+public:
+    cached_datasource(mapnik::datasource_ptr const & ds, feature_cache & cache, std::string const & layer_name)
+        : mapnik::datasource(ds->params()), ds(ds), cache(cache), source(cache.new_source()),
+          layer_name(layer_name)
+    {
+    }
+
+    datasource_t type() const override
+    {
+        return ds->type();
+    }
+
+    mapnik::featureset_ptr features(mapnik::query const & q) const override
+    {
+        return query(q, [&](mapnik::query const & piece) { return ds->features(piece); });
+    }
+
+    mapnik::featureset_ptr features_with_context(mapnik::query const & q,
+                                                 mapnik::processor_context_ptr ctx) const override
+    {
+        return query(q, [&](mapnik::query const & piece) { return ds->features_with_context(piece, ctx); });
+    }
+
+    mapnik::processor_context_ptr get_context(mapnik::feature_style_context_map & ctx) const override
+    {
+        return ds->get_context(ctx);
+    }
+
+    mapnik::featureset_ptr features_at_point(mapnik::coord2d const & pt, double tol) const override
+    {
+        return ds->features_at_point(pt, tol);
+    }
+
+    mapnik::box2d<double> envelope() const override
+    {
+        return ds->envelope();
+    }
+
+    boost::optional<mapnik::datasource_geometry_t> get_geometry_type() const override
+    {
+        return ds->get_geometry_type();
+    }
+
+    mapnik::layer_descriptor get_descriptor() const override
+    {
+        return ds->get_descriptor();
+    }
+
+private:
+    template <typename Fetch>
+    mapnik::featureset_ptr query(mapnik::query const & q, Fetch fetch) const
+    {
+        feature_cache_options const & options = cache.get_options();
+        mapnik::box2d<double> const & bbox = q.get_bbox();
+        long level = feature_cache::resolution_level(q);
+        double filter_factor = q.get_filter_factor();
+        std::string variables(feature_cache::variables_key(q));
+        std::vector<feature_cache::entry> found(
+            cache.find(source, level, q.scale_denominator(), filter_factor, variables, bbox, q.property_names()));
+        if (!options.partial)
+        {
+            // Only features of one query can be told apart.
+            auto covering = std::find_if(found.begin(), found.end(), [&](feature_cache::entry const & e) {
+                return e.bbox.contains(bbox);
+            });
+            if (covering != found.end())
+            {
+                found = { *covering };
+            }
+            else
+            {
+                found.clear();
+            }
+        }
+
+        std::vector<mapnik::box2d<double>> missing{ bbox };
+        for (feature_cache::entry const & e : found)
+        {
+            std::vector<mapnik::box2d<double>> remaining;
+            for (mapnik::box2d<double> const & piece : missing)
+            {
+                for (mapnik::box2d<double> const & rest : subtract(piece, e.bbox))
+                {
+                    remaining.push_back(rest);
+                }
+            }
+            missing.swap(remaining);
+        }
+        if (!missing.empty() && (!options.partial || missing.size() > options.max_pieces))
+        {
+            found.clear();
+            missing = { bbox };
+        }
+
+        std::vector<feature_cache::feature_list> parts;
+        for (feature_cache::entry const & e : found)
+        {
+            parts.push_back(e.features);
+        }
+        for (mapnik::box2d<double> const & piece : missing)
+        {
+            mapnik::query piece_query(piece, q.resolution(), q.scale_denominator(), q.get_unbuffered_bbox());
+            for (std::string const & name : q.property_names())
+            {
+                piece_query.add_property_name(name);
+            }
+            piece_query.set_filter_factor(q.get_filter_factor());
+            piece_query.set_variables(q.variables());
+
+            auto features = std::make_shared<std::vector<mapnik::feature_ptr>>();
+            mapnik::featureset_ptr fs(fetch(piece_query));
+            if (fs)
+            {
+                while (mapnik::feature_ptr feature = fs->next())
+                {
+                    features->push_back(feature);
+                }
+            }
+            cache.insert({ source, layer_name, level, q.scale_denominator(), filter_factor, variables, piece,
+                           q.property_names(), features, feature_cache::clock::now() });
+            parts.push_back(features);
+        }
+
+        if (found.empty() && missing.size() == 1)
+        {
+            return std::make_shared<feature_list_featureset>(parts.front());
+        }
+
+        // Features overlapping several parts are returned once.
+        auto features = std::make_shared<std::vector<mapnik::feature_ptr>>();
+        std::unordered_set<mapnik::value_integer> ids;
+        for (feature_cache::feature_list const & part : parts)
+        {
+            for (mapnik::feature_ptr const & feature : *part)
+            {
+                if (feature->envelope().intersects(bbox) &&
+                    (parts.size() == 1 || ids.insert(feature->id()).second))
+                {
+                    features->push_back(feature);
+                }
+            }
+        }
+        return std::make_shared<feature_list_featureset>(features);
+    }
+};
+
+// Wraps the vector datasources of the map layers to share the features
+// they read through the cache.
+inline void cache_features(mapnik::Map & map, feature_cache & cache)
+{
+    for (mapnik::layer & lyr : map.layers())
+    {
+        if (lyr.datasource() && lyr.datasource()->type() == mapnik::datasource::Vector)
+        {
+            lyr.set_datasource(std::make_shared<cached_datasource>(lyr.datasource(), cache, lyr.name()));
+        }
+    }
+}
+
+}
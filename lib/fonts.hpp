@@ -0,0 +1,98 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+#include <mapnik/map.hpp>
+#include <mapnik/rule.hpp>
+#include <mapnik/symbolizer.hpp>
+#include <mapnik/feature_type_style.hpp>
+#include <mapnik/font_engine_freetype.hpp>
+#include <mapnik/font_set.hpp>
+#include <mapnik/text/placements/base.hpp>
+
+namespace mapnik_print
+{
+
+// Registers the fonts of the directory and its subdirectories with the
+// global font engine, returns whether any font was found.
+inline bool register_fonts(std::string const & directory)
+{
+    mapnik::freetype_engine::register_fonts(directory, true);
+    return !mapnik::freetype_engine::face_names().empty();
+}
+
+// Face names the text and shield symbolizers of the map and its font
+// sets may use.
+inline std::set<std::string> referenced_faces(mapnik::Map const & map)
+{
+    std::set<std::string> faces;
+    for (auto const & fontset : map.fontsets())
+    {
+        for (std::string const & face : fontset.second.get_face_names())
+        {
+            faces.insert(face);
+        }
+    }
+    for (auto const & style : map.styles())
+    {
+        for (mapnik::rule const & r : style.second.get_rules())
+        {
+            for (mapnik::symbolizer const & sym : r)
+            {
+                mapnik::util::apply_visitor([&](auto const & s) {
+                    using symbolizer_type = typename std::decay<decltype(s)>::type;
+                    if constexpr (std::is_base_of<mapnik::text_symbolizer, symbolizer_type>::value)
+                    {
+                        auto placements(mapnik::get<mapnik::text_placements_ptr>(s, mapnik::keys::text_placements_));
+                        if (!placements)
+                        {
+                            return;
+                        }
+                        mapnik::format_properties const & format = placements->defaults.format_defaults;
+                        if (!format.face_name.empty())
+                        {
+                            faces.insert(format.face_name);
+                        }
+                        if (format.fontset)
+                        {
+                            for (std::string const & face : format.fontset->get_face_names())
+                            {
+                                faces.insert(face);
+                            }
+                        }
+                    }
+                }, sym);
+            }
+        }
+    }
+    return faces;
+}
+
+// Loads the font files the map references into the font engine memory
+// cache and opens their faces once, so that renderers create faces from
+// memory instead of reading font files on their first text. Returns the
+// faces which cannot be opened.
+//
+// The memory cache is global: when loaded before forking worker
+// processes, its pages are shared by all workers.
+inline std::vector<std::string> warm_fonts(mapnik::Map & map)
+{
+    map.load_fonts();
+    mapnik::font_library library;
+    mapnik::face_manager_freetype face_manager(library, map.get_font_file_mapping(),
+                                               map.get_font_memory_cache());
+    std::vector<std::string> missing;
+    for (std::string const & face : referenced_faces(map))
+    {
+        if (!face_manager.get_face(face))
+        {
+            missing.push_back(face);
+        }
+    }
+    return missing;
+}
+
+}
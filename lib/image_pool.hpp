@@ -0,0 +1,93 @@
+#pragma once
+
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <cstring>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include <mapnik/image.hpp>
+
+namespace mapnik_print
+{
+
+// Images of finished renders kept for the next renders of the same size,
+// so that long running processes do not allocate and free page sized
+// buffers for every job. The least recently released images are freed
+// beyond the size limit.
+class image_pool
+{
+    const std::size_t max_size;
+    std::mutex mutex;
+    // Least recently released first.
+    std::list<mapnik::image_rgba8> images;
+    std::size_t total_size = 0;
+
+public:
+    explicit image_pool(std::size_t max_size)
+        : max_size(max_size)
+    {
+    }
+
+    // Bytes of the images the pool may hold.
+    std::size_t capacity() const
+    {
+        return max_size;
+    }
+
+    // Transparent image of the given size.
+    mapnik::image_rgba8 acquire(unsigned width, unsigned height)
+    {
+        mapnik::image_rgba8 image;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = images.rbegin(); it != images.rend(); ++it)
+            {
+                if (it->width() == width && it->height() == height)
+                {
+                    image = std::move(*it);
+                    images.erase(std::next(it).base());
+                    total_size -= image.size();
+                    break;
+                }
+            }
+        }
+        if (image.width() != width || image.height() != height)
+        {
+            return mapnik::image_rgba8(width, height);
+        }
+        std::memset(image.bytes(), 0, image.size());
+        image.set_premultiplied(false);
+        return image;
+    }
+
+    void release(mapnik::image_rgba8 && image)
+    {
+        if (image.size() > max_size)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        total_size += image.size();
+        images.push_back(std::move(image));
+        while (total_size > max_size)
+        {
+            total_size -= images.front().size();
+            images.pop_front();
+        }
+    }
+};
+
+// Returns the free memory at the top of the heaps to the system, so that
+// the resident size of a long running process follows its live memory.
+inline void release_free_memory()
+{
+#if defined(__GLIBC__)
+    ::malloc_trim(0);
+#endif
+}
+
+}
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include <mapnik/map.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/image.hpp>
+#include <mapnik/image_util.hpp>
+#include <mapnik/image_compositing.hpp>
+#include <mapnik/agg_renderer.hpp>
+#include <mapnik/projection.hpp>
+#include <mapnik/scale_denominator.hpp>
+
+#include "renderer.hpp"
+#include "tiling.hpp"
+
+namespace mapnik_print
+{
+
+// Offset in pixels of a view from a kept one of the same size: set if
+// the view is panned by whole pixels at the same scale and overlaps the
+// kept one.
+inline bool pan_offset(mapnik::box2d<double> const & kept, mapnik::box2d<double> const & extent,
+                       unsigned width, unsigned height, long & ox, long & oy)
+{
+    double pixel_size = extent.width() / width;
+    double kept_pixel_size = kept.width() / width;
+    double dx = (extent.minx() - kept.minx()) / pixel_size;
+    double dy = (kept.maxy() - extent.maxy()) / pixel_size;
+    ox = std::lround(dx);
+    oy = std::lround(dy);
+    return std::abs(pixel_size - kept_pixel_size) < 1e-9 * pixel_size &&
+           std::abs(dx - ox) < 1e-3 && std::abs(dy - oy) < 1e-3 &&
+           std::abs(ox) < long(width) && std::abs(oy) < long(height);
+}
+
+// Image moved by the offset, its pixel (x, y) being the pixel
+// (x + ox, y + oy) of the source, the exposed pixels cleared.
+inline mapnik::image_rgba8 pan_image(mapnik::image_rgba8 const & source, long ox, long oy)
+{
+    unsigned width = source.width();
+    unsigned height = source.height();
+    mapnik::image_rgba8 image(width, height);
+    image.set_premultiplied(source.get_premultiplied());
+    unsigned first_row = static_cast<unsigned>(std::max(0l, -oy));
+    unsigned last_row = static_cast<unsigned>(std::min(long(height), long(height) - oy));
+    unsigned first_column = static_cast<unsigned>(std::max(0l, -ox));
+    unsigned last_column = static_cast<unsigned>(std::min(long(width), long(width) - ox));
+    for (unsigned y = first_row; y < last_row; y++)
+    {
+        std::memcpy(image.get_row(y) + first_column, source.get_row(y + oy) + (first_column + ox),
+                    (last_column - first_column) * mapnik::image_rgba8::pixel_size);
+    }
+    return image;
+}
+
+// Areas of an image which moving it by the offset exposes: full width
+// rows above or below, then the columns on the side within the remaining
+// rows.
+inline std::vector<tile> exposed_tiles(unsigned width, unsigned height, long ox, long oy)
+{
+    unsigned first_row = static_cast<unsigned>(std::max(0l, -oy));
+    unsigned last_row = static_cast<unsigned>(std::min(long(height), long(height) - oy));
+    unsigned first_column = static_cast<unsigned>(std::max(0l, -ox));
+    unsigned last_column = static_cast<unsigned>(std::min(long(width), long(width) - ox));
+    std::vector<tile> exposed;
+    if (first_row > 0)
+    {
+        exposed.push_back(make_tile(width, height, 0, 0, width, first_row, 0));
+    }
+    if (last_row < height)
+    {
+        exposed.push_back(make_tile(width, height, 0, last_row, width, height - last_row, 0));
+    }
+    if (first_column > 0)
+    {
+        exposed.push_back(make_tile(width, height, 0, first_row, first_column, last_row - first_row, 0));
+    }
+    if (last_column < width)
+    {
+        exposed.push_back(make_tile(width, height, last_column, first_row,
+                                    width - last_column, last_row - first_row, 0));
+    }
+    return exposed;
+}
+
+// Raster renderer of successive views of one map, as an editor exports
+// them, keeping the image of every layer which renders independently
+// (see renders_independently) for the next view. Layers of the same view
+// are composited again without rendering, so that toggling a layer only
+// renders the layers placing symbols, which have to avoid each other.
+// Views panned by whole pixels at the same scale translate the kept
+// images and render only the newly exposed areas.
+//
+// The kept images take the size of the view for each layer, up to
+// max_bytes over all layers: beyond, the images of the layers the view
+// did not draw and then of the topmost layers are dropped. The data of
+// the layers is not watched: invalidate when it changes.
+class incremental_renderer
+{
+    struct view_key
+    {
+        unsigned width = 0, height = 0;
+        mapnik::box2d<double> extent;
+        double scale_factor = 0;
+    };
+
+    struct layer_image
+    {
+        view_key key;
+        mapnik::image_rgba8 image;
+    };
+
+    const shared_map map;
+    // Zero for no limit.
+    const std::size_t max_bytes;
+    render_listener * listener = nullptr;
+    std::vector<layer_image> layers;
+    std::atomic<std::size_t> bytes{ 0 };
+
+public:
+    explicit incremental_renderer(shared_map const & map, std::size_t max_bytes = 0)
+        : map(map), max_bytes(max_bytes), layers(map->layers().size())
+    {
+    }
+
+    // Bytes of the kept images once the last render returned.
+    std::size_t kept_bytes() const
+    {
+        return bytes;
+    }
+
+    void set_listener(render_listener * render_listener)
+    {
+        listener = render_listener;
+    }
+
+    void invalidate()
+    {
+        layers.assign(map->layers().size(), layer_image());
+        bytes = 0;
+    }
+
+    // Renders the command without the hidden layers.
+    mapnik::image_rgba8 render(command const & cmd, std::set<std::string> const & hidden = {})
+    {
+        map_view view(renderer<agg_renderer>(map).view(cmd));
+        mapnik::request const & req = view.req;
+        view_key key{ req.width(), req.height(), req.extent(), view.scale_factor };
+
+        mapnik::projection proj(map->srs(), true);
+        double scale_denom = mapnik::scale_denominator(req.scale(), proj.is_geographic()) * view.scale_factor;
+        std::set<std::string> names;
+        mapnik::image_rgba8 image(req.width(), req.height());
+        mapnik::attributes vars;
+        mapnik::agg_renderer<mapnik::image_rgba8> ren(*map, req, vars, image, view.scale_factor);
+        render_stage stage(listener, "render");
+        std::vector<bool> drawn(layers.size(), false);
+        ren.start_map_processing(*map);
+        for (std::size_t i = 0; i < layers.size(); i++)
+        {
+            mapnik::layer const & lyr = map->layers()[i];
+            if (hidden.count(lyr.name()) || !layer_contributes(*map, lyr, req, scale_denom))
+            {
+                continue;
+            }
+            if (!renders_independently(*map, lyr))
+            {
+                render_layer(ren, *map, lyr, proj, req, scale_denom, names, listener);
+                continue;
+            }
+            update(layers[i], lyr, view, key);
+            drawn[i] = true;
+            if (listener)
+            {
+                listener->layer_begin(lyr);
+            }
+            mapnik::composite(image, layers[i].image, mapnik::src_over);
+            if (listener)
+            {
+                listener->layer_end(lyr);
+            }
+        }
+        ren.end_map_processing(*map);
+        trim(drawn);
+        return image;
+    }
+
+private:
+    void trim(std::vector<bool> const & drawn)
+    {
+        std::size_t total = 0;
+        for (layer_image const & kept : layers)
+        {
+            total += kept.image.size();
+        }
+        for (bool drop_drawn : { false, true })
+        {
+            for (std::size_t i = layers.size(); i-- > 0 && max_bytes > 0 && total > max_bytes;)
+            {
+                if (drawn[i] == drop_drawn && layers[i].image.size() > 0)
+                {
+                    total -= layers[i].image.size();
+                    layers[i] = layer_image();
+                }
+            }
+        }
+        bytes = total;
+    }
+
+    // Brings the kept image of the layer to the view.
+    void update(layer_image & kept, mapnik::layer const & lyr, map_view const & view, view_key const & key)
+    {
+        mapnik::request const & req = view.req;
+        if (kept.key.width == key.width && kept.key.height == key.height &&
+            kept.key.scale_factor == key.scale_factor && kept.image.width() == key.width)
+        {
+            if (kept.key.extent == key.extent)
+            {
+                if (listener)
+                {
+                    listener->counter("layer_reused", 1);
+                }
+                return;
+            }
+            long ox, oy;
+            if (pan_offset(kept.key.extent, key.extent, key.width, key.height, ox, oy))
+            {
+                translate(kept, lyr, view, ox, oy);
+                kept.key = key;
+                if (listener)
+                {
+                    listener->counter("layer_translated", 1);
+                }
+                return;
+            }
+        }
+        tile t(make_tile(key.width, key.height, 0, 0, key.width, key.height, 0));
+        kept.image = render_area(lyr, view, t);
+        kept.key = key;
+    }
+
+    // Moves the image by the offset of the new view and renders the areas
+    // it exposes.
+    void translate(layer_image & kept, mapnik::layer const & lyr, map_view const & view, long ox, long oy)
+    {
+        mapnik::image_rgba8 image(pan_image(kept.image, ox, oy));
+        for (tile const & t : exposed_tiles(image.width(), image.height(), ox, oy))
+        {
+            mapnik::image_rgba8 area(render_area(lyr, view, t));
+            copy_tile(image, area, t);
+        }
+        kept.image = std::move(image);
+    }
+
+    // Premultiplied image of the layer alone over the tile area.
+    mapnik::image_rgba8 render_area(mapnik::layer const & lyr, map_view const & view, tile const & t)
+    {
+        mapnik::request req(tile_request(view.req, t));
+        mapnik::projection proj(map->srs(), true);
+        double scale_denom = mapnik::scale_denominator(view.req.scale(), proj.is_geographic()) * view.scale_factor;
+        std::set<std::string> names;
+        mapnik::image_rgba8 image(req.width(), req.height());
+        mapnik::attributes vars;
+        mapnik::agg_renderer<mapnik::image_rgba8> ren(*map, req, vars, image, view.scale_factor);
+        // The renderer paints the map background as it is constructed:
+        // cleared, the background being painted once below all layers.
+        std::memset(image.bytes(), 0, image.size());
+        ren.start_map_processing(*map);
+        render_layer(ren, *map, lyr, proj, req, scale_denom, names, listener);
+        ren.end_map_processing(*map);
+        mapnik::premultiply_alpha(image);
+        return image;
+    }
+};
+
+struct session_options
+{
+    // Sessions kept, the least recently used being dropped beyond.
+    std::size_t max_sessions = 16;
+    // Bytes of the layer images kept over all sessions, the least recently
+    // used sessions being dropped beyond. Zero for no limit.
+    std::size_t max_bytes = std::size_t(1) << 30;
+};
+
+// Incremental renderers of the editing sessions of a server, by session
+// id and map.
+class session_cache
+{
+public:
+    using renderer_ptr = std::shared_ptr<incremental_renderer>;
+
+    struct session
+    {
+        std::string id;
+        shared_map map;
+        renderer_ptr ren;
+        // Renders of a session are serialized.
+        std::shared_ptr<std::mutex> mutex;
+    };
+
+private:
+    const session_options options;
+    std::mutex mutex;
+    // Least recently used first.
+    std::list<session> sessions;
+
+public:
+    explicit session_cache(session_options const & options)
+        : options(options)
+    {
+    }
+
+    session get(std::string const & id, shared_map const & map)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = sessions.begin(); it != sessions.end(); ++it)
+        {
+            if (it->id == id && it->map == map)
+            {
+                sessions.splice(sessions.end(), sessions, it);
+                return sessions.back();
+            }
+        }
+        sessions.push_back({ id, map, std::make_shared<incremental_renderer>(map, options.max_bytes),
+                             std::make_shared<std::mutex>() });
+        while (sessions.size() > options.max_sessions)
+        {
+            sessions.pop_front();
+        }
+        return sessions.back();
+    }
+
+    // Drops the least recently used sessions until the images kept by the
+    // others fit the byte limit, to be called once a session rendered.
+    void trim()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::size_t total = 0;
+        for (session const & s : sessions)
+        {
+            total += s.ren->kept_bytes();
+        }
+        while (options.max_bytes > 0 && total > options.max_bytes && sessions.size() > 1)
+        {
+            total -= sessions.front().ren->kept_bytes();
+            sessions.pop_front();
+        }
+    }
+
+    void invalidate()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sessions.clear();
+    }
+};
+
+}
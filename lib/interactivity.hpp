@@ -0,0 +1,51 @@
+#pragma once
+
+#if defined(GRID_RENDERER)
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include <mapnik/map.hpp>
+
+#include "renderer.hpp"
+#include "progressive.hpp"
+
+namespace mapnik_print
+{
+
+// Renders the output through render, given the renderer of the output,
+// and then the grid of the command to the path from the features the
+// output read, which also records the fields of the grid. Both renderers
+// are set up by configure. An output served from the output cache reads
+// no feature: the grid then queries the datasources itself.
+template <typename Renderer, typename Configure, typename Render>
+void render_with_grid(shared_map const & map,
+                      command const & cmd,
+                      tile_options const & tiles,
+                      boost::filesystem::path const & grid_path,
+                      Configure && configure,
+                      Render && render)
+{
+    grid_interactivity interactivity(*map);
+    auto capture = std::make_shared<feature_capture>();
+    shared_map capturing(capture_features(*map, capture,
+                                          { { interactivity.layer, interactivity.property_names() } }));
+    {
+        renderer<Renderer> output(capturing, tiles);
+        configure(output);
+        render(output);
+    }
+    capture->recording = false;
+
+    renderer<grid_renderer> grid(capturing, tiles);
+    configure(grid);
+    grid.render(cmd, grid_path).get();
+}
+
+}
+
+#endif
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+
+#include <boost/optional.hpp>
+
+#include <mapnik/map.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/box2d.hpp>
+#include <mapnik/request.hpp>
+#include <mapnik/rule.hpp>
+#include <mapnik/feature_type_style.hpp>
+
+#include "projection_cache.hpp"
+
+namespace mapnik_print
+{
+
+// Bounds of the box of the source SRS in the target SRS, projected
+// through geographic coordinates at points along its edges, which may
+// curve. False when a point cannot be projected.
+inline bool project_box(mapnik::box2d<double> const & box, std::string const & source,
+                        std::string const & target, mapnik::box2d<double> & result)
+{
+    constexpr int edge_points = 8;
+    projection_cache & projections = projection_cache::instance();
+    bool first = true;
+    for (int i = 0; i <= edge_points; i++)
+    {
+        double t = double(i) / edge_points;
+        double x = box.minx() + box.width() * t;
+        double y = box.miny() + box.height() * t;
+        double points[4][2] = { { x, box.miny() }, { x, box.maxy() }, { box.minx(), y }, { box.maxx(), y } };
+        for (auto & point : points)
+        {
+            if (!projections.inverse(source, point[0], point[1]) ||
+                !projections.forward(target, point[0], point[1]))
+            {
+                return false;
+            }
+            mapnik::box2d<double> p(point[0], point[1], point[0], point[1]);
+            if (first)
+            {
+                result = p;
+                first = false;
+            }
+            else
+            {
+                result.expand_to_include(p);
+            }
+        }
+    }
+    return true;
+}
+
+// Whether the layer can draw anything into the request at the scale:
+// visible at the scale, with a rule of one of its styles active at the
+// scale, and reaching the request extent grown by the buffer of the
+// layer. Layers of unknown extent, or whose extent does not project, are
+// kept, as are layers clearing the label cache, which affects the layers
+// above them.
+//
+// The renderers skip the other layers before mapnik sets up their
+// projection or asks their datasource for its envelope, which for a
+// deferred datasource (see defer_datasources) means it is never opened.
+inline bool layer_contributes(mapnik::Map const & map, mapnik::layer const & lyr,
+                              mapnik::request const & req, double scale_denom)
+{
+    if (!lyr.visible(scale_denom))
+    {
+        return false;
+    }
+    if (lyr.clear_label_cache())
+    {
+        return true;
+    }
+
+    bool active = false;
+    for (std::string const & name : lyr.styles())
+    {
+        boost::optional<mapnik::feature_type_style const &> style(map.find_style(name));
+        if (style)
+        {
+            std::vector<mapnik::rule> const & rules = style->get_rules();
+            active = std::any_of(rules.begin(), rules.end(), [&](mapnik::rule const & r) {
+                return r.active(scale_denom);
+            });
+        }
+        if (active)
+        {
+            break;
+        }
+    }
+    if (!active)
+    {
+        return false;
+    }
+
+    mapnik::box2d<double> layer_extent;
+    if (lyr.maximum_extent())
+    {
+        layer_extent = *lyr.maximum_extent();
+    }
+    else if (lyr.datasource())
+    {
+        layer_extent = lyr.datasource()->envelope();
+    }
+    if (!layer_extent.valid())
+    {
+        return true;
+    }
+
+    mapnik::box2d<double> extent(req.extent());
+    int buffer = std::max(req.buffer_size(), lyr.buffer_size().get_value_or(0));
+    extent.pad(buffer * req.extent().width() / req.width());
+    if (lyr.srs() != map.srs() &&
+        !project_box(mapnik::box2d<double>(extent), map.srs(), lyr.srs(), extent))
+    {
+        return true;
+    }
+    return extent.intersects(layer_extent);
+}
+
+}
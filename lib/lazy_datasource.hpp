@@ -0,0 +1,105 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+
+#include <mapnik/map.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/datasource.hpp>
+#include <mapnik/datasource_cache.hpp>
+
+namespace mapnik_print
+{
+
+// Datasource created again from the parameters of a loaded one on its
+// first query, answering for its type and envelope meanwhile from those
+// of the loaded one. Datasources failing to open are tried again on the
+// next query.
+//
+// Connection pools are those of the input plugins, keyed by connection
+// parameters: all the datasources of a process with the same parameters
+// share them, across layers, maps and jobs.
+class lazy_datasource : public mapnik::datasource
+{
+    const datasource_t ds_type;
+    const mapnik::box2d<double> extent;
+    mutable std::mutex mutex;
+    mutable mapnik::datasource_ptr ds;
+
+public:
+    explicit lazy_datasource(mapnik::datasource_ptr const & loaded)
+        : mapnik::datasource(loaded->params()), ds_type(loaded->type()), extent(loaded->envelope())
+    {
+    }
+
+    datasource_t type() const override
+    {
+        return ds_type;
+    }
+
+    mapnik::featureset_ptr features(mapnik::query const & q) const override
+    {
+        return open()->features(q);
+    }
+
+    mapnik::featureset_ptr features_with_context(mapnik::query const & q,
+                                                 mapnik::processor_context_ptr ctx) const override
+    {
+        return open()->features_with_context(q, ctx);
+    }
+
+    mapnik::processor_context_ptr get_context(mapnik::feature_style_context_map & ctx) const override
+    {
+        return open()->get_context(ctx);
+    }
+
+    mapnik::featureset_ptr features_at_point(mapnik::coord2d const & pt, double tol) const override
+    {
+        return open()->features_at_point(pt, tol);
+    }
+
+    mapnik::box2d<double> envelope() const override
+    {
+        return extent;
+    }
+
+    boost::optional<mapnik::datasource_geometry_t> get_geometry_type() const override
+    {
+        return open()->get_geometry_type();
+    }
+
+    mapnik::layer_descriptor get_descriptor() const override
+    {
+        return open()->get_descriptor();
+    }
+
+private:
+    mapnik::datasource_ptr open() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!ds)
+        {
+            ds = mapnik::datasource_cache::instance().create(params_);
+        }
+        return ds;
+    }
+};
+
+// Replaces the datasources of the map layers by lazy ones, releasing
+// those opened while loading the map: layers the commands never query
+// (see layer_contributes) hold no files or connections, and processes
+// forked after loading open their own.
+//
+// Must be called before other datasource wrappers are installed.
+inline void defer_datasources(mapnik::Map & map)
+{
+    for (mapnik::layer & lyr : map.layers())
+    {
+        if (lyr.datasource())
+        {
+            lyr.set_datasource(std::make_shared<lazy_datasource>(lyr.datasource()));
+        }
+    }
+}
+
+}
@@ -0,0 +1,424 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "renderer.hpp"
+#include "command_spec.hpp"
+#include "benchmark.hpp"
+#include "net.hpp"
+#include "output.hpp"
+#include "vector_quality.hpp"
+#include "scale_styles.hpp"
+
+namespace mapnik_print
+{
+
+struct load_test_options
+{
+    // Render server the jobs are sent to, see connect_socket. Jobs are
+    // rendered in process when empty.
+    std::string server;
+    // Jobs in flight at the same time, each level being run in turn.
+    std::vector<unsigned> concurrency{ 1 };
+    // Threads of each in process job (tile_options::threads), each count
+    // being run in turn with every concurrency level. The threads of the
+    // tile options when empty.
+    std::vector<unsigned> threads;
+    // Renderers given to the pages in turn, each as many times as its
+    // weight. The renderers of the pages themselves when empty.
+    std::vector<std::pair<std::string, unsigned>> renderers;
+    // Passes over the pages at each level.
+    std::size_t repeat = 1;
+    tile_options tiles;
+    vector_options vector;
+    png_options png;
+    // Simplifies vector output of the pages rendered in process when set.
+    device_maps * device = nullptr;
+    // Specializes the styles of the pages rendered in process when set.
+    scale_maps * scales = nullptr;
+};
+
+// Parses renderer[:weight],...
+inline std::vector<std::pair<std::string, unsigned>> parse_renderer_mix(std::string const & list)
+{
+    std::vector<std::pair<std::string, unsigned>> mix;
+    std::istringstream items(list);
+    std::string item;
+    while (std::getline(items, item, ','))
+    {
+        std::string::size_type colon = item.find(':');
+        std::string name(item.substr(0, colon));
+        unsigned weight = 1;
+        if (colon != std::string::npos)
+        {
+            std::istringstream value(item.substr(colon + 1));
+            if (!(value >> weight) || !value.eof() || weight == 0)
+            {
+                throw std::runtime_error("Invalid renderer weight: " + item);
+            }
+        }
+        find_renderer(name);
+        mix.emplace_back(name, weight);
+    }
+    return mix;
+}
+
+// CPU time of each core since boot, busy and total, from /proc/stat.
+// Empty where not available.
+inline std::vector<std::pair<double, double>> core_times()
+{
+    std::vector<std::pair<double, double>> cores;
+    std::ifstream stat("/proc/stat");
+    std::string line;
+    while (std::getline(stat, line))
+    {
+        if (line.compare(0, 3, "cpu") != 0 || line.size() < 4 || !std::isdigit(static_cast<unsigned char>(line[3])))
+        {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string name;
+        fields >> name;
+        double total = 0, idle = 0, value;
+        for (int i = 0; fields >> value; i++)
+        {
+            total += value;
+            // idle and iowait
+            if (i == 3 || i == 4)
+            {
+                idle += value;
+            }
+        }
+        cores.emplace_back(total - idle, total);
+    }
+    return cores;
+}
+
+// Results of one concurrency level and thread count.
+struct load_test_result
+{
+    unsigned concurrency;
+    unsigned threads;
+    std::size_t pages = 0;
+    std::size_t failures = 0;
+    double wall_time = 0;
+    double pixels = 0;
+    double output_bytes = 0;
+    // Seconds from sending each page to its last output byte.
+    std::vector<double> latencies;
+    // Busy fraction of each core over the level, of the whole machine.
+    std::vector<double> core_utilization;
+    // CPU time of this process over the wall time, in cores.
+    double process_cores = 0;
+    // Peak resident size of this process, which renders the pages unless
+    // they go to a server.
+    std::size_t peak_rss = 0;
+
+    double pages_per_second() const
+    {
+        return wall_time > 0 ? pages / wall_time : 0;
+    }
+
+    double latency_percentile(double p) const
+    {
+        if (latencies.empty())
+        {
+            return 0;
+        }
+        std::vector<double> sorted(latencies);
+        std::sort(sorted.begin(), sorted.end());
+        std::size_t index = static_cast<std::size_t>(std::ceil(p * sorted.size()));
+        return sorted[std::min(std::max<std::size_t>(index, 1), sorted.size()) - 1];
+    }
+};
+
+// Replays the pages, as recorded from real print traffic, at every
+// concurrency level and thread count, each level starting once the
+// previous one is done. Pages are drawn by concurrency closed loop
+// clients, each sending its next page once it has the output of the
+// previous one, which is discarded.
+class load_test
+{
+    std::map<std::string, shared_map> const & maps;
+    const load_test_options options;
+    std::vector<command_spec> pages;
+
+public:
+    load_test(std::map<std::string, shared_map> const & maps, std::vector<command_spec> const & trace,
+              load_test_options const & options)
+        : maps(maps), options(options), pages(trace)
+    {
+        if (pages.empty())
+        {
+            throw std::runtime_error("No page to replay");
+        }
+        std::vector<std::string> mix;
+        for (auto const & renderer_weight : options.renderers)
+        {
+            mix.insert(mix.end(), renderer_weight.second, renderer_weight.first);
+        }
+        for (std::size_t i = 0; i < pages.size(); i++)
+        {
+            // Outputs are streamed back and discarded in both modes,
+            // never written to the files the trace recorded.
+            pages[i].output.clear();
+            if (!mix.empty())
+            {
+                pages[i].renderer = mix[i % mix.size()];
+            }
+            // Servers loading more maps than the test need the name.
+            if (pages[i].map.empty() && maps.size() == 1)
+            {
+                pages[i].map = maps.begin()->first;
+            }
+        }
+    }
+
+    std::vector<load_test_result> run() const
+    {
+        std::vector<unsigned> thread_counts(options.threads);
+        if (thread_counts.empty() || !options.server.empty())
+        {
+            thread_counts = { options.tiles.threads };
+        }
+        std::vector<load_test_result> results;
+        for (unsigned threads : thread_counts)
+        {
+            for (unsigned concurrency : options.concurrency)
+            {
+                results.push_back(run_level(std::max(1u, concurrency), threads));
+            }
+        }
+        return results;
+    }
+
+private:
+    load_test_result run_level(unsigned concurrency, unsigned threads) const
+    {
+        using clock = std::chrono::steady_clock;
+        load_test_result result;
+        result.concurrency = concurrency;
+        result.threads = threads;
+        tile_options tiles(options.tiles);
+        tiles.threads = threads;
+
+        std::size_t total = pages.size() * std::max<std::size_t>(1, options.repeat);
+        std::atomic<std::size_t> next{ 0 };
+        std::mutex mutex;
+
+        reset_peak_rss();
+        std::vector<std::pair<double, double>> cores_start(core_times());
+        double cpu_start = cpu_time();
+        clock::time_point start = clock::now();
+
+        auto client = [&] {
+            std::size_t i;
+            while ((i = next++) < total)
+            {
+                command_spec const & spec = pages[i % pages.size()];
+                clock::time_point page_start = clock::now();
+                double pixels = 0;
+                std::size_t bytes = 0;
+                bool failed = false;
+                try
+                {
+                    bytes = options.server.empty() ? render_page(spec, tiles, pixels) : send_page(spec, pixels);
+                }
+                catch (std::exception const & e)
+                {
+                    failed = true;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    std::clog << "Warning: page " << i % pages.size() + 1 << ": " << e.what() << std::endl;
+                }
+                std::chrono::duration<double> latency = clock::now() - page_start;
+                std::lock_guard<std::mutex> lock(mutex);
+                if (failed)
+                {
+                    result.failures++;
+                    continue;
+                }
+                result.pages++;
+                result.pixels += pixels;
+                result.output_bytes += bytes;
+                result.latencies.push_back(latency.count());
+            }
+        };
+        std::vector<std::thread> clients;
+        for (unsigned c = 0; c < concurrency; c++)
+        {
+            clients.emplace_back(client);
+        }
+        for (std::thread & t : clients)
+        {
+            t.join();
+        }
+
+        std::chrono::duration<double> wall_time = clock::now() - start;
+        result.wall_time = wall_time.count();
+        result.process_cores = result.wall_time > 0 ? (cpu_time() - cpu_start) / result.wall_time : 0;
+        result.peak_rss = peak_rss();
+        std::vector<std::pair<double, double>> cores_end(core_times());
+        for (std::size_t c = 0; c < cores_end.size() && c < cores_start.size(); c++)
+        {
+            double busy = cores_end[c].first - cores_start[c].first;
+            double elapsed = cores_end[c].second - cores_start[c].second;
+            result.core_utilization.push_back(elapsed > 0 ? busy / elapsed : 0);
+        }
+        return result;
+    }
+
+    std::size_t render_page(command_spec const & spec, tile_options const & tiles, double & pixels) const
+    {
+        shared_map map(find_map(maps, spec.map));
+        command cmd(spec.to_command(map->srs()));
+        if (options.device)
+        {
+            map = options.device->for_renderer(spec.renderer, map, cmd.dpi);
+        }
+        if (options.scales)
+        {
+            map = options.scales->get(map, cmd);
+        }
+        return dispatch_renderer(spec.renderer, [&](auto tag) {
+            renderer<typename decltype(tag)::type> r(map, tiles);
+            r.set_png_options(options.png);
+            r.set_vector_options(options.vector);
+            map_view view(r.view(cmd));
+            pixels = double(view.req.width()) * view.req.height();
+            counting_streambuf counter;
+            std::ostream stream(&counter);
+            r.render(cmd, stream);
+            return counter.size();
+        });
+    }
+
+    // Has the server stream the output back, which is counted until the
+    // server closes the connection.
+    std::size_t send_page(command_spec const & spec, double & pixels) const
+    {
+        auto map = maps.find(spec.map);
+        if (map != maps.end())
+        {
+            command cmd(spec.to_command(map->second->srs()));
+            dispatch_renderer(spec.renderer, [&](auto tag) {
+                map_view view(renderer<typename decltype(tag)::type>(map->second).view(cmd));
+                pixels = double(view.req.width()) * view.req.height();
+            });
+        }
+        int fd = connect_socket(options.server);
+        output_stream connection(fd, true);
+        connection << format_command_spec(spec) << "\n";
+        if (!connection.flush())
+        {
+            throw std::runtime_error("Cannot send page to " + options.server);
+        }
+        std::string answer(read_line(fd, 4096));
+        if (answer != "OK")
+        {
+            throw std::runtime_error(options.server + ": " + answer);
+        }
+        std::size_t bytes = 0;
+        char buffer[65536];
+        while (true)
+        {
+            ssize_t count = ::read(fd, buffer, sizeof(buffer));
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count < 0)
+            {
+                throw std::runtime_error(std::string("Cannot read: ") + std::strerror(errno));
+            }
+            if (count == 0)
+            {
+                return bytes;
+            }
+            bytes += count;
+        }
+    }
+};
+
+// Speedup of each result over the first one of the same thread count,
+// the scaling having flattened where it stops growing with concurrency.
+inline double load_test_speedup(std::vector<load_test_result> const & results, std::size_t i)
+{
+    for (load_test_result const & first : results)
+    {
+        if (first.threads == results[i].threads)
+        {
+            return first.pages_per_second() > 0 ? results[i].pages_per_second() / first.pages_per_second() : 0;
+        }
+    }
+    return 0;
+}
+
+inline void write_json(std::ostream & out, std::vector<load_test_result> const & results)
+{
+    out << "[";
+    for (std::size_t i = 0; i < results.size(); i++)
+    {
+        load_test_result const & r = results[i];
+        out << (i ? "," : "") << "\n{\"concurrency\":" << r.concurrency << ",\"threads\":" << r.threads
+            << ",\"pages\":" << r.pages << ",\"failures\":" << r.failures
+            << ",\"wall_time\":" << r.wall_time
+            << ",\"pages_per_second\":" << r.pages_per_second()
+            << ",\"mpx_per_second\":" << (r.wall_time > 0 ? r.pixels / 1e6 / r.wall_time : 0)
+            << ",\"mb_per_second\":" << (r.wall_time > 0 ? r.output_bytes / 1e6 / r.wall_time : 0)
+            << ",\"speedup\":" << load_test_speedup(results, i)
+            << ",\"latency\":{\"p50\":" << r.latency_percentile(0.5) << ",\"p90\":" << r.latency_percentile(0.9)
+            << ",\"p99\":" << r.latency_percentile(0.99) << ",\"max\":" << r.latency_percentile(1) << "}"
+            << ",\"process_cores\":" << r.process_cores << ",\"core_utilization\":[";
+        for (std::size_t c = 0; c < r.core_utilization.size(); c++)
+        {
+            out << (c ? "," : "") << r.core_utilization[c];
+        }
+        out << "],\"peak_rss\":" << r.peak_rss << "}";
+    }
+    out << "\n]\n";
+}
+
+// One row per level, the utilization of the cores being separated by
+// spaces.
+inline void write_csv(std::ostream & out, std::vector<load_test_result> const & results)
+{
+    out << "concurrency,threads,pages,failures,wall_time,pages_per_second,mpx_per_second,mb_per_second,"
+           "speedup,latency_p50,latency_p90,latency_p99,latency_max,process_cores,core_utilization,peak_rss\n";
+    for (std::size_t i = 0; i < results.size(); i++)
+    {
+        load_test_result const & r = results[i];
+        out << r.concurrency << "," << r.threads << "," << r.pages << "," << r.failures << ","
+            << r.wall_time << "," << r.pages_per_second() << ","
+            << (r.wall_time > 0 ? r.pixels / 1e6 / r.wall_time : 0) << ","
+            << (r.wall_time > 0 ? r.output_bytes / 1e6 / r.wall_time : 0) << ","
+            << load_test_speedup(results, i) << ","
+            << r.latency_percentile(0.5) << "," << r.latency_percentile(0.9) << ","
+            << r.latency_percentile(0.99) << "," << r.latency_percentile(1) << ","
+            << r.process_cores << ",";
+        for (std::size_t c = 0; c < r.core_utilization.size(); c++)
+        {
+            out << (c ? " " : "") << r.core_utilization[c];
+        }
+        out << "," << r.peak_rss << "\n";
+    }
+}
+
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <future>
+#include <mutex>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include <mapnik/map.hpp>
+
+#include "renderer.hpp"
+#include "output.hpp"
+#include "thread_pool.hpp"
+
+namespace mapnik_print
+{
+
+// Cairo drawing of a map kept as a recording surface, sized in points.
+struct cairo_recording
+{
+    mapnik::cairo_surface_ptr surface;
+    double width, height;
+};
+
+// Renders the map once into a recording surface which is then replayed
+// into the output of any cairo renderer.
+struct cairo_recording_renderer
+{
+    using image_type = cairo_recording;
+
+    static constexpr const char * name = "cairo-recording";
+    static constexpr const bool support_tiles = false;
+    static constexpr const bool support_streaming = false;
+    static constexpr const bool support_pages = false;
+
+    double resolution(double) const
+    {
+        return command::points_per_inch;
+    }
+
+    image_type render(mapnik::Map const & map, mapnik::request const & req, double scale_factor,
+                      render_listener * listener = nullptr) const
+    {
+        cairo_rectangle_t extents = { 0, 0, double(req.width()), double(req.height()) };
+        mapnik::cairo_surface_ptr surface(
+            cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents),
+            mapnik::cairo_surface_closer());
+        mapnik::cairo_ptr context(mapnik::create_context(surface));
+        mapnik::attributes vars;
+        mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, req, vars, context, scale_factor);
+        render_layers(ren, map, req, scale_factor, listener);
+        return { surface, extents.width, extents.height };
+    }
+};
+
+// Paints the recording onto the context. Cairo recording surfaces are not
+// safe to replay from several threads at once: the callers serialize
+// replaying, while encoding raster outputs runs concurrently.
+inline void paint_recording(mapnik::cairo_ptr const & context,
+                            cairo_recording const & recording,
+                            double scale)
+{
+    cairo_scale(&*context, scale, scale);
+    cairo_set_source_surface(&*context, &*recording.surface, 0, 0);
+    cairo_paint(&*context);
+}
+
+// Writes the recording in the format of the renderer, raster formats
+// being rasterized at the resolution of the command.
+template <typename Renderer>
+void replay(cairo_recording const & recording, command const & cmd,
+            std::ostream & stream, std::mutex & mutex, png_options const & png)
+{
+    if constexpr (!Renderer::support_replay)
+    {
+        throw std::runtime_error(std::string("Renderer cannot replay a cairo recording: ") +
+            Renderer::name);
+    }
+    else if constexpr (Renderer::support_streaming)
+    {
+        mapnik::cairo_surface_ptr surface(Renderer::create_surface(stream, recording.width, recording.height));
+        {
+            // Paginated surfaces replay the recording when finished.
+            std::lock_guard<std::mutex> lock(mutex);
+            paint_recording(mapnik::create_context(surface), recording, 1.0);
+            cairo_surface_finish(&*surface);
+        }
+        Renderer::check_status(&*surface);
+        stream.flush();
+    }
+    else
+    {
+        double factor = cmd.dpi / command::points_per_inch;
+        int width = std::max(1l, std::lround(recording.width * factor));
+        int height = std::max(1l, std::lround(recording.height * factor));
+        typename Renderer::image_type image(width, height);
+        {
+            mapnik::cairo_surface_ptr surface(create_image_surface(image));
+            std::lock_guard<std::mutex> lock(mutex);
+            paint_recording(mapnik::create_context(surface), recording, factor);
+            cairo_surface_flush(&*surface);
+        }
+        cairo_argb_to_rgba(image);
+        Renderer().save(image, stream, png);
+    }
+}
+
+struct output_target
+{
+    std::string renderer;
+    std::string path;
+};
+
+// Parses "renderer[:path]", the path defaulting to the map name with the
+// extension of the renderer.
+inline output_target parse_output_target(std::string const & text, std::string const & map_name)
+{
+    std::string::size_type colon = text.find(':');
+    output_target target{ text.substr(0, colon), colon == std::string::npos ? "" : text.substr(colon + 1) };
+    if (target.path.empty())
+    {
+        target.path = map_name + find_renderer(target.renderer).ext;
+    }
+    return target;
+}
+
+// Renders the command once and writes it to all targets concurrently, so
+// that datasources are queried and styles evaluated a single time
+// whatever the number of formats.
+inline void render_outputs(shared_map const & map,
+                           command const & cmd,
+                           std::vector<output_target> const & targets,
+                           render_listener * listener = nullptr,
+                           png_options const & png = png_options())
+{
+    renderer<cairo_recording_renderer> recorder(map);
+    recorder.set_listener(listener);
+    cairo_recording recording(recorder.render(cmd));
+
+    render_stage stage(listener, "replay");
+    std::mutex mutex;
+    thread_pool pool(std::max(1u, static_cast<unsigned>(targets.size())));
+    std::vector<std::future<void>> results;
+    for (output_target const & target : targets)
+    {
+        results.push_back(pool.submit([&, target] {
+            output_stream stream(target.path);
+            dispatch_renderer(target.renderer, [&](auto tag) {
+                replay<typename decltype(tag)::type>(recording, cmd, stream, mutex, png);
+            });
+            if (!stream.flush())
+            {
+                throw std::runtime_error("Cannot write output: " + target.path);
+            }
+        }));
+    }
+    for (std::future<void> & result : results)
+    {
+        result.wait();
+    }
+    for (std::future<void> & result : results)
+    {
+        result.get();
+    }
+}
+
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <string>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+namespace mapnik_print
+{
+
+// Socket addresses are either Unix socket paths or host:port for TCP,
+// an empty host meaning all interfaces when listening.
+inline bool is_tcp_address(std::string const & address)
+{
+    return address.find('/') == std::string::npos && address.find(':') != std::string::npos;
+}
+
+namespace net_detail
+{
+
+[[noreturn]] inline void fail(char const * operation, std::string const & address, int error)
+{
+    throw std::runtime_error(std::string("Cannot ") + operation + " " + address + ": " +
+        std::strerror(error));
+}
+
+inline sockaddr_un unix_address(std::string const & path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error("Socket path too long: " + path);
+    }
+    std::strcpy(address.sun_path, path.c_str());
+    return address;
+}
+
+// Calls the function with each resolved address until it returns a
+// socket, returning it.
+template <typename Function>
+int with_tcp_address(std::string const & address, bool passive, char const * operation,
+                     Function function)
+{
+    std::string::size_type colon = address.rfind(':');
+    std::string host(address.substr(0, colon));
+    std::string port(address.substr(colon + 1));
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo * results = nullptr;
+    int status = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results);
+    if (status != 0)
+    {
+        throw std::runtime_error("Cannot resolve " + address + ": " + ::gai_strerror(status));
+    }
+    int error = 0;
+    int fd = -1;
+    for (addrinfo * info = results; info && fd < 0; info = info->ai_next)
+    {
+        fd = function(*info);
+        if (fd < 0)
+        {
+            error = errno;
+        }
+    }
+    ::freeaddrinfo(results);
+    if (fd < 0)
+    {
+        fail(operation, address, error);
+    }
+    return fd;
+}
+
+}
+
+// Listening socket of the address, non-blocking.
+inline int listen_socket(std::string const & address)
+{
+    if (!is_tcp_address(address))
+    {
+        sockaddr_un unix_address(net_detail::unix_address(address));
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+        {
+            throw std::runtime_error(std::string("Cannot create socket: ") + std::strerror(errno));
+        }
+        ::unlink(address.c_str());
+        if (::bind(fd, reinterpret_cast<sockaddr const *>(&unix_address), sizeof(unix_address)) < 0 ||
+            ::listen(fd, SOMAXCONN) < 0)
+        {
+            int error = errno;
+            ::close(fd);
+            net_detail::fail("listen on", address, error);
+        }
+        return fd;
+    }
+    return net_detail::with_tcp_address(address, true, "listen on", [](addrinfo const & info) {
+        int fd = ::socket(info.ai_family, info.ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, info.ai_protocol);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        int reuse = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (::bind(fd, info.ai_addr, info.ai_addrlen) < 0 || ::listen(fd, SOMAXCONN) < 0)
+        {
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            return -1;
+        }
+        return fd;
+    });
+}
+
+// Socket connected to the address, whose reads and writes fail after the
+// given number of seconds without progress, zero for never.
+inline int connect_socket(std::string const & address, double timeout = 0)
+{
+    auto set_timeout = [timeout](int fd) {
+        if (timeout > 0)
+        {
+            timeval tv;
+            tv.tv_sec = static_cast<time_t>(timeout);
+            tv.tv_usec = static_cast<suseconds_t>((timeout - tv.tv_sec) * 1e6);
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+    };
+    if (!is_tcp_address(address))
+    {
+        sockaddr_un unix_address(net_detail::unix_address(address));
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            throw std::runtime_error(std::string("Cannot create socket: ") + std::strerror(errno));
+        }
+        set_timeout(fd);
+        if (::connect(fd, reinterpret_cast<sockaddr const *>(&unix_address), sizeof(unix_address)) < 0)
+        {
+            int error = errno;
+            ::close(fd);
+            net_detail::fail("connect to", address, error);
+        }
+        return fd;
+    }
+    return net_detail::with_tcp_address(address, false, "connect to", [&](addrinfo const & info) {
+        int fd = ::socket(info.ai_family, info.ai_socktype | SOCK_CLOEXEC, info.ai_protocol);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        set_timeout(fd);
+        if (::connect(fd, info.ai_addr, info.ai_addrlen) < 0)
+        {
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            return -1;
+        }
+        // Requests are single lines sent at once.
+        int nodelay = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        return fd;
+    });
+}
+
+// Reads a line without its newline, up to the end of the input.
+inline std::string read_line(int fd, std::size_t max_size)
+{
+    std::string line;
+    char c;
+    while (line.size() < max_size)
+    {
+        ssize_t size = ::read(fd, &c, 1);
+        if (size < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (size < 0)
+        {
+            throw std::runtime_error(std::string("Cannot read: ") + std::strerror(errno));
+        }
+        if (size == 0 || c == '\n')
+        {
+            return line;
+        }
+        line.push_back(c);
+    }
+    throw std::runtime_error("Line too long");
+}
+
+// Reads exactly size bytes.
+inline void read_exact(int fd, char * data, std::size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t count = ::read(fd, data, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count < 0)
+        {
+            throw std::runtime_error(std::string("Cannot read: ") + std::strerror(errno));
+        }
+        if (count == 0)
+        {
+            throw std::runtime_error("Connection closed");
+        }
+        data += count;
+        size -= count;
+    }
+}
+
+}
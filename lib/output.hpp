@@ -0,0 +1,196 @@
+#pragma once
+
+#include <streambuf>
+#include <ostream>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace mapnik_print
+{
+
+inline std::string escape_json(std::string const & text)
+{
+    std::string escaped;
+    escaped.reserve(text.size());
+    for (char c : text)
+    {
+        switch (c)
+        {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    char code[8];
+                    std::snprintf(code, sizeof(code), "\\u%04x", c);
+                    escaped += code;
+                }
+                else
+                {
+                    escaped += c;
+                }
+        }
+    }
+    return escaped;
+}
+
+// Stream buffer writing to a file descriptor (file, pipe or socket)
+// through a fixed size buffer, so memory use does not depend on output size.
+class fd_streambuf : public std::streambuf
+{
+    const int fd;
+    const bool owns_fd;
+    std::vector<char> buffer;
+    std::size_t written = 0;
+
+public:
+    static constexpr std::size_t default_buffer_size = 64 * 1024;
+
+    fd_streambuf(int fd, bool owns_fd, std::size_t buffer_size = default_buffer_size)
+        : fd(fd), owns_fd(owns_fd), buffer(buffer_size)
+    {
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    fd_streambuf(fd_streambuf const &) = delete;
+    fd_streambuf & operator=(fd_streambuf const &) = delete;
+
+    ~fd_streambuf()
+    {
+        sync();
+        if (owns_fd)
+        {
+            ::close(fd);
+        }
+    }
+
+    int descriptor() const
+    {
+        return fd;
+    }
+
+    // Bytes passed to the descriptor so far.
+    std::size_t bytes_written() const
+    {
+        return written;
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (!flush_buffer())
+        {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char * data, std::streamsize size) override
+    {
+        if (size <= epptr() - pptr())
+        {
+            std::memcpy(pptr(), data, size);
+            pbump(static_cast<int>(size));
+            return size;
+        }
+        // Large chunks bypass the buffer instead of being copied through it.
+        if (!flush_buffer() || !write_all(data, size))
+        {
+            return 0;
+        }
+        return size;
+    }
+
+    int sync() override
+    {
+        return flush_buffer() ? 0 : -1;
+    }
+
+private:
+    bool flush_buffer()
+    {
+        std::size_t size = pptr() - pbase();
+        bool ok = write_all(pbase(), size);
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return ok;
+    }
+
+    bool write_all(const char * data, std::size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t count = ::write(fd, data, size);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            data += count;
+            size -= count;
+            written += count;
+        }
+        return true;
+    }
+};
+
+// Output stream for a path, "-" meaning standard output.
+class output_stream : public std::ostream
+{
+    fd_streambuf buf;
+
+    static int open(std::string const & path)
+    {
+        if (path == "-")
+        {
+            return STDOUT_FILENO;
+        }
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Cannot open file for writing: " + path +
+                ": " + std::strerror(errno));
+        }
+        return fd;
+    }
+
+public:
+    explicit output_stream(std::string const & path,
+                           std::size_t buffer_size = fd_streambuf::default_buffer_size)
+        : std::ostream(nullptr),
+          buf(open(path), path != "-", buffer_size)
+    {
+        rdbuf(&buf);
+    }
+
+    output_stream(int fd, bool owns_fd,
+                  std::size_t buffer_size = fd_streambuf::default_buffer_size)
+        : std::ostream(nullptr),
+          buf(fd, owns_fd, buffer_size)
+    {
+        rdbuf(&buf);
+    }
+
+    std::size_t bytes_written() const
+    {
+        return buf.bytes_written();
+    }
+};
+
+}
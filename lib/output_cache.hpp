@@ -0,0 +1,268 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <streambuf>
+#include <ostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+#include <ctime>
+
+#include <boost/filesystem.hpp>
+
+#include <mapnik/map.hpp>
+#include <mapnik/save_map.hpp>
+
+#include "output.hpp"
+
+namespace mapnik_print
+{
+
+inline std::uint64_t fnv1a(std::string const & data, std::uint64_t hash = 14695981039346656037ull)
+{
+    for (unsigned char c : data)
+    {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Stream buffer copying everything to two streams.
+class tee_streambuf : public std::streambuf
+{
+    std::ostream & first;
+    std::ostream & second;
+
+public:
+    tee_streambuf(std::ostream & first, std::ostream & second)
+        : first(first), second(second)
+    {
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            char c = traits_type::to_char_type(ch);
+            first.put(c);
+            second.put(c);
+        }
+        return first && second ? traits_type::not_eof(ch) : traits_type::eof();
+    }
+
+    std::streamsize xsputn(const char * data, std::streamsize size) override
+    {
+        first.write(data, size);
+        second.write(data, size);
+        return first && second ? size : 0;
+    }
+
+    int sync() override
+    {
+        return first.flush() && second.flush() ? 0 : -1;
+    }
+};
+
+// Content addressed store of rendered outputs in a directory, evicting
+// the least recently used entries beyond the size limit.
+//
+// Keys hash the serialized map, the renderer and the normalized command,
+// so a hit is served from the file without opening any datasource. The
+// data the datasources read is not part of the key: the cache must be
+// cleared when it changes.
+class output_cache
+{
+    struct entry
+    {
+        std::string key;
+        std::uintmax_t size;
+    };
+
+    const boost::filesystem::path directory;
+    const std::uintmax_t max_size;
+    std::mutex mutex;
+    // Least recently used first.
+    std::list<entry> entries;
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+    std::uintmax_t total_size = 0;
+    // Keyed by owner, which unlike the address of a map is not reused
+    // while the entry exists. Entries of maps gone are dropped on insert.
+    std::map<std::weak_ptr<const mapnik::Map>, std::uint64_t,
+             std::owner_less<std::weak_ptr<const mapnik::Map>>> style_hashes;
+
+public:
+    output_cache(boost::filesystem::path const & directory, std::uintmax_t max_size)
+        : directory(directory), max_size(max_size)
+    {
+        boost::filesystem::create_directories(directory);
+        std::vector<std::pair<std::time_t, entry>> found;
+        for (boost::filesystem::directory_entry const & file :
+             boost::filesystem::directory_iterator(directory))
+        {
+            std::string name(file.path().filename().string());
+            if (!boost::filesystem::is_regular_file(file.status()))
+            {
+                continue;
+            }
+            if (name[0] == '.')
+            {
+                // Left over by an interrupted store.
+                boost::system::error_code error;
+                boost::filesystem::remove(file.path(), error);
+                continue;
+            }
+            found.push_back({ boost::filesystem::last_write_time(file.path()),
+                              { name, boost::filesystem::file_size(file.path()) } });
+        }
+        std::sort(found.begin(), found.end(),
+                  [](auto const & a, auto const & b) { return a.first < b.first; });
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto const & f : found)
+        {
+            add(f.second);
+        }
+        evict();
+    }
+
+    // Hash of the map as mapnik would save it, computed once per map.
+    std::uint64_t style_hash(std::shared_ptr<const mapnik::Map> const & map)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = style_hashes.find(map);
+            if (it != style_hashes.end())
+            {
+                return it->second;
+            }
+        }
+        std::uint64_t hash = fnv1a(mapnik::save_map_to_string(*map));
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = style_hashes.begin(); it != style_hashes.end();)
+        {
+            it = it->first.expired() ? style_hashes.erase(it) : std::next(it);
+        }
+        return style_hashes.emplace(map, hash).first->second;
+    }
+
+    // Key of an output of the map, the parameters normalizing everything
+    // else which changes its bytes.
+    std::string key(std::shared_ptr<const mapnik::Map> const & map, std::string const & parameters)
+    {
+        std::ostringstream name;
+        name << std::hex << std::setw(16) << std::setfill('0')
+             << fnv1a(parameters, style_hash(map));
+        return name.str();
+    }
+
+    // Copies the cached output to the stream, returns false on a miss.
+    bool read(std::string const & key, std::ostream & stream)
+    {
+        boost::filesystem::path path(directory / key);
+        std::ifstream file;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it == index.end())
+            {
+                return false;
+            }
+            file.open(path.string(), std::ios::binary);
+            if (!file)
+            {
+                remove(it->second);
+                return false;
+            }
+            entries.splice(entries.end(), entries, it->second);
+        }
+        boost::system::error_code error;
+        boost::filesystem::last_write_time(path, std::time(nullptr), error);
+        stream << file.rdbuf();
+        return true;
+    }
+
+    // Writes the output produced by the function to the stream and, if
+    // the function succeeds, to the cache.
+    void store(std::string const & key, std::ostream & stream,
+               std::function<void(std::ostream &)> const & produce)
+    {
+        std::ostringstream temporary_name;
+        temporary_name << "." << key << "." << std::this_thread::get_id() << ".tmp";
+        boost::filesystem::path temporary(directory / temporary_name.str());
+        try
+        {
+            {
+                output_stream file(temporary.string());
+                tee_streambuf tee(stream, file);
+                std::ostream output(&tee);
+                produce(output);
+                if (!output.flush())
+                {
+                    throw std::runtime_error("Cannot write output");
+                }
+            }
+            boost::filesystem::rename(temporary, directory / key);
+        }
+        catch (...)
+        {
+            boost::system::error_code error;
+            boost::filesystem::remove(temporary, error);
+            throw;
+        }
+
+        std::uintmax_t size = boost::filesystem::file_size(directory / key);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            total_size -= it->second->size;
+            entries.erase(it->second);
+            index.erase(it);
+        }
+        add({ key, size });
+        evict();
+    }
+
+    std::uintmax_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return total_size;
+    }
+
+private:
+    void add(entry const & e)
+    {
+        index[e.key] = entries.insert(entries.end(), e);
+        total_size += e.size;
+    }
+
+    void remove(std::list<entry>::iterator it)
+    {
+        boost::system::error_code error;
+        boost::filesystem::remove(directory / it->key, error);
+        total_size -= it->size;
+        index.erase(it->key);
+        entries.erase(it);
+    }
+
+    void evict()
+    {
+        while (total_size > max_size && !entries.empty())
+        {
+            remove(entries.begin());
+        }
+    }
+};
+
+}
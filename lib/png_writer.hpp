@@ -0,0 +1,541 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <future>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <zlib.h>
+
+#include <mapnik/image.hpp>
+
+#include "thread_pool.hpp"
+
+namespace mapnik_print
+{
+
+enum class png_filter
+{
+    none = 0,
+    sub = 1,
+    up = 2,
+    average = 3,
+    paeth = 4,
+    // Picks the filter of each row giving the smallest sum of residuals.
+    adaptive = 5
+};
+
+struct png_options
+{
+    // Deflate level from 0 (stored) to 9 (smallest).
+    int level = 6;
+    png_filter filter = png_filter::adaptive;
+    // Threads compressing strips of rows, zero means one per core.
+    unsigned threads = 0;
+    // Uncompressed bytes per strip compressed on its own.
+    std::size_t strip_size = 1 << 20;
+
+    // Presets trading encoding time for file size.
+    static png_options fast()
+    {
+        png_options options;
+        options.level = 1;
+        options.filter = png_filter::up;
+        return options;
+    }
+
+    static png_options small()
+    {
+        png_options options;
+        options.level = 9;
+        options.strip_size = 4 << 20;
+        return options;
+    }
+};
+
+// Parses a preset name (fast, default, small) or a deflate level.
+inline png_options parse_png_options(std::string const & compression)
+{
+    if (compression == "fast")
+    {
+        return png_options::fast();
+    }
+    if (compression == "default")
+    {
+        return png_options();
+    }
+    if (compression == "small")
+    {
+        return png_options::small();
+    }
+    if (compression.size() == 1 && compression[0] >= '0' && compression[0] <= '9')
+    {
+        png_options options;
+        options.level = compression[0] - '0';
+        return options;
+    }
+    throw std::runtime_error("Invalid PNG compression: " + compression);
+}
+
+namespace png_detail
+{
+
+constexpr std::size_t bytes_per_pixel = 4;
+constexpr std::size_t window_size = 32768;
+
+// The filters are plain loops over bytes which the compiler vectorizes.
+inline void filter_row(png_filter filter,
+                       std::uint8_t const * __restrict row,
+                       std::uint8_t const * __restrict prev,
+                       std::uint8_t * __restrict out,
+                       std::size_t size)
+{
+    constexpr std::size_t bpp = bytes_per_pixel;
+    switch (filter)
+    {
+        case png_filter::none:
+            std::memcpy(out, row, size);
+            break;
+        case png_filter::sub:
+            for (std::size_t i = 0; i < bpp; i++)
+            {
+                out[i] = row[i];
+            }
+            for (std::size_t i = bpp; i < size; i++)
+            {
+                out[i] = row[i] - row[i - bpp];
+            }
+            break;
+        case png_filter::up:
+            for (std::size_t i = 0; i < size; i++)
+            {
+                out[i] = row[i] - prev[i];
+            }
+            break;
+        case png_filter::average:
+            for (std::size_t i = 0; i < bpp; i++)
+            {
+                out[i] = row[i] - (prev[i] >> 1);
+            }
+            for (std::size_t i = bpp; i < size; i++)
+            {
+                out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+            }
+            break;
+        default:
+            for (std::size_t i = 0; i < bpp; i++)
+            {
+                out[i] = row[i] - prev[i];
+            }
+            for (std::size_t i = bpp; i < size; i++)
+            {
+                int a = row[i - bpp];
+                int b = prev[i];
+                int c = prev[i - bpp];
+                int pa = std::abs(b - c);
+                int pb = std::abs(a - c);
+                int pc = std::abs(a + b - 2 * c);
+                int predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                out[i] = row[i] - predictor;
+            }
+            break;
+    }
+}
+
+inline std::size_t residual_sum(std::uint8_t const * data, std::size_t size)
+{
+    std::size_t sum = 0;
+    for (std::size_t i = 0; i < size; i++)
+    {
+        sum += std::abs(static_cast<std::int8_t>(data[i]));
+    }
+    return sum;
+}
+
+// Row of pixels as stored in the image being encoded.
+struct row_ref
+{
+    std::uint8_t const * data;
+    bool premultiplied;
+};
+
+// PNG stores straight alpha while mapnik images may be premultiplied.
+inline void load_row(row_ref const & row, std::uint8_t * target, std::size_t size)
+{
+    if (!row.premultiplied)
+    {
+        std::memcpy(target, row.data, size);
+        return;
+    }
+    for (std::size_t i = 0; i < size; i += bytes_per_pixel)
+    {
+        unsigned alpha = row.data[i + 3];
+        for (std::size_t c = 0; c < 3; c++)
+        {
+            target[i + c] = alpha ? std::min(255u, (row.data[i + c] * 255u + alpha / 2) / alpha) : 0;
+        }
+        target[i + 3] = alpha;
+    }
+}
+
+// Filters rows [begin, end), each prefixed with its filter type, into
+// out. The row before begin is the previous row of the first one, or
+// none when begin is the first row of the image.
+inline void filter_rows(std::vector<row_ref> const & rows, std::size_t begin, std::size_t end,
+                        std::size_t size, png_filter filter, std::string & out)
+{
+    // Scratch rows kept by each thread for the next strips.
+    thread_local std::vector<std::uint8_t> buffer;
+    thread_local std::vector<std::uint8_t> candidate;
+    buffer.resize(2 * size);
+    candidate.resize(filter == png_filter::adaptive ? size : 0);
+    std::uint8_t * prev = buffer.data();
+    std::uint8_t * row = buffer.data() + size;
+
+    // The scratch rows hold those of the last strip of the thread, which
+    // may be of another image.
+    if (begin > 0)
+    {
+        load_row(rows[begin - 1], prev, size);
+    }
+    else
+    {
+        std::fill(prev, prev + size, 0);
+    }
+    std::size_t offset = out.size();
+    out.resize(offset + (end - begin) * (size + 1));
+    for (std::size_t y = begin; y < end; y++)
+    {
+        load_row(rows[y], row, size);
+        std::uint8_t * target = reinterpret_cast<std::uint8_t *>(&out[offset]);
+        png_filter row_filter = filter;
+        if (filter == png_filter::adaptive)
+        {
+            std::size_t best = static_cast<std::size_t>(-1);
+            for (png_filter f : { png_filter::none, png_filter::sub, png_filter::up,
+                                  png_filter::average, png_filter::paeth })
+            {
+                filter_row(f, row, prev, candidate.data(), size);
+                std::size_t sum = residual_sum(candidate.data(), size);
+                if (sum < best)
+                {
+                    best = sum;
+                    row_filter = f;
+                    std::memcpy(target + 1, candidate.data(), size);
+                }
+            }
+        }
+        else
+        {
+            filter_row(filter, row, prev, target + 1, size);
+        }
+        target[0] = static_cast<std::uint8_t>(row_filter);
+        offset += size + 1;
+        std::swap(row, prev);
+    }
+}
+
+struct strip
+{
+    std::string data;
+    uLong adler;
+    std::size_t length;
+    bool last;
+};
+
+// Compresses the rows after the first context ones as a piece of a
+// single deflate stream, ending on a byte boundary unless it is the last
+// one. The context rows precede the strip in the image: they give the
+// previous row of the strip and prime the dictionary, as if the whole
+// image had been compressed at once. from_top tells whether the first
+// context row is the first row of the image.
+inline strip compress_strip(std::vector<row_ref> const & rows, std::size_t context, bool from_top,
+                            std::size_t size, png_options const & options, bool last)
+{
+    // Filtered rows are only needed until compressed: each thread keeps
+    // its buffers for the next strips.
+    thread_local std::string dictionary;
+    thread_local std::string input;
+    dictionary.clear();
+    input.clear();
+    if (context > 0)
+    {
+        filter_rows(rows, from_top ? 0 : 1, context, size, options.filter, dictionary);
+    }
+    filter_rows(rows, context, rows.size(), size, options.filter, input);
+
+    z_stream stream = {};
+    if (deflateInit2(&stream, options.level, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw std::runtime_error("Cannot initialize PNG compression");
+    }
+    if (!dictionary.empty())
+    {
+        std::size_t dictionary_size = std::min(dictionary.size(), window_size);
+        deflateSetDictionary(&stream,
+            reinterpret_cast<Bytef const *>(dictionary.data() + dictionary.size() - dictionary_size),
+            dictionary_size);
+    }
+
+    strip result;
+    result.last = last;
+    result.length = input.size();
+    result.adler = adler32(adler32(0, nullptr, 0),
+                           reinterpret_cast<Bytef const *>(input.data()), input.size());
+    result.data.resize(deflateBound(&stream, input.size()) + 16);
+    stream.next_in = reinterpret_cast<Bytef *>(&input[0]);
+    stream.avail_in = input.size();
+    stream.next_out = reinterpret_cast<Bytef *>(&result.data[0]);
+    stream.avail_out = result.data.size();
+    while (true)
+    {
+        int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (status == Z_STREAM_ERROR)
+        {
+            deflateEnd(&stream);
+            throw std::runtime_error("PNG compression failed");
+        }
+        if (last ? status == Z_STREAM_END : stream.avail_in == 0 && stream.avail_out > 0)
+        {
+            break;
+        }
+        std::size_t written = result.data.size() - stream.avail_out;
+        result.data.resize(result.data.size() * 2);
+        stream.next_out = reinterpret_cast<Bytef *>(&result.data[written]);
+        stream.avail_out = result.data.size() - written;
+    }
+    result.data.resize(result.data.size() - stream.avail_out);
+    deflateEnd(&stream);
+    return result;
+}
+
+inline void put_uint32(std::string & out, std::uint32_t value)
+{
+    out.push_back(static_cast<char>(value >> 24));
+    out.push_back(static_cast<char>(value >> 16));
+    out.push_back(static_cast<char>(value >> 8));
+    out.push_back(static_cast<char>(value));
+}
+
+inline void write_chunk(std::ostream & stream, char const * type, char const * data, std::size_t size)
+{
+    constexpr std::size_t max_chunk_size = 1u << 30;
+    do
+    {
+        std::size_t chunk_size = std::min(size, max_chunk_size);
+        std::string header;
+        put_uint32(header, chunk_size);
+        header.append(type, 4);
+        uLong crc = crc32(0, reinterpret_cast<Bytef const *>(type), 4);
+        if (chunk_size)
+        {
+            // A null buffer would reset the checksum.
+            crc = crc32(crc, reinterpret_cast<Bytef const *>(data), chunk_size);
+        }
+        std::string trailer;
+        put_uint32(trailer, crc);
+        stream.write(header.data(), header.size());
+        stream.write(data, chunk_size);
+        stream.write(trailer.data(), trailer.size());
+        data += chunk_size;
+        size -= chunk_size;
+    }
+    while (size > 0);
+}
+
+}
+
+// Streaming encoder of an 8 bit RGBA PNG, taking the rows of the image
+// in order in as many pieces as needed. Strips of rows are filtered and
+// compressed on a thread pool into one deflate stream, so that only the
+// rows being added and a few rows before them are needed in memory.
+class png_encoder
+{
+    std::ostream & stream;
+    const unsigned width;
+    const unsigned height;
+    const png_options options;
+    // Bytes of pixels per row.
+    const std::size_t row_size;
+    const unsigned strip_rows;
+    // Rows preceding a strip needed to compress it: enough to fill the
+    // deflate window plus the previous row of the first one.
+    const unsigned context_rows;
+    std::unique_ptr<thread_pool> pool;
+    // The last context rows added so far, with straight alpha.
+    std::vector<std::uint8_t> tail;
+    unsigned rows_added = 0;
+    unsigned strips_written = 0;
+    uLong adler = adler32(0, nullptr, 0);
+
+public:
+    png_encoder(std::ostream & stream, unsigned width, unsigned height,
+                png_options const & options = png_options())
+        : stream(stream),
+          width(width),
+          height(height),
+          options(options),
+          row_size(std::size_t(width) * png_detail::bytes_per_pixel),
+          strip_rows(std::max<std::size_t>(1, options.strip_size / (row_size + 1))),
+          context_rows((png_detail::window_size + row_size) / (row_size + 1) + 1)
+    {
+        if (width == 0 || height == 0)
+        {
+            throw std::runtime_error("Cannot encode an empty image as PNG");
+        }
+        if (options.threads != 1 && height > strip_rows)
+        {
+            pool.reset(new thread_pool(options.threads));
+        }
+
+        static char const signature[] = { '\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n' };
+        stream.write(signature, sizeof(signature));
+        std::string header;
+        png_detail::put_uint32(header, width);
+        png_detail::put_uint32(header, height);
+        header += std::string("\x08\x06\x00\x00\x00", 5);
+        png_detail::write_chunk(stream, "IHDR", header.data(), header.size());
+    }
+
+    png_encoder(png_encoder const &) = delete;
+    png_encoder & operator=(png_encoder const &) = delete;
+
+    unsigned rows() const
+    {
+        return rows_added;
+    }
+
+    // Encodes count rows of the image starting at row first, which follow
+    // the rows added before. The image is not used once this returns.
+    template <typename Image>
+    void add_rows(Image const & image, unsigned first, unsigned count)
+    {
+        using namespace png_detail;
+
+        if (image.width() != width || first + count > image.height() || rows_added + count > height)
+        {
+            throw std::runtime_error("Rows do not fit the PNG image");
+        }
+        std::size_t tail_rows = tail.size() / row_size;
+        std::vector<row_ref> rows;
+        rows.reserve(tail_rows + count);
+        for (std::size_t i = 0; i < tail_rows; i++)
+        {
+            rows.push_back({ tail.data() + i * row_size, false });
+        }
+        for (unsigned y = first; y < first + count; y++)
+        {
+            rows.push_back({ reinterpret_cast<std::uint8_t const *>(image.get_row(y)),
+                             image.get_premultiplied() });
+        }
+
+        // Bounds the compressed strips waiting to be written.
+        std::size_t max_pending = pool ? 2 * pool->size() : 1;
+        std::deque<std::future<strip>> pending;
+        std::size_t begin = tail_rows;
+        try
+        {
+            while (begin < rows.size() || !pending.empty())
+            {
+                while (begin < rows.size() && pending.size() < max_pending)
+                {
+                    std::size_t end = std::min<std::size_t>(rows.size(), begin + strip_rows);
+                    std::size_t context_begin = begin - std::min<std::size_t>(begin, context_rows);
+                    // Row of the image the strip starts at.
+                    std::size_t position = rows_added + begin - tail_rows;
+                    std::vector<row_ref> strip_refs(rows.begin() + context_begin, rows.begin() + end);
+                    std::size_t context = begin - context_begin;
+                    bool from_top = position == context;
+                    bool last = position + (end - begin) == height;
+                    auto compress = [this, strip_refs, context, from_top, last] {
+                        return compress_strip(strip_refs, context, from_top, row_size, options, last);
+                    };
+                    if (pool)
+                    {
+                        pending.push_back(pool->submit(std::move(compress)));
+                    }
+                    else
+                    {
+                        std::promise<strip> result;
+                        result.set_value(compress());
+                        pending.push_back(result.get_future());
+                    }
+                    begin = end;
+                }
+                strip s(pending.front().get());
+                pending.pop_front();
+                write_strip(s);
+            }
+        }
+        catch (...)
+        {
+            // The strips being compressed still read the image.
+            for (std::future<strip> & result : pending)
+            {
+                result.wait();
+            }
+            throw;
+        }
+        rows_added += count;
+
+        // Keeps the rows the next strip needs, the image going away.
+        std::size_t keep = std::min<std::size_t>(rows.size(), context_rows);
+        std::vector<std::uint8_t> new_tail(keep * row_size);
+        for (std::size_t i = 0; i < keep; i++)
+        {
+            load_row(rows[rows.size() - keep + i], new_tail.data() + i * row_size, row_size);
+        }
+        tail.swap(new_tail);
+    }
+
+    void finish()
+    {
+        if (rows_added != height)
+        {
+            throw std::runtime_error("Missing rows in PNG image");
+        }
+        png_detail::write_chunk(stream, "IEND", nullptr, 0);
+        if (!stream)
+        {
+            throw std::runtime_error("Cannot write PNG output");
+        }
+    }
+
+private:
+    void write_strip(png_detail::strip & s)
+    {
+        adler = adler32_combine(adler, s.adler, s.length);
+        if (strips_written == 0)
+        {
+            // The zlib header is informative about the level only.
+            std::string header("\x78", 1);
+            header.push_back(options.level < 2 ? '\x01' : options.level < 6 ? '\x5e' :
+                             options.level == 6 ? '\x9c' : '\xda');
+            s.data.insert(0, header);
+        }
+        strips_written++;
+        if (s.last)
+        {
+            png_detail::put_uint32(s.data, adler);
+        }
+        png_detail::write_chunk(stream, "IDAT", s.data.data(), s.data.size());
+    }
+};
+
+// Encodes the whole image as an 8 bit RGBA PNG.
+template <typename Image>
+void write_png(Image const & image, std::ostream & stream, png_options const & options = png_options())
+{
+    png_encoder encoder(stream, image.width(), image.height(), options);
+    encoder.add_rows(image, 0, image.height());
+    encoder.finish();
+}
+
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <mapnik/map.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/datasource.hpp>
+#include <mapnik/feature.hpp>
+#include <mapnik/query.hpp>
+
+#include "renderer.hpp"
+#include "feature_cache.hpp"
+
+namespace mapnik_print
+{
+
+struct progressive_options
+{
+    boost::filesystem::path preview_path;
+    double preview_dpi = 72.0;
+    png_options preview_png = png_options::fast();
+};
+
+// Whether the datasources of a capturing map record the features they
+// read, only done during the preview pass.
+struct feature_capture
+{
+    std::atomic<bool> recording{ true };
+    // Ratio of the resolution of the final pass to that of the preview.
+    double resolution_factor = 1.0;
+};
+
+// Vector datasource proxy recording the features of the preview queries
+// to serve the queries of the final pass they cover.
+//
+// Preview queries are made at the resolution of the final pass, since
+// datasources may simplify geometries to the query resolution, and with
+// a slightly larger extent, since the final extent is fitted to a
+// different pixel size.
+class capturing_datasource : public mapnik::datasource
+{
+    struct entry
+    {
+        mapnik::box2d<double> bbox;
+        std::set<std::string> property_names;
+        std::shared_ptr<const std::vector<mapnik::feature_ptr>> features;
+    };
+
+    const mapnik::datasource_ptr ds;
+    const std::shared_ptr<feature_capture> capture;
+    // Properties recorded on top of those of the queries, for a later
+    // pass needing more.
+    const std::set<std::string> extra_properties;
+    mutable std::mutex mutex;
+    mutable std::vector<entry> entries;
+
+public:
+    static constexpr double margin = 0.01;
+
+    capturing_datasource(mapnik::datasource_ptr const & ds, std::shared_ptr<feature_capture> const & capture,
+                         std::set<std::string> const & extra_properties = {})
+        : mapnik::datasource(ds->params()), ds(ds), capture(capture), extra_properties(extra_properties)
+    {
+    }
+
+    datasource_t type() const override
+    {
+        return ds->type();
+    }
+
+    mapnik::featureset_ptr features(mapnik::query const & q) const override
+    {
+        return query(q, [&](mapnik::query const & forwarded) { return ds->features(forwarded); });
+    }
+
+    mapnik::featureset_ptr features_with_context(mapnik::query const & q,
+                                                 mapnik::processor_context_ptr ctx) const override
+    {
+        return query(q, [&](mapnik::query const & forwarded) {
+            return ds->features_with_context(forwarded, ctx);
+        });
+    }
+
+    mapnik::processor_context_ptr get_context(mapnik::feature_style_context_map & ctx) const override
+    {
+        return ds->get_context(ctx);
+    }
+
+    mapnik::featureset_ptr features_at_point(mapnik::coord2d const & pt, double tol) const override
+    {
+        return ds->features_at_point(pt, tol);
+    }
+
+    mapnik::box2d<double> envelope() const override
+    {
+        return ds->envelope();
+    }
+
+    boost::optional<mapnik::datasource_geometry_t> get_geometry_type() const override
+    {
+        return ds->get_geometry_type();
+    }
+
+    mapnik::layer_descriptor get_descriptor() const override
+    {
+        return ds->get_descriptor();
+    }
+
+private:
+    template <typename Query>
+    mapnik::featureset_ptr query(mapnik::query const & q, Query forward) const
+    {
+        if (!capture->recording)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (entry const & e : entries)
+            {
+                if (e.bbox.contains(q.get_bbox()) &&
+                    std::includes(e.property_names.begin(), e.property_names.end(),
+                                  q.property_names().begin(), q.property_names().end()))
+                {
+                    return std::make_shared<feature_list_featureset>(e.features);
+                }
+            }
+            return forward(q);
+        }
+
+        mapnik::box2d<double> bbox(q.get_bbox());
+        bbox.pad(std::max(bbox.width(), bbox.height()) * margin);
+        mapnik::query::resolution_type resolution(
+            std::get<0>(q.resolution()) * capture->resolution_factor,
+            std::get<1>(q.resolution()) * capture->resolution_factor);
+        mapnik::query recorded(bbox, resolution, q.scale_denominator(), q.get_unbuffered_bbox());
+        std::set<std::string> property_names(q.property_names());
+        property_names.insert(extra_properties.begin(), extra_properties.end());
+        for (std::string const & name : property_names)
+        {
+            recorded.add_property_name(name);
+        }
+        recorded.set_filter_factor(q.get_filter_factor());
+        recorded.set_variables(q.variables());
+
+        auto features = std::make_shared<std::vector<mapnik::feature_ptr>>();
+        mapnik::featureset_ptr fs(forward(recorded));
+        if (fs)
+        {
+            while (mapnik::feature_ptr feature = fs->next())
+            {
+                features->push_back(feature);
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.push_back({ bbox, property_names, features });
+        return std::make_shared<feature_list_featureset>(features);
+    }
+};
+
+// Copy of the map whose vector layers share the features read by the
+// preview with the final pass. Raster layers are queried by both. The
+// layers of extra_properties also record the given properties.
+inline shared_map capture_features(mapnik::Map const & map, std::shared_ptr<feature_capture> const & capture,
+                                   std::map<std::string, std::set<std::string>> const & extra_properties = {})
+{
+    auto copy = std::make_shared<mapnik::Map>(map);
+    for (mapnik::layer & lyr : copy->layers())
+    {
+        if (lyr.datasource() && lyr.datasource()->type() == mapnik::datasource::Vector)
+        {
+            auto extra = extra_properties.find(lyr.name());
+            lyr.set_datasource(std::make_shared<capturing_datasource>(
+                lyr.datasource(), capture,
+                extra == extra_properties.end() ? std::set<std::string>() : extra->second));
+        }
+    }
+    return copy;
+}
+
+// Writes a quick agg preview of the command at low resolution, calls
+// preview_done and then final_render with the renderer of the final
+// output, which reuses the features the preview read. Both renderers are
+// set up by configure, the preview without output cache since it is
+// rendered for the features it reads.
+template <typename Renderer, typename Configure, typename PreviewDone, typename FinalRender>
+void render_progressive(shared_map const & map,
+                        command const & cmd,
+                        tile_options const & tiles,
+                        progressive_options const & options,
+                        Configure && configure,
+                        PreviewDone && preview_done,
+                        FinalRender && final_render)
+{
+    auto capture = std::make_shared<feature_capture>();
+    capture->resolution_factor = Renderer().resolution(cmd.dpi) / options.preview_dpi;
+    shared_map capturing(capture_features(*map, capture));
+
+    command preview_cmd(cmd);
+    preview_cmd.dpi = options.preview_dpi;
+    {
+        renderer<agg_renderer> preview(capturing, tiles);
+        configure(preview);
+        preview.set_png_options(options.preview_png);
+        preview.set_cache(nullptr);
+        preview.render(preview_cmd, options.preview_path);
+    }
+    capture->recording = false;
+    preview_done();
+
+    renderer<Renderer> final_renderer(capturing, tiles);
+    configure(final_renderer);
+    final_render(final_renderer);
+}
+
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include <mapnik/projection.hpp>
+
+namespace mapnik_print
+{
+
+// Projections shared by all commands and threads, built once per SRS.
+//
+// Building a mapnik::projection parses the definition and sets up the
+// PROJ context, which is far more expensive than projecting a point.
+// A PROJ context must not be used by several threads at once, so every
+// projection is used under its own lock. Commands may name any SRS:
+// beyond max_entries, the least recently used projection is dropped.
+class projection_cache
+{
+    struct entry
+    {
+        const mapnik::projection proj;
+        std::mutex mutex;
+        std::atomic<std::uint64_t> used{ 0 };
+
+        explicit entry(std::string const & srs)
+            : proj(srs)
+        {
+        }
+    };
+
+    static constexpr std::size_t max_entries = 64;
+
+    std::shared_mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<entry>> entries;
+    std::atomic<std::uint64_t> uses{ 0 };
+
+public:
+    static projection_cache & instance()
+    {
+        static projection_cache cache;
+        return cache;
+    }
+
+    // Projects the point in the given SRS to geographic coordinates.
+    bool inverse(std::string const & srs, double & x, double & y)
+    {
+        std::shared_ptr<entry> e(find(srs));
+        std::lock_guard<std::mutex> lock(e->mutex);
+        return e->proj.inverse(x, y);
+    }
+
+    bool forward(std::string const & srs, double & x, double & y)
+    {
+        std::shared_ptr<entry> e(find(srs));
+        std::lock_guard<std::mutex> lock(e->mutex);
+        return e->proj.forward(x, y);
+    }
+
+    std::size_t size()
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return entries.size();
+    }
+
+private:
+    // Dropped entries live on while in use.
+    std::shared_ptr<entry> find(std::string const & srs)
+    {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto it = entries.find(srs);
+            if (it != entries.end())
+            {
+                it->second->used = ++uses;
+                return it->second;
+            }
+        }
+        // Invalid definitions throw here and are not cached.
+        auto e = std::make_shared<entry>(srs);
+        e->used = ++uses;
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto inserted = entries.emplace(srs, e);
+        if (inserted.second && entries.size() > max_entries)
+        {
+            auto oldest = entries.end();
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+            {
+                if (it != inserted.first && (oldest == entries.end() || it->second->used < oldest->second->used))
+                {
+                    oldest = it;
+                }
+            }
+            entries.erase(oldest);
+        }
+        return inserted.first->second;
+    }
+};
+
+}
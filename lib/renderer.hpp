@@ -4,22 +4,39 @@
 #include <iomanip>
 #include <fstream>
 #include <memory>
+#include <stdexcept>
+#include <set>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <type_traits>
 
 #include <mapnik/map.hpp>
 #include <mapnik/image_util.hpp>
 #include <mapnik/image_reader.hpp>
 #include <mapnik/util/variant.hpp>
+#include <mapnik/request.hpp>
+#include <mapnik/attribute.hpp>
 #include <mapnik/agg_renderer.hpp>
 #if defined(GRID_RENDERER)
+#include <mapnik/grid/grid.hpp>
 #include <mapnik/grid/grid_renderer.hpp>
 #endif
 
 #include <mapnik/projection.hpp>
 #include <mapnik/scale_denominator.hpp>
+#include <mapnik/rule.hpp>
+#include <mapnik/symbolizer.hpp>
+#include <mapnik/feature_type_style.hpp>
+#include <mapnik/datasource.hpp>
+#include <mapnik/query.hpp>
 
 #if defined(HAVE_CAIRO)
 #include <mapnik/cairo/cairo_renderer.hpp>
-#include <mapnik/cairo/cairo_image_util.hpp>
 #ifdef CAIRO_HAS_SVG_SURFACE
 #include <cairo-svg.h>
 #endif
@@ -33,6 +50,18 @@
 
 #include <boost/filesystem.hpp>
 
+#include "output.hpp"
+#include "async_writer.hpp"
+#include "png_writer.hpp"
+#include "output_cache.hpp"
+#include "tiling.hpp"
+#include "image_pool.hpp"
+#include "projection_cache.hpp"
+#include "layer_pruning.hpp"
+#if defined(GRID_RENDERER)
+#include "utfgrid.hpp"
+#endif
+
 #ifndef HAVE_CAIRO
     Mapnik must be compiled with Cairo support
 #endif
@@ -40,6 +69,564 @@
 namespace mapnik_print
 {
 
+// Receives notifications about the progress of a render. Tiled
+// rendering notifies from several threads at once.
+struct render_listener
+{
+    virtual ~render_listener() {}
+    virtual void layer_begin(mapnik::layer const &) {}
+    virtual void layer_end(mapnik::layer const &) {}
+    virtual void stage_begin(char const *) {}
+    virtual void stage_end(char const *) {}
+    virtual void counter(char const *, double) {}
+};
+
+class render_stage
+{
+    render_listener * const listener;
+    char const * const name;
+
+public:
+    render_stage(render_listener * listener, char const * name)
+        : listener(listener), name(name)
+    {
+        if (listener)
+        {
+            listener->stage_begin(name);
+        }
+    }
+
+    ~render_stage()
+    {
+        if (listener)
+        {
+            listener->stage_end(name);
+        }
+    }
+};
+
+// Maps are loaded once and then only read, so that any number of
+// renderers and threads can render from the same instance.
+using shared_map = std::shared_ptr<const mapnik::Map>;
+
+inline mapnik::request map_request(mapnik::Map const & map)
+{
+    mapnik::request req(map.width(), map.height(), map.get_current_extent());
+    req.set_buffer_size(map.buffer_size());
+    return req;
+}
+
+// Request rendering the extent of the map at the given size, the extent
+// being grown to the aspect ratio of the size like mapnik::Map::zoom_to_box
+// does by default.
+inline mapnik::request map_request(mapnik::Map const & map, unsigned width, unsigned height,
+                                   mapnik::box2d<double> extent)
+{
+    double ratio = double(width) / height;
+    double extent_ratio = extent.width() / extent.height();
+    if (extent_ratio > ratio)
+    {
+        extent.height(extent.width() / ratio);
+    }
+    else if (extent_ratio < ratio)
+    {
+        extent.width(extent.height() * ratio);
+    }
+    mapnik::request req(width, height, extent);
+    req.set_buffer_size(map.buffer_size());
+    return req;
+}
+
+// Job specific view of a shared map: what to render and how large.
+struct map_view
+{
+    mapnik::request req;
+    double scale_factor;
+};
+
+// Renders the layer unless it cannot contribute to the request (see
+// layer_contributes), returning whether it did.
+template <typename Processor>
+bool render_layer(Processor & ren, mapnik::Map const & map, mapnik::layer const & lyr,
+                  mapnik::projection const & proj, mapnik::request const & req, double scale_denom,
+                  std::set<std::string> & names, render_listener * listener)
+{
+    if (!layer_contributes(map, lyr, req, scale_denom))
+    {
+        return false;
+    }
+    if (listener)
+    {
+        listener->layer_begin(lyr);
+    }
+    ren.apply_to_layer(lyr, ren, proj, req.scale(), scale_denom,
+                       req.width(), req.height(), req.extent(),
+                       req.buffer_size(), names);
+    if (listener)
+    {
+        listener->layer_end(lyr);
+    }
+    return true;
+}
+
+// Renders the layers of the map for the given request, which may cover
+// a different extent and size than the map itself.
+template <typename Processor>
+void render_layers(Processor & ren, mapnik::Map const & map,
+                   mapnik::request const & req, double scale_factor,
+                   render_listener * listener = nullptr)
+{
+    mapnik::projection proj(map.srs(), true);
+    double scale_denom = mapnik::scale_denominator(req.scale(), proj.is_geographic());
+    scale_denom *= scale_factor;
+    std::set<std::string> names;
+
+    std::size_t pruned = 0;
+    ren.start_map_processing(map);
+    for (mapnik::layer const & lyr : map.layers())
+    {
+        if (!render_layer(ren, map, lyr, proj, req, scale_denom, names, listener) && lyr.visible(scale_denom))
+        {
+            pruned++;
+        }
+    }
+    ren.end_map_processing(map);
+    if (listener)
+    {
+        listener->counter("layers_pruned", pruned);
+    }
+}
+
+// Whether the layer can be drawn on a surface of its own and composited
+// over the layers below afterwards: it places no symbols, which have to
+// avoid the symbols of other layers, and blends with nothing below.
+inline bool renders_independently(mapnik::Map const & map, mapnik::layer const & lyr)
+{
+    if (lyr.comp_op())
+    {
+        return false;
+    }
+    for (std::string const & name : lyr.styles())
+    {
+        boost::optional<mapnik::feature_type_style const &> style(map.find_style(name));
+        if (!style)
+        {
+            continue;
+        }
+        if (style->comp_op() || !style->image_filters().empty())
+        {
+            return false;
+        }
+        for (mapnik::rule const & r : style->get_rules())
+        {
+            for (mapnik::symbolizer const & sym : r)
+            {
+                bool independent = mapnik::util::apply_visitor([](auto const & s) {
+                    using symbolizer_type = typename std::decay<decltype(s)>::type;
+                    constexpr bool places_symbols =
+                        std::is_base_of<mapnik::text_symbolizer, symbolizer_type>::value ||
+                        std::is_same<symbolizer_type, mapnik::point_symbolizer>::value ||
+                        std::is_same<symbolizer_type, mapnik::markers_symbolizer>::value ||
+                        std::is_same<symbolizer_type, mapnik::group_symbolizer>::value;
+                    return !places_symbols && s.properties.find(mapnik::keys::comp_op) == s.properties.end();
+                }, sym);
+                if (!independent)
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Renders runs of independent layers on a thread pool, each run split in
+// up to one stack of consecutive layers per thread drawn into a
+// recording surface. The final pass paints the recordings in layer order
+// and draws the other layers itself, so that all symbols are placed by a
+// single renderer.
+inline void render_layers_parallel(mapnik::cairo_ptr const & context, mapnik::Map const & map,
+                                   mapnik::request const & req, double scale_factor,
+                                   unsigned threads, render_listener * listener = nullptr)
+{
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    mapnik::projection proj(map.srs(), true);
+    double scale_denom = mapnik::scale_denominator(req.scale(), proj.is_geographic());
+    scale_denom *= scale_factor;
+
+    struct segment
+    {
+        std::vector<mapnik::layer const *> layers;
+        bool stack;
+        std::future<mapnik::cairo_surface_ptr> recording;
+    };
+    std::vector<segment> segments;
+    std::vector<mapnik::layer const *> run;
+    auto end_run = [&] {
+        std::size_t stacks = std::min<std::size_t>(run.size(), threads);
+        for (std::size_t i = 0; i < stacks; i++)
+        {
+            segments.push_back({ std::vector<mapnik::layer const *>(run.begin() + run.size() * i / stacks,
+                                                                    run.begin() + run.size() * (i + 1) / stacks),
+                                 true, {} });
+        }
+        run.clear();
+    };
+    for (mapnik::layer const & lyr : map.layers())
+    {
+        if (!layer_contributes(map, lyr, req, scale_denom))
+        {
+            continue;
+        }
+        if (renders_independently(map, lyr))
+        {
+            run.push_back(&lyr);
+        }
+        else
+        {
+            end_run();
+            segments.push_back({ { &lyr }, false, {} });
+        }
+    }
+    end_run();
+
+    thread_pool pool(threads);
+    for (segment & s : segments)
+    {
+        if (!s.stack)
+        {
+            continue;
+        }
+        s.recording = pool.submit([&, layers = s.layers] {
+            cairo_rectangle_t extents = { 0, 0, double(req.width()), double(req.height()) };
+            mapnik::cairo_surface_ptr surface(
+                cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents),
+                mapnik::cairo_surface_closer());
+            mapnik::cairo_ptr stack_context(mapnik::create_context(surface));
+            // The renderer paints the map background when created, which
+            // belongs to the final pass only.
+            cairo_set_operator(&*stack_context, CAIRO_OPERATOR_DEST);
+            mapnik::attributes vars;
+            mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, req, vars, stack_context, scale_factor);
+            cairo_set_operator(&*stack_context, CAIRO_OPERATOR_OVER);
+            mapnik::projection stack_proj(map.srs(), true);
+            std::set<std::string> names;
+            ren.start_map_processing(map);
+            for (mapnik::layer const * lyr : layers)
+            {
+                render_layer(ren, map, *lyr, stack_proj, req, scale_denom, names, listener);
+            }
+            ren.end_map_processing(map);
+            return surface;
+        });
+    }
+
+    mapnik::attributes vars;
+    mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, req, vars, context, scale_factor);
+    std::set<std::string> names;
+    ren.start_map_processing(map);
+    for (segment & s : segments)
+    {
+        if (s.stack)
+        {
+            mapnik::cairo_surface_ptr recording(s.recording.get());
+            cairo_save(&*context);
+            cairo_set_source_surface(&*context, &*recording, 0, 0);
+            cairo_paint(&*context);
+            cairo_restore(&*context);
+        }
+        else
+        {
+            render_layer(ren, map, *s.layers.front(), proj, req, scale_denom, names, listener);
+        }
+    }
+    ren.end_map_processing(map);
+}
+
+// Layers of vector output drawn as embedded images, so that documents of
+// dense layers stay small and fast to print. Layers are rasterized when
+// named by the comma separated raster_layers parameter of the map, or
+// when they have more features in the view than max_features. Only
+// layers placing no symbols are (see renders_independently), text and
+// symbols being placed by the vector renderer.
+struct hybrid_options
+{
+    bool enabled = false;
+    // Zero for the named layers only, raster datasources counting as
+    // above any threshold.
+    std::size_t max_features = 0;
+    // Resolution of the images, the one of the command when zero.
+    double dpi = 0;
+    // Pixels of an image beyond which its resolution is lowered.
+    std::size_t max_pixels = std::size_t(64) << 20;
+};
+
+// Settings of the vector renderers only.
+struct vector_options
+{
+    // Independent layers are drawn on the threads of the tile options.
+    bool parallel_layers = false;
+    // Heavy layers are drawn as images when enabled, without drawing
+    // layers in parallel.
+    hybrid_options hybrid;
+};
+
+// Names of the layers the map asks to rasterize in hybrid output, its
+// comma separated raster_layers parameter.
+inline std::set<std::string> raster_layer_names(mapnik::Map const & map)
+{
+    std::set<std::string> names;
+    std::istringstream list(map.get_extra_parameters().get<std::string>("raster_layers").get_value_or(""));
+    std::string name;
+    while (std::getline(list, name, ','))
+    {
+        if (!name.empty())
+        {
+            names.insert(name);
+        }
+    }
+    return names;
+}
+
+// Featureset returning the features read before and then the rest of
+// the featureset they were read from.
+class resumed_featureset : public mapnik::Featureset
+{
+    const std::vector<mapnik::feature_ptr> features;
+    const mapnik::featureset_ptr rest;
+    std::size_t position = 0;
+
+public:
+    resumed_featureset(std::vector<mapnik::feature_ptr> && features, mapnik::featureset_ptr const & rest)
+        : features(std::move(features)), rest(rest)
+    {
+    }
+
+    mapnik::feature_ptr next() override
+    {
+        if (position < features.size())
+        {
+            return features[position++];
+        }
+        return rest ? rest->next() : mapnik::feature_ptr();
+    }
+};
+
+// Vector datasource proxy counting the features of a query up to one
+// more than a limit. The first query it covers resumes from the counted
+// features instead of reading them again, the others are forwarded.
+class counted_datasource : public mapnik::datasource
+{
+    const mapnik::datasource_ptr ds;
+    const mapnik::box2d<double> bbox;
+    const std::set<std::string> property_names;
+    std::size_t counted = 0;
+    mutable std::shared_ptr<resumed_featureset> resumed;
+
+public:
+    counted_datasource(mapnik::datasource_ptr const & ds, mapnik::query const & q, std::size_t max_features)
+        : mapnik::datasource(ds->params()), ds(ds), bbox(q.get_bbox()), property_names(q.property_names())
+    {
+        mapnik::featureset_ptr fs(ds->features(q));
+        std::vector<mapnik::feature_ptr> features;
+        while (fs && counted <= max_features)
+        {
+            mapnik::feature_ptr feature(fs->next());
+            if (!feature)
+            {
+                fs.reset();
+                break;
+            }
+            features.push_back(feature);
+            counted++;
+        }
+        resumed = std::make_shared<resumed_featureset>(std::move(features), fs);
+    }
+
+    std::size_t count() const
+    {
+        return counted;
+    }
+
+    datasource_t type() const override
+    {
+        return ds->type();
+    }
+
+    mapnik::featureset_ptr features(mapnik::query const & q) const override
+    {
+        mapnik::featureset_ptr fs(resume(q));
+        return fs ? fs : ds->features(q);
+    }
+
+    mapnik::featureset_ptr features_with_context(mapnik::query const & q,
+                                                 mapnik::processor_context_ptr ctx) const override
+    {
+        mapnik::featureset_ptr fs(resume(q));
+        return fs ? fs : ds->features_with_context(q, ctx);
+    }
+
+    mapnik::processor_context_ptr get_context(mapnik::feature_style_context_map & ctx) const override
+    {
+        return ds->get_context(ctx);
+    }
+
+    mapnik::featureset_ptr features_at_point(mapnik::coord2d const & pt, double tol) const override
+    {
+        return ds->features_at_point(pt, tol);
+    }
+
+    mapnik::box2d<double> envelope() const override
+    {
+        return ds->envelope();
+    }
+
+    boost::optional<mapnik::datasource_geometry_t> get_geometry_type() const override
+    {
+        return ds->get_geometry_type();
+    }
+
+    mapnik::layer_descriptor get_descriptor() const override
+    {
+        return ds->get_descriptor();
+    }
+
+private:
+    mapnik::featureset_ptr resume(mapnik::query const & q) const
+    {
+        if (resumed && bbox.contains(q.get_bbox()) &&
+            std::includes(property_names.begin(), property_names.end(),
+                          q.property_names().begin(), q.property_names().end()))
+        {
+            return std::move(resumed);
+        }
+        return mapnik::featureset_ptr();
+    }
+};
+
+// Whether the layer has more features than the given number in the
+// request extent, counting them up to one more with all their
+// properties. The datasource of the layer is then replaced by a proxy
+// drawing the layer from the counted features (see counted_datasource).
+inline bool has_more_features(mapnik::Map const & map, mapnik::layer & lyr, mapnik::request const & req,
+                              double scale_denom, std::size_t max_features)
+{
+    mapnik::datasource_ptr ds(lyr.datasource());
+    if (!ds)
+    {
+        return false;
+    }
+    if (ds->type() == mapnik::datasource::Raster)
+    {
+        return true;
+    }
+    mapnik::box2d<double> extent(req.extent());
+    int buffer = std::max(req.buffer_size(), lyr.buffer_size().get_value_or(0));
+    extent.pad(buffer * req.extent().width() / req.width());
+    if (lyr.srs() != map.srs() && !project_box(mapnik::box2d<double>(extent), map.srs(), lyr.srs(), extent))
+    {
+        return false;
+    }
+    // The layer queries of the renderer project the extent on their own.
+    extent.pad(std::max(extent.width(), extent.height()) * 0.01);
+    mapnik::query q(extent, mapnik::query::resolution_type(req.width() / extent.width(),
+                                                           req.height() / extent.height()),
+                    scale_denom);
+    for (mapnik::attribute_descriptor const & attribute : ds->get_descriptor().get_descriptors())
+    {
+        q.add_property_name(attribute.get_name());
+    }
+    auto counted = std::make_shared<counted_datasource>(ds, q, max_features);
+    lyr.set_datasource(counted);
+    return counted->count() > max_features;
+}
+
+// Draws the layer into an image at the given resolution, covering the
+// request, and paints it onto the context of the request.
+inline void paint_raster_layer(mapnik::cairo_ptr const & context, mapnik::Map const & map,
+                               mapnik::layer const & lyr, mapnik::request const & req, double scale_factor,
+                               double scale_denom, double factor, std::size_t max_pixels,
+                               render_listener * listener)
+{
+    double pixels = req.width() * factor * req.height() * factor;
+    if (max_pixels > 0 && pixels > max_pixels)
+    {
+        factor *= std::sqrt(max_pixels / pixels);
+    }
+    unsigned width = std::max(1l, std::lround(req.width() * factor));
+    unsigned height = std::max(1l, std::lround(req.height() * factor));
+    mapnik::request raster_req(width, height, req.extent());
+    raster_req.set_buffer_size(static_cast<int>(std::ceil(req.buffer_size() * factor)));
+
+    mapnik::cairo_surface_ptr surface(cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height),
+                                      mapnik::cairo_surface_closer());
+    {
+        mapnik::cairo_ptr raster_context(mapnik::create_context(surface));
+        // The map background belongs to the vector output.
+        cairo_set_operator(&*raster_context, CAIRO_OPERATOR_DEST);
+        mapnik::attributes vars;
+        mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, raster_req, vars, raster_context, scale_factor * factor);
+        cairo_set_operator(&*raster_context, CAIRO_OPERATOR_OVER);
+        mapnik::projection proj(map.srs(), true);
+        std::set<std::string> names;
+        ren.start_map_processing(map);
+        render_layer(ren, map, lyr, proj, raster_req, scale_denom, names, listener);
+        ren.end_map_processing(map);
+    }
+    cairo_surface_flush(&*surface);
+
+    cairo_save(&*context);
+    cairo_scale(&*context, double(req.width()) / width, double(req.height()) / height);
+    cairo_set_source_surface(&*context, &*surface, 0, 0);
+    cairo_paint(&*context);
+    cairo_restore(&*context);
+    if (listener)
+    {
+        listener->counter("raster_layer_pixels", double(width) * height);
+    }
+}
+
+// Renders the layers onto the vector context, the independent ones
+// which are named by the map or heavy (see hybrid_options) as images of
+// factor times the resolution of the request.
+inline void render_layers_hybrid(mapnik::cairo_ptr const & context, mapnik::Map const & map,
+                                 mapnik::request const & req, double scale_factor, double factor,
+                                 hybrid_options const & options, render_listener * listener = nullptr)
+{
+    mapnik::projection proj(map.srs(), true);
+    double scale_denom = mapnik::scale_denominator(req.scale(), proj.is_geographic());
+    scale_denom *= scale_factor;
+    std::set<std::string> raster_names(raster_layer_names(map));
+
+    mapnik::attributes vars;
+    mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, req, vars, context, scale_factor);
+    std::set<std::string> names;
+    ren.start_map_processing(map);
+    for (mapnik::layer const & lyr : map.layers())
+    {
+        if (!layer_contributes(map, lyr, req, scale_denom) || !renders_independently(map, lyr))
+        {
+            render_layer(ren, map, lyr, proj, req, scale_denom, names, listener);
+            continue;
+        }
+        mapnik::layer counted(lyr);
+        if (raster_names.count(lyr.name()) ||
+            (options.max_features > 0 && has_more_features(map, counted, req, scale_denom, options.max_features)))
+        {
+            paint_raster_layer(context, map, counted, req, scale_factor, scale_denom, factor,
+                               options.max_pixels, listener);
+        }
+        else
+        {
+            render_layer(ren, map, counted, proj, req, scale_denom, names, listener);
+        }
+    }
+    ren.end_map_processing(map);
+}
+
 template <typename ImageType>
 struct raster_renderer_base
 {
@@ -47,10 +634,30 @@ struct raster_renderer_base
 
     static constexpr const char * ext = ".png";
     static constexpr const bool support_tiles = true;
+    static constexpr const bool support_streaming = false;
+    static constexpr const bool support_pages = false;
+    static constexpr const bool support_replay = false;
 
-    void save(image_type const & image, boost::filesystem::path const& path) const
+    double resolution(double dpi) const
+    {
+        return dpi;
+    }
+
+    void save(image_type const & image, boost::filesystem::path const& path,
+              png_options const & options = png_options()) const
+    {
+        output_stream stream(path.string());
+        write_png(image, stream, options);
+        if (!stream.flush())
+        {
+            throw std::runtime_error("Cannot write output: " + path.string());
+        }
+    }
+
+    void save(image_type const & image, std::ostream & stream,
+              png_options const & options = png_options()) const
     {
-        mapnik::save_to_file(image, path.string(), "png32");
+        write_png(image, stream, options);
     }
 };
 
@@ -59,6 +666,8 @@ struct vector_renderer_base
     using image_type = std::string;
 
     static constexpr const bool support_tiles = false;
+    static constexpr const bool support_streaming = true;
+    static constexpr const bool support_pages = false;
 
     void save(image_type const & image, boost::filesystem::path const& path) const
     {
@@ -69,65 +678,197 @@ struct vector_renderer_base
         }
         file << image;
     }
+
+    void save(image_type const & image, std::ostream & stream) const
+    {
+        stream << image;
+    }
 };
 
+inline mapnik::image_rgba8 acquire_image(image_pool * pool, unsigned width, unsigned height)
+{
+    return pool ? pool->acquire(width, height) : mapnik::image_rgba8(width, height);
+}
+
 struct agg_renderer : raster_renderer_base<mapnik::image_rgba8>
 {
     static constexpr const char * name = "agg";
 
-    image_type render(mapnik::Map const & map, double scale_factor) const
+    // Draws into an image of the pool when given.
+    image_type render(mapnik::Map const & map, mapnik::request const & req, double scale_factor,
+                      render_listener * listener = nullptr, image_pool * pool = nullptr) const
     {
-        image_type image(map.width(), map.height());
-        mapnik::agg_renderer<image_type> ren(map, image, scale_factor);
-        ren.apply();
+        image_type image(acquire_image(pool, req.width(), req.height()));
+        mapnik::attributes vars;
+        mapnik::agg_renderer<image_type> ren(map, req, vars, image, scale_factor);
+        render_layers(ren, map, req, scale_factor, listener);
         return image;
     }
 };
 
+// Cairo image surface drawing directly into the pixels of the image.
+inline mapnik::cairo_surface_ptr create_image_surface(mapnik::image_rgba8 & image)
+{
+    return mapnik::cairo_surface_ptr(
+        cairo_image_surface_create_for_data(image.bytes(), CAIRO_FORMAT_ARGB32,
+                                            image.width(), image.height(), image.row_size()),
+        mapnik::cairo_surface_closer());
+}
+
+// Turns the native endian ARGB words cairo draws into the RGBA bytes of
+// the image, in place. The pixels stay premultiplied. The loop is simple
+// enough for the compiler to vectorize.
+inline void cairo_argb_to_rgba(mapnik::image_rgba8 & image)
+{
+    std::uint32_t * __restrict pixels = image.data();
+    std::size_t size = image.width() * image.height();
+    for (std::size_t i = 0; i < size; i++)
+    {
+        std::uint32_t p = pixels[i];
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        pixels[i] = (p << 8) | (p >> 24);
+#else
+        pixels[i] = (p & 0xff00ff00u) | ((p >> 16) & 0xffu) | ((p & 0xffu) << 16);
+#endif
+    }
+    image.set_premultiplied(true);
+}
+
 struct cairo_renderer : raster_renderer_base<mapnik::image_rgba8>
 {
     static constexpr const char * name = "cairo";
+    static constexpr const bool support_replay = true;
 
-    image_type render(mapnik::Map const & map, double scale_factor) const
+    image_type render(mapnik::Map const & map, mapnik::request const & req, double scale_factor,
+                      render_listener * listener = nullptr, image_pool * pool = nullptr) const
     {
-        mapnik::cairo_surface_ptr image_surface(
-            cairo_image_surface_create(CAIRO_FORMAT_ARGB32, map.width(), map.height()),
-            mapnik::cairo_surface_closer());
-        mapnik::cairo_ptr image_context(mapnik::create_context(image_surface));
-        mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, image_context, scale_factor);
-        ren.apply();
-        image_type image(map.width(), map.height());
-        mapnik::cairo_image_to_rgba8(image, image_surface);
+        image_type image(acquire_image(pool, req.width(), req.height()));
+        {
+            mapnik::cairo_surface_ptr image_surface(create_image_surface(image));
+            mapnik::cairo_ptr image_context(mapnik::create_context(image_surface));
+            mapnik::attributes vars;
+            mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, req, vars, image_context, scale_factor);
+            render_layers(ren, map, req, scale_factor, listener);
+            cairo_surface_flush(&*image_surface);
+        }
+        cairo_argb_to_rgba(image);
         return image;
     }
 };
 
 using surface_create_type = cairo_surface_t *(&)(cairo_write_func_t, void *, double, double);
+using surface_set_size_type = void (*)(cairo_surface_t *, double, double);
 
-template <surface_create_type SurfaceCreateFunction>
+template <surface_create_type SurfaceCreateFunction,
+          surface_set_size_type SurfaceSetSizeFunction = nullptr>
 struct cairo_vector_renderer : vector_renderer_base
 {
     static constexpr double cairo_resolution = 72.0;
+    static constexpr const bool support_pages = SurfaceSetSizeFunction != nullptr;
+    static constexpr const bool support_replay = true;
+
+    double resolution(double) const
+    {
+        return cairo_resolution;
+    }
 
     static cairo_status_t write(void *closure,
                                 const unsigned char *data,
                                 unsigned int length)
     {
-        std::ostringstream & ss = *reinterpret_cast<std::ostringstream*>(closure);
-        ss.write(reinterpret_cast<char const *>(data), length);
-        return ss ? CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
+        std::ostream & stream = *reinterpret_cast<std::ostream*>(closure);
+        stream.write(reinterpret_cast<char const *>(data), length);
+        return stream ? CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
     }
 
-    image_type render(mapnik::Map const & map, double scale_factor) const
+    static mapnik::cairo_surface_ptr create_surface(std::ostream & stream, double width, double height)
     {
-        std::ostringstream ss(std::stringstream::binary);
-        mapnik::cairo_surface_ptr image_surface(
-            SurfaceCreateFunction(write, &ss, map.width(), map.height()),
-            mapnik::cairo_surface_closer());
+        return mapnik::cairo_surface_ptr(SurfaceCreateFunction(write, &stream, width, height),
+                                         mapnik::cairo_surface_closer());
+    }
+
+    // Streams the document to the given stream while cairo produces it.
+    // Independent layers are drawn on the given number of threads when it
+    // is not one, or heavy layers as images at the given resolution with
+    // hybrid options enabled.
+    void render(mapnik::Map const & map, mapnik::request const & req, double scale_factor,
+                std::ostream & stream, render_listener * listener = nullptr,
+                unsigned layer_threads = 1, hybrid_options const & hybrid = hybrid_options()) const
+    {
+        mapnik::cairo_surface_ptr image_surface(create_surface(stream, req.width(), req.height()));
         mapnik::cairo_ptr image_context(mapnik::create_context(image_surface));
-        mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, image_context, scale_factor);
-        ren.apply();
-        cairo_surface_finish(&*image_surface);
+        if (hybrid.enabled)
+        {
+            render_layers_hybrid(image_context, map, req, scale_factor, hybrid.dpi / cairo_resolution,
+                                 hybrid, listener);
+        }
+        else if (layer_threads != 1)
+        {
+            render_layers_parallel(image_context, map, req, scale_factor, layer_threads, listener);
+        }
+        else
+        {
+            mapnik::attributes vars;
+            mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, req, vars, image_context, scale_factor);
+            render_layers(ren, map, req, scale_factor, listener);
+        }
+        {
+            render_stage stage(listener, "finish");
+            cairo_surface_finish(&*image_surface);
+        }
+        check_status(&*image_surface);
+        stream.flush();
+    }
+
+    static void check_status(cairo_surface_t * surface)
+    {
+        cairo_status_t status = cairo_surface_status(surface);
+        if (status != CAIRO_STATUS_SUCCESS)
+        {
+            throw std::runtime_error(std::string("Cannot write output: ") +
+                cairo_status_to_string(status));
+        }
+    }
+
+    // Multi-page document streamed to the given stream page by page.
+    class document
+    {
+        std::ostream & stream;
+        mapnik::cairo_surface_ptr surface;
+        mapnik::cairo_ptr context;
+
+    public:
+        explicit document(std::ostream & stream)
+            : stream(stream),
+              surface(create_surface(stream, 1, 1)),
+              context(mapnik::create_context(surface))
+        {
+        }
+
+        void add_page(mapnik::Map const & map, mapnik::request const & req, double scale_factor,
+                      render_listener * listener = nullptr)
+        {
+            SurfaceSetSizeFunction(&*surface, req.width(), req.height());
+            mapnik::attributes vars;
+            mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, req, vars, context, scale_factor);
+            render_layers(ren, map, req, scale_factor, listener);
+            cairo_show_page(&*context);
+            check_status(&*surface);
+        }
+
+        void finish()
+        {
+            cairo_surface_finish(&*surface);
+            check_status(&*surface);
+            stream.flush();
+        }
+    };
+
+    image_type render(mapnik::Map const & map, mapnik::request const & req, double scale_factor,
+                      render_listener * listener = nullptr) const
+    {
+        std::ostringstream ss(std::stringstream::binary);
+        render(map, req, scale_factor, ss, listener);
         return ss.str();
     }
 };
@@ -141,7 +882,8 @@ struct cairo_svg_renderer : cairo_vector_renderer<cairo_svg_surface_create_for_s
 #endif
 
 #ifdef CAIRO_HAS_PS_SURFACE
-struct cairo_ps_renderer : cairo_vector_renderer<cairo_ps_surface_create_for_stream>
+struct cairo_ps_renderer : cairo_vector_renderer<cairo_ps_surface_create_for_stream,
+                                                 cairo_ps_surface_set_size>
 {
     static constexpr const char * name = "cairo-ps";
     static constexpr const char * ext = ".ps";
@@ -149,13 +891,123 @@ struct cairo_ps_renderer : cairo_vector_renderer<cairo_ps_surface_create_for_str
 #endif
 
 #ifdef CAIRO_HAS_PDF_SURFACE
-struct cairo_pdf_renderer : cairo_vector_renderer<cairo_pdf_surface_create_for_stream>
+struct cairo_pdf_renderer : cairo_vector_renderer<cairo_pdf_surface_create_for_stream,
+                                                  cairo_pdf_surface_set_size>
 {
     static constexpr const char * name = "cairo-pdf";
     static constexpr const char * ext = ".pdf";
 };
 #endif
 
+#if defined(GRID_RENDERER)
+// What the grid of a map describes, from the parameters of the map: the
+// features of the layer named by interactivity_layer, keyed by the field
+// named by interactivity_key, their id by default, with the comma
+// separated interactivity_fields.
+struct grid_interactivity
+{
+    static constexpr const char * id_key = "__id__";
+
+    std::string layer;
+    std::string key;
+    std::vector<std::string> fields;
+
+    explicit grid_interactivity(mapnik::Map const & map)
+    {
+        mapnik::parameters const & params = map.get_extra_parameters();
+        boost::optional<std::string> layer_name(params.get<std::string>("interactivity_layer"));
+        if (!layer_name)
+        {
+            throw std::runtime_error("Map has no interactivity_layer parameter");
+        }
+        layer = *layer_name;
+        key = params.get<std::string>("interactivity_key").get_value_or(id_key);
+        std::istringstream list(params.get<std::string>("interactivity_fields").get_value_or(""));
+        std::string field;
+        while (std::getline(list, field, ','))
+        {
+            if (!field.empty())
+            {
+                fields.push_back(field);
+            }
+        }
+    }
+
+    // Properties to query from the layer, the id not being one.
+    std::set<std::string> property_names() const
+    {
+        std::set<std::string> names(fields.begin(), fields.end());
+        names.insert(key);
+        names.erase(id_key);
+        return names;
+    }
+};
+
+// Renders the features of the interactivity layer of the map into a grid
+// of cells of cell_size output pixels, written as UTFGrid JSON.
+struct grid_renderer
+{
+    using image_type = mapnik::grid;
+
+    static constexpr const char * name = "grid";
+    static constexpr const char * ext = ".json";
+    static constexpr const bool support_tiles = false;
+    static constexpr const bool support_streaming = false;
+    static constexpr const bool support_pages = false;
+    static constexpr const bool support_replay = false;
+    static constexpr const unsigned cell_size = 4;
+
+    double resolution(double dpi) const
+    {
+        return dpi / cell_size;
+    }
+
+    image_type render(mapnik::Map const & map, mapnik::request const & req, double scale_factor,
+                      render_listener * listener = nullptr) const
+    {
+        grid_interactivity interactivity(map);
+        auto lyr = std::find_if(map.layers().begin(), map.layers().end(), [&](mapnik::layer const & l) {
+            return l.name() == interactivity.layer;
+        });
+        if (lyr == map.layers().end())
+        {
+            throw std::runtime_error("Unknown interactivity layer: " + interactivity.layer);
+        }
+        image_type grid(req.width(), req.height(), interactivity.key);
+        for (std::string const & field : interactivity.fields)
+        {
+            grid.add_field(field);
+        }
+        std::set<std::string> names(interactivity.property_names());
+
+        mapnik::attributes vars;
+        mapnik::grid_renderer<image_type> ren(map, req, vars, grid, scale_factor);
+        mapnik::projection proj(map.srs(), true);
+        double scale_denom = mapnik::scale_denominator(req.scale(), proj.is_geographic()) * scale_factor;
+        ren.start_map_processing(map);
+        render_layer(ren, map, *lyr, proj, req, scale_denom, names, listener);
+        ren.end_map_processing(map);
+        return grid;
+    }
+
+    void save(image_type const & grid, boost::filesystem::path const & path,
+              png_options const & = png_options()) const
+    {
+        output_stream stream(path.string());
+        write_utfgrid(grid, stream);
+        if (!stream.flush())
+        {
+            throw std::runtime_error("Cannot write output: " + path.string());
+        }
+    }
+
+    void save(image_type const & grid, std::ostream & stream, png_options const & = png_options()) const
+    {
+        write_utfgrid(grid, stream);
+    }
+};
+#endif
+
 double meters_to_inches(double meters)
 {
     return meters / 0.0254;
@@ -204,18 +1056,29 @@ struct command
           size(size.meters_to_inches() * points_per_inch),
           dpi(dpi)
     {
-        mapnik::projection proj(srs);
-        point_type geografic_center;
-        proj.inverse(geografic_center.x, geografic_center.y);
+        point_type geografic_center(map_center);
+        projection_cache::instance().inverse(srs, geografic_center.x, geografic_center.y);
 
         double projection_scale_factor = std::cos(geografic_center.y * mapnik::D2R);
         extent *= scale_denom * projection_scale_factor;
         extent.re_center(map_center.x, map_center.y);
 
-        double scale = scale_merc(zoom);
-        double mapnik_scale_denom = mapnik::scale_denominator(scale, false);
-        scale_factor = mapnik_scale_denom / (mapnik::scale_denominator(
-            extent.width() / size.width, false));
+        // Ratio of mapnik::scale_denominator(scale_merc(zoom), false) to
+        // the scale denominator of the print. Both are the scale divided
+        // by the same pixel size, which cancels out.
+        scale_factor = scale_merc(zoom) / (extent.width() / size.width);
+    }
+
+    // Fields determining the output, written in full precision.
+    std::string normalized() const
+    {
+        std::ostringstream fields;
+        fields << std::setprecision(17)
+               << size.width << "," << size.height << ";"
+               << extent.minx() << "," << extent.miny() << ","
+               << extent.maxx() << "," << extent.maxy() << ";"
+               << scale_factor << ";" << dpi;
+        return fields.str();
     }
 };
 
@@ -224,37 +1087,388 @@ class renderer
 {
     const Renderer ren;
     const boost::filesystem::path output_dir;
-    mapnik::Map map;
+    const shared_map map;
+    tile_options tiles;
+    vector_options vector;
+    png_options png;
+    output_cache * cache = nullptr;
+    file_writer * writer = nullptr;
+    image_pool * images = nullptr;
+    render_listener * listener = nullptr;
 
 public:
     using renderer_type = Renderer;
     using image_type = typename Renderer::image_type;
 
-    renderer(mapnik::Map const & map)
-        : map(map)
+    renderer(shared_map const & map, tile_options const & tiles = tile_options())
+        : ren(), map(map), tiles(tiles)
+    {
+    }
+
+    void set_listener(render_listener * render_listener)
+    {
+        listener = render_listener;
+    }
+
+    void set_png_options(png_options const & options)
+    {
+        png = options;
+    }
+
+    void set_vector_options(vector_options const & options)
+    {
+        vector = options;
+    }
+
+    // Reuses the images of raster renders when set.
+    void set_image_pool(image_pool * pool)
+    {
+        images = pool;
+    }
+
+    // Writes output files in the background when set.
+    void set_writer(file_writer * file_writer)
     {
+        writer = file_writer;
+    }
+
+    // Serves repeated commands from the cache when set.
+    void set_cache(output_cache * output_cache)
+    {
+        cache = output_cache;
     }
 
     image_type render(command const & cmd)
     {
-        return ren.render(map, cmd.scale_factor);
+        map_view view(prepare(cmd));
+        render_stage stage(listener, "render");
+        if constexpr (Renderer::support_tiles)
+        {
+            if (tiles.enabled(view.req))
+            {
+                return render_tiled(ren, *map, view.req, view.scale_factor, view_tiles(view), listener, images);
+            }
+            return ren.render(*map, view.req, view.scale_factor, listener, images);
+        }
+        else
+        {
+            return ren.render(*map, view.req, view.scale_factor, listener);
+        }
+    }
+
+    // Renders the area of the tile of the command image, with its
+    // overlap, the result covering the tile render area.
+    image_type render(command const & cmd, tile const & t)
+    {
+        static_assert(Renderer::support_tiles, "Renderer does not support tiles");
+        map_view view(prepare(cmd));
+        mapnik::request req(tile_request(view.req, t));
+        render_stage stage(listener, "render");
+        if (tiles.enabled(req))
+        {
+            return render_tiled(ren, *map, req, view.scale_factor, view_tiles(view), listener, images);
+        }
+        return ren.render(*map, req, view.scale_factor, listener, images);
     }
+
+    // View of the command at the resolution of the renderer.
+    map_view view(command const & cmd) const
+    {
+        return prepare(cmd);
+    }
+
+    // Vector output goes to the stream as it is produced, raster output
+    // is encoded into it once rendered. Outputs in the cache are copied
+    // to the stream without rendering.
+    void render(command const & cmd, std::ostream & stream)
+    {
+        if (!cache)
+        {
+            render_output(cmd, stream);
+            return;
+        }
+        std::ostringstream parameters;
+        parameters << Renderer::name << ";" << cmd.normalized();
+        if constexpr (!Renderer::support_streaming)
+        {
+            parameters << ";png" << png.level << "," << static_cast<int>(png.filter) << "," << png.strip_size;
+        }
+        else if (vector.hybrid.enabled)
+        {
+            parameters << ";hybrid" << vector.hybrid.max_features << "," << vector.hybrid.dpi << ","
+                       << vector.hybrid.max_pixels;
+        }
+        std::string key(cache->key(map, parameters.str()));
+        bool hit;
+        {
+            render_stage stage(listener, "cache");
+            hit = cache->read(key, stream);
+        }
+        if (listener)
+        {
+            listener->counter("cache_hit", hit);
+        }
+        if (!hit)
+        {
+            cache->store(key, stream, [&](std::ostream & output) { render_output(cmd, output); });
+        }
+    }
+
+    // Adds the command as a page to a document of a renderer supporting pages.
+    template <typename Document>
+    void render_page(command const & cmd, Document & document)
+    {
+        map_view view(prepare(cmd));
+        render_stage stage(listener, "render");
+        document.add_page(*map, view.req, view.scale_factor, listener);
+    }
+
+    // The returned future is ready once the output is written, which with
+    // a writer set happens in the background.
+    std::shared_future<void> render(command const & cmd, boost::filesystem::path const & path)
+    {
+        if (writer)
+        {
+            async_output_stream stream(*writer, path.string());
+            render(cmd, stream);
+            if (listener)
+            {
+                listener->counter("output_bytes", stream.bytes_written());
+            }
+            return stream.close();
+        }
+        output_stream stream(path.string());
+        render(cmd, stream);
+        {
+            render_stage stage(listener, "write");
+            if (!stream.flush())
+            {
+                throw std::runtime_error("Cannot write output: " + path.string());
+            }
+        }
+        if (listener)
+        {
+            listener->counter("output_bytes", stream.bytes_written());
+        }
+        std::promise<void> written;
+        written.set_value();
+        return written.get_future().share();
+    }
+
+private:
+    void render_output(command const & cmd, std::ostream & stream)
+    {
+        if constexpr (Renderer::support_streaming)
+        {
+            map_view view(prepare(cmd));
+            render_stage stage(listener, "render");
+            hybrid_options hybrid(vector.hybrid);
+            if (hybrid.dpi <= 0)
+            {
+                hybrid.dpi = cmd.dpi;
+            }
+            ren.render(*map, view.req, view.scale_factor, stream, listener,
+                       vector.parallel_layers ? tiles.threads : 1, hybrid);
+        }
+        else
+        {
+            if constexpr (Renderer::support_tiles)
+            {
+                map_view view(prepare(cmd));
+                if (view_tiles(view).strip_rows(view.req.width(), view.req.height(),
+                                                images ? images->capacity() : 0))
+                {
+                    render_strips(view, stream);
+                    return;
+                }
+            }
+            image_type image(render(cmd));
+            {
+                render_stage stage(listener, "encode");
+                ren.save(image, stream, png);
+            }
+            if constexpr (Renderer::support_tiles)
+            {
+                if (images)
+                {
+                    images->release(std::move(image));
+                }
+            }
+        }
+    }
+
+    // Renders and encodes the image strip by strip, so that memory use
+    // depends on its width only.
+    void render_strips(map_view const & view, std::ostream & stream)
+    {
+        unsigned width = view.req.width();
+        unsigned height = view.req.height();
+        tile_options strips(view_tiles(view));
+        unsigned rows = strips.strip_rows(width, height, images ? images->capacity() : 0);
+        png_encoder encoder(stream, width, height, png);
+        for (unsigned y = 0; y < height; y += rows)
+        {
+            tile t(strip_tile(width, height, y, rows, strips.overlap));
+            mapnik::request req(tile_request(view.req, t));
+            image_type image;
+            {
+                render_stage stage(listener, "render");
+                image = tiles.enabled(req) ?
+                    render_tiled(ren, *map, req, view.scale_factor, strips, listener, images) :
+                    ren.render(*map, req, view.scale_factor, listener, images);
+            }
+            {
+                render_stage stage(listener, "encode");
+                encoder.add_rows(image, t.y - t.render_y, t.height);
+            }
+            if (images)
+            {
+                images->release(std::move(image));
+            }
+        }
+        encoder.finish();
+    }
+
+    // Tile options with the overlap of the map at the scale of the view.
+    tile_options view_tiles(map_view const & view) const
+    {
+        tile_options scaled(tiles);
+        scaled.overlap = scaled_overlap(*map, view.scale_factor, tiles.overlap);
+        return scaled;
+    }
+
+    // Sizes the view for the command at the resolution of the renderer.
+    map_view prepare(command const & cmd) const
+    {
+        double factor = ren.resolution(cmd.dpi) / command::points_per_inch;
+        return { map_request(*map,
+                             std::max(1l, std::lround(cmd.size.width * factor)),
+                             std::max(1l, std::lround(cmd.size.height * factor)),
+                             cmd.extent),
+                 cmd.scale_factor * factor };
+    }
+};
+
+
+template <typename Renderer>
+struct renderer_tag
+{
+    using type = Renderer;
+};
+
+// Traits of a renderer known by its name at run time.
+struct renderer_info
+{
+    char const * name;
+    char const * ext;
+    bool support_tiles;
+    bool support_streaming;
+    bool support_pages;
+    bool support_replay;
 };
 
+// Set of renderers selected by name at run time, built from their traits
+// at compile time. Code dispatching through the list instantiates the
+// renderers of the list only, so that programs embedding the library
+// pick the ones they need and custom ones with extend.
+template <typename... Renderers>
+struct renderer_list
+{
+    static_assert(sizeof...(Renderers) > 0, "Empty renderer list");
+
+    template <typename... Others>
+    using extend = renderer_list<Renderers..., Others...>;
+
+    static std::vector<std::string> names()
+    {
+        return { Renderers::name... };
+    }
+
+    static std::vector<renderer_info> const & infos()
+    {
+        static const std::vector<renderer_info> table{
+            { Renderers::name, Renderers::ext, Renderers::support_tiles, Renderers::support_streaming,
+              Renderers::support_pages, Renderers::support_replay }...
+        };
+        return table;
+    }
+
+    // Traits of the renderer of that name, without instantiating any.
+    static renderer_info const & find(std::string const & name)
+    {
+        for (renderer_info const & info : infos())
+        {
+            if (name == info.name)
+            {
+                return info;
+            }
+        }
+        throw std::runtime_error("Unknown renderer: " + name);
+    }
+
+    // Calls the function with the renderer_tag of the renderer of that
+    // name, the function returning the same type for all of them.
+    template <typename Function>
+    static auto dispatch(std::string const & name, Function && function)
+    {
+        return dispatch_from<Renderers...>(name, function);
+    }
+
+private:
+    template <typename Renderer, typename... Rest, typename Function>
+    static auto dispatch_from(std::string const & name, Function & function)
+    {
+        if (name == Renderer::name)
+        {
+            return function(renderer_tag<Renderer>());
+        }
+        if constexpr (sizeof...(Rest) > 0)
+        {
+            return dispatch_from<Rest...>(name, function);
+        }
+        else
+        {
+            throw std::runtime_error("Unknown renderer: " + name);
+        }
+    }
+};
 
-using renderer_type = mapnik::util::variant<renderer<agg_renderer>
+// Renderers of the command line and server.
+using builtin_renderers = renderer_list<
+    agg_renderer
 #if defined(HAVE_CAIRO)
-                                            ,renderer<cairo_renderer>
+    ,cairo_renderer
 #ifdef CAIRO_HAS_SVG_SURFACE
-                                            ,renderer<cairo_svg_renderer>
+    ,cairo_svg_renderer
 #endif
 #ifdef CAIRO_HAS_PS_SURFACE
-                                            ,renderer<cairo_ps_renderer>
+    ,cairo_ps_renderer
 #endif
 #ifdef CAIRO_HAS_PDF_SURFACE
-                                            ,renderer<cairo_pdf_renderer>
+    ,cairo_pdf_renderer
 #endif
 #endif
-                                            >;
+#if defined(GRID_RENDERER)
+    ,grid_renderer
+#endif
+    >;
+
+inline std::vector<std::string> renderer_names()
+{
+    return builtin_renderers::names();
+}
+
+inline renderer_info const & find_renderer(std::string const & name)
+{
+    return builtin_renderers::find(name);
+}
+
+// Calls the function with the renderer_tag of the built-in renderer of
+// that name.
+template <typename Function>
+auto dispatch_renderer(std::string const & name, Function && function)
+{
+    return builtin_renderers::dispatch(name, function);
+}
 
 }
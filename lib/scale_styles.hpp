@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <type_traits>
+#include <vector>
+
+#include <mapnik/map.hpp>
+#include <mapnik/rule.hpp>
+#include <mapnik/symbolizer.hpp>
+#include <mapnik/feature_type_style.hpp>
+#include <mapnik/feature.hpp>
+#include <mapnik/expression.hpp>
+#include <mapnik/expression_node.hpp>
+#include <mapnik/expression_evaluator.hpp>
+#include <mapnik/projection.hpp>
+#include <mapnik/scale_denominator.hpp>
+
+#include "renderer.hpp"
+
+namespace mapnik_print
+{
+
+namespace scale_styles_detail
+{
+
+template <typename Node, typename = void>
+struct has_operands : std::false_type {};
+
+template <typename Node>
+struct has_operands<Node, std::void_t<decltype(std::declval<Node &>().left),
+                                      decltype(std::declval<Node &>().right)>> : std::true_type {};
+
+template <typename Node, typename = void>
+struct has_arguments : std::false_type {};
+
+template <typename Node>
+struct has_arguments<Node, std::void_t<decltype(std::declval<Node &>().arg1),
+                                       decltype(std::declval<Node &>().arg2)>> : std::true_type {};
+
+template <typename Node, typename = void>
+struct has_expression : std::false_type {};
+
+template <typename Node>
+struct has_expression<Node, std::void_t<decltype(std::declval<Node &>().expr)>> : std::true_type {};
+
+template <typename Node, typename = void>
+struct has_argument : std::false_type {};
+
+template <typename Node>
+struct has_argument<Node, std::void_t<decltype(std::declval<Node &>().arg)>> : std::true_type {};
+
+template <typename Node>
+constexpr bool is_literal =
+    std::is_same<Node, mapnik::value_null>::value ||
+    std::is_same<Node, mapnik::value_bool>::value ||
+    std::is_same<Node, mapnik::value_integer>::value ||
+    std::is_same<Node, mapnik::value_double>::value ||
+    std::is_same<Node, mapnik::value_unicode_string>::value;
+
+inline mapnik::value evaluate_constant(mapnik::expr_node const & node)
+{
+    mapnik::feature_impl feature(std::make_shared<mapnik::context_type>(), 0);
+    mapnik::attributes vars;
+    return mapnik::util::apply_visitor(
+        mapnik::evaluate<mapnik::feature_impl, mapnik::value, mapnik::attributes>(feature, vars), node);
+}
+
+// Folds the constant sub-expressions of the node into their values,
+// returning whether the whole node is constant. Only literals are
+// constants: feature, geometry type and global attributes are not, nor
+// are nodes of a kind not known to have operands.
+inline bool fold_constants(mapnik::expr_node & node)
+{
+    bool constant = mapnik::util::apply_visitor([](auto & n) {
+        using node_type = typename std::decay<decltype(n)>::type;
+        if constexpr (is_literal<node_type>)
+        {
+            return true;
+        }
+        else if constexpr (has_operands<node_type>::value)
+        {
+            bool left = fold_constants(n.left);
+            bool right = fold_constants(n.right);
+            return left && right;
+        }
+        else if constexpr (has_arguments<node_type>::value)
+        {
+            bool arg1 = fold_constants(n.arg1);
+            bool arg2 = fold_constants(n.arg2);
+            return arg1 && arg2;
+        }
+        else if constexpr (has_expression<node_type>::value)
+        {
+            return fold_constants(n.expr);
+        }
+        else if constexpr (has_argument<node_type>::value)
+        {
+            return fold_constants(n.arg);
+        }
+        else
+        {
+            return false;
+        }
+    }, node);
+    if (constant)
+    {
+        mapnik::value value;
+        try
+        {
+            value = evaluate_constant(node);
+        }
+        catch (std::exception const &)
+        {
+            // Left for the renderer to fail on.
+            return false;
+        }
+        node = mapnik::util::apply_visitor([](auto const & v) { return mapnik::expr_node(v); }, value);
+    }
+    return constant;
+}
+
+// Copy of the expression with its constant sub-expressions folded, and
+// whether it is constant as a whole. The expressions of a map are shared
+// by its copies, so they are never folded in place.
+inline std::pair<mapnik::expression_ptr, bool> fold_expression(mapnik::expression_ptr const & expr)
+{
+    auto folded = std::make_shared<mapnik::expr_node>(*expr);
+    bool constant = fold_constants(*folded);
+    return { folded, constant };
+}
+
+}
+
+// Relative margin on the scale denominator of the rules kept, covering
+// the rounding of the view size between renderers and the commands
+// sharing a copy (see scale_maps).
+constexpr double scale_margin = 1e-3;
+
+// Scale denominator the commands are drawn at, which does not depend on
+// the resolution of the renderer.
+inline double command_scale_denominator(shared_map const & map, command const & cmd)
+{
+    map_view view(renderer<agg_renderer>(map).view(cmd));
+    mapnik::projection proj(map->srs(), true);
+    return mapnik::scale_denominator(view.req.scale(), proj.is_geographic()) * view.scale_factor;
+}
+
+// Copy of the map whose styles only have the rules active around the
+// scale denominator, their filters and the expressions of their
+// symbolizer properties having their constant parts evaluated once.
+// Rules whose filter is always false are dropped. The rules kept keep
+// their scale range, the renderers still checking it.
+inline shared_map specialize_for_scale(mapnik::Map const & map, double scale_denom)
+{
+    using scale_styles_detail::fold_expression;
+
+    auto copy = std::make_shared<mapnik::Map>(map);
+    for (auto & style : copy->styles())
+    {
+        std::vector<mapnik::rule> & rules = style.second.get_rules_nonconst();
+        std::vector<mapnik::rule> kept;
+        for (mapnik::rule & r : rules)
+        {
+            if (r.get_min_scale() > scale_denom * (1 + scale_margin) ||
+                r.get_max_scale() <= scale_denom * (1 - scale_margin))
+            {
+                continue;
+            }
+            // The filters of else and also rules are not evaluated.
+            if (r.get_filter() && !r.has_else_filter() && !r.has_also_filter())
+            {
+                auto filter = fold_expression(r.get_filter());
+                if (filter.second && !scale_styles_detail::evaluate_constant(*filter.first).to_bool())
+                {
+                    continue;
+                }
+                r.set_filter(filter.first);
+            }
+            for (mapnik::symbolizer & sym : r)
+            {
+                mapnik::util::apply_visitor([&](auto & s) {
+                    for (auto & property : s.properties)
+                    {
+                        if (property.second.template is<mapnik::expression_ptr>() &&
+                            property.second.template get<mapnik::expression_ptr>())
+                        {
+                            property.second = fold_expression(
+                                property.second.template get<mapnik::expression_ptr>()).first;
+                        }
+                    }
+                }, sym);
+            }
+            kept.push_back(std::move(r));
+        }
+        rules = std::move(kept);
+    }
+    return copy;
+}
+
+// Scale specialized copies of the maps, one per map and scale
+// denominator, so that prints at the same scale share one copy. The scale
+// denominator of a command varies slightly with the latitude and extent
+// of its view: commands within half the scale margin of a copy share it.
+// Beyond max_maps copies, the least recently used one is dropped.
+class scale_maps
+{
+    struct entry
+    {
+        // The original is kept so that its address is not reused.
+        shared_map map;
+        double scale_denom;
+        shared_map specialized;
+    };
+
+    const std::size_t max_maps;
+    std::mutex mutex;
+    // Least recently used first.
+    std::list<entry> maps;
+
+public:
+    explicit scale_maps(std::size_t max_maps = 16)
+        : max_maps(std::max<std::size_t>(1, max_maps))
+    {
+    }
+
+    shared_map get(shared_map const & map, command const & cmd)
+    {
+        double scale_denom = command_scale_denominator(map, cmd);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = maps.begin(); it != maps.end(); ++it)
+        {
+            if (it->map == map && std::abs(it->scale_denom - scale_denom) <= scale_denom * scale_margin / 2)
+            {
+                maps.splice(maps.end(), maps, it);
+                return it->specialized;
+            }
+        }
+        maps.push_back({ map, scale_denom, specialize_for_scale(*map, scale_denom) });
+        if (maps.size() > max_maps)
+        {
+            maps.pop_front();
+        }
+        return maps.back().specialized;
+    }
+};
+
+}
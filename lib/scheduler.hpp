@@ -0,0 +1,398 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/optional.hpp>
+
+#include <mapnik/layer.hpp>
+
+#include "renderer.hpp"
+
+namespace mapnik_print
+{
+
+enum class job_priority
+{
+    interactive,
+    normal,
+    batch
+};
+
+inline job_priority parse_job_priority(std::string const & name)
+{
+    if (name == "interactive")
+    {
+        return job_priority::interactive;
+    }
+    if (name == "normal")
+    {
+        return job_priority::normal;
+    }
+    if (name == "batch")
+    {
+        return job_priority::batch;
+    }
+    throw std::runtime_error("Unknown job priority: " + name);
+}
+
+enum class job_state
+{
+    queued,
+    running,
+    done,
+    failed,
+    cancelled,
+    expired
+};
+
+inline char const * job_state_name(job_state state)
+{
+    switch (state)
+    {
+        case job_state::queued: return "queued";
+        case job_state::running: return "running";
+        case job_state::done: return "done";
+        case job_state::failed: return "failed";
+        case job_state::cancelled: return "cancelled";
+        case job_state::expired: return "expired";
+    }
+    return "unknown";
+}
+
+// Thrown out of a render when its job is cancelled or past its deadline.
+struct job_cancelled : std::runtime_error
+{
+    const bool expired;
+
+    explicit job_cancelled(bool expired)
+        : std::runtime_error(expired ? "Deadline exceeded" : "Cancelled"), expired(expired)
+    {
+    }
+};
+
+// Print job run by the scheduler. Its listener follows the progress of
+// the render and stops it between two layers once the job is cancelled
+// or past its deadline.
+class job : public render_listener
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    const std::string id;
+    const job_priority priority;
+    const boost::optional<clock::time_point> deadline;
+    const clock::time_point submitted = clock::now();
+
+private:
+    render_listener * const inner;
+    std::atomic<job_state> state{ job_state::queued };
+    std::atomic<bool> cancel_requested{ false };
+    std::atomic<unsigned> layers{ 0 };
+    std::atomic<char const *> current_stage{ "" };
+    mutable std::mutex mutex;
+    std::string error;
+
+public:
+    job(std::string const & id, job_priority priority,
+        boost::optional<clock::time_point> const & deadline, render_listener * inner)
+        : id(id), priority(priority), deadline(deadline), inner(inner)
+    {
+    }
+
+    job_state get_state() const
+    {
+        return state;
+    }
+
+    void cancel()
+    {
+        cancel_requested = true;
+    }
+
+    // Throws job_cancelled when the job must stop.
+    void check() const
+    {
+        if (cancel_requested)
+        {
+            throw job_cancelled(false);
+        }
+        if (deadline && clock::now() > *deadline)
+        {
+            throw job_cancelled(true);
+        }
+    }
+
+    // One line summary: state, layers rendered, current stage, seconds
+    // since submission and the error of a failed job.
+    std::string status() const
+    {
+        std::ostringstream line;
+        std::chrono::duration<double> elapsed = clock::now() - submitted;
+        line << job_state_name(state) << " layers=" << layers << " stage=" << current_stage
+             << " elapsed=" << elapsed.count();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error.empty())
+        {
+            line << " error=" << error;
+        }
+        return line.str();
+    }
+
+    void layer_begin(mapnik::layer const & lyr) override
+    {
+        check();
+        if (inner)
+        {
+            inner->layer_begin(lyr);
+        }
+    }
+
+    void layer_end(mapnik::layer const & lyr) override
+    {
+        layers++;
+        if (inner)
+        {
+            inner->layer_end(lyr);
+        }
+    }
+
+    void stage_begin(char const * stage) override
+    {
+        current_stage = stage;
+        if (inner)
+        {
+            inner->stage_begin(stage);
+        }
+    }
+
+    void stage_end(char const * stage) override
+    {
+        if (inner)
+        {
+            inner->stage_end(stage);
+        }
+    }
+
+    void counter(char const * name, double value) override
+    {
+        if (inner)
+        {
+            inner->counter(name, value);
+        }
+    }
+
+private:
+    friend class job_scheduler;
+
+    void finish(job_state final_state, std::string const & message = std::string())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = message;
+        }
+        state = final_state;
+    }
+};
+
+using job_ptr = std::shared_ptr<job>;
+
+// Runs jobs on a fixed number of threads, highest priority first and in
+// submission order within a priority. The queue is bounded: jobs are
+// refused rather than queued without limit when it is full.
+class job_scheduler
+{
+    struct queued_job
+    {
+        job_ptr j;
+        std::function<void(job &)> run;
+    };
+
+    static constexpr std::size_t priorities = 3;
+    static constexpr std::size_t finished_jobs_kept = 1024;
+
+    const std::size_t max_queued;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::array<std::deque<queued_job>, priorities> queues;
+    std::size_t queued = 0;
+    std::map<std::string, job_ptr> jobs;
+    // Finished jobs in order, their ids being reusable once finished.
+    std::deque<job_ptr> finished;
+    unsigned long next_id = 1;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+public:
+    // Zero threads means one per hardware core.
+    job_scheduler(unsigned threads, std::size_t max_queued)
+        : max_queued(max_queued)
+    {
+        if (threads == 0)
+        {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned i = 0; i < threads; i++)
+        {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    job_scheduler(job_scheduler const &) = delete;
+    job_scheduler & operator=(job_scheduler const &) = delete;
+
+    // Running jobs finish, queued ones are run cancelled so that they can
+    // report it.
+    ~job_scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            for (auto & queue : queues)
+            {
+                for (queued_job & q : queue)
+                {
+                    q.j->cancel();
+                }
+            }
+        }
+        condition.notify_all();
+        for (std::thread & worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // Queues the job, returns nullptr when the queue is full. An empty id
+    // gets a generated one. The function is called even when the job was
+    // cancelled or expired while queued, so that it can report it:
+    // job::check throws for such jobs.
+    job_ptr try_submit(std::string id, job_priority priority,
+                       boost::optional<job::clock::time_point> const & deadline,
+                       render_listener * listener,
+                       std::function<void(job &)> run)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (queued >= max_queued)
+        {
+            return nullptr;
+        }
+        if (id.empty())
+        {
+            id = std::to_string(next_id++);
+        }
+        auto it = jobs.find(id);
+        if (it != jobs.end())
+        {
+            job_state state = it->second->get_state();
+            if (state == job_state::queued || state == job_state::running)
+            {
+                throw std::runtime_error("Job already exists: " + id);
+            }
+        }
+        job_ptr j(std::make_shared<job>(id, priority, deadline, listener));
+        jobs[id] = j;
+        queues[static_cast<std::size_t>(priority)].push_back({ j, std::move(run) });
+        queued++;
+        lock.unlock();
+        condition.notify_one();
+        return j;
+    }
+
+    job_ptr find(std::string const & id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = jobs.find(id);
+        return it == jobs.end() ? nullptr : it->second;
+    }
+
+    bool cancel(std::string const & id)
+    {
+        job_ptr j(find(id));
+        if (j)
+        {
+            j->cancel();
+        }
+        return bool(j);
+    }
+
+    std::size_t queue_size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queued;
+    }
+
+private:
+    void work()
+    {
+        while (true)
+        {
+            queued_job q;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return stopping || queued > 0; });
+                if (queued == 0)
+                {
+                    return;
+                }
+                for (auto & queue : queues)
+                {
+                    if (!queue.empty())
+                    {
+                        q = std::move(queue.front());
+                        queue.pop_front();
+                        break;
+                    }
+                }
+                queued--;
+            }
+            run(q);
+        }
+    }
+
+    void run(queued_job & q)
+    {
+        job & j = *q.j;
+        j.state = job_state::running;
+        try
+        {
+            q.run(j);
+            j.finish(job_state::done);
+        }
+        catch (job_cancelled const & e)
+        {
+            j.finish(e.expired ? job_state::expired : job_state::cancelled, e.what());
+        }
+        catch (std::exception const & e)
+        {
+            j.finish(job_state::failed, e.what());
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.push_back(q.j);
+        while (finished.size() > finished_jobs_kept)
+        {
+            // Unless a newer job took its id.
+            auto it = jobs.find(finished.front()->id);
+            if (it != jobs.end() && it->second == finished.front())
+            {
+                jobs.erase(it);
+            }
+            finished.pop_front();
+        }
+    }
+};
+
+}
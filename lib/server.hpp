@@ -0,0 +1,657 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <atomic>
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include <mapnik/map.hpp>
+
+#include "renderer.hpp"
+#include "command_spec.hpp"
+#include "output.hpp"
+#include "thread_pool.hpp"
+#include "scheduler.hpp"
+#include "progressive.hpp"
+#include "feature_cache.hpp"
+#include "scale_styles.hpp"
+#include "vector_quality.hpp"
+#include "distributed.hpp"
+#include "incremental.hpp"
+#include "interactivity.hpp"
+#include "net.hpp"
+#include "trace.hpp"
+
+namespace mapnik_print
+{
+
+struct server_options
+{
+    // Unix socket path or host:port, see listen_socket.
+    std::string socket_path;
+    // Number of jobs rendered at the same time, zero means one per core.
+    unsigned threads = 0;
+    // Jobs waiting to be rendered beyond which new ones are refused.
+    std::size_t max_queued = 64;
+    // Processes forked to serve the socket, sharing the maps and fonts
+    // loaded before. One serves from the current process.
+    unsigned workers = 1;
+    // Threads reading requests and answering status queries.
+    unsigned connection_threads = 4;
+    // Directory the output, preview and grid files of the jobs are
+    // written to, the jobs naming them relative to it.
+    std::string output_directory = ".";
+    tile_options tiles;
+    vector_options vector;
+    png_options png;
+    output_cache * cache = nullptr;
+    // Writes output files in the background when set, each worker
+    // process starting its own writer, whose thread would not survive the
+    // fork.
+    boost::optional<writer_options> writer;
+    // Images reused between jobs when set.
+    image_pool * images = nullptr;
+    // Feature cache of the map datasources, if any.
+    feature_cache * features = nullptr;
+    // Simplifies vector output to the device resolution when set.
+    device_maps * device = nullptr;
+    // Specializes the styles to the scale of the jobs when set.
+    scale_maps * scales = nullptr;
+    // Preview settings of jobs asking for one.
+    progressive_options progressive;
+    // Renderers of the editing sessions, which jobs naming a session use
+    // when set.
+    session_cache * sessions = nullptr;
+    // Notified about the progress of every job when set.
+    render_listener * listener = nullptr;
+    // Trace of the jobs when set, which each worker process writes to
+    // trace_path.<pid> once stopped.
+    trace * tracer = nullptr;
+    std::string trace_path;
+};
+
+inline std::atomic<bool> & server_stop_requested()
+{
+    static std::atomic<bool> stop(false);
+    return stop;
+}
+
+inline void server_stop_handler(int)
+{
+    server_stop_requested() = true;
+}
+
+// Job parameters of a request, apart from its command parameters.
+struct job_request
+{
+    std::string id;
+    job_priority priority = job_priority::normal;
+    boost::optional<job::clock::time_point> deadline;
+    std::string preview;
+    std::string grid;
+    boost::optional<tile_region> tile;
+    std::string session;
+    std::set<std::string> hidden;
+    std::string parameters;
+};
+
+// Takes job=<id>, priority=<priority>, deadline=<seconds>,
+// preview=<path>, grid=<path>, tile=<x>,<y>,<width>,<height>, overlap=<pixels>,
+// session=<id> and hide=<layer>,... out of the request line, the rest
+// being command parameters.
+inline job_request parse_job_request(std::string const & line)
+{
+    job_request request;
+    std::string tile;
+    unsigned overlap = 0;
+    for (std::string const & token : split_parameters(line))
+    {
+        std::string::size_type equals = token.find('=');
+        std::string key(token.substr(0, equals));
+        std::string value(equals == std::string::npos ? "" : token.substr(equals + 1));
+        if (key == "job")
+        {
+            request.id = value;
+        }
+        else if (key == "priority")
+        {
+            request.priority = parse_job_priority(value);
+        }
+        else if (key == "deadline")
+        {
+            request.deadline = job::clock::now() +
+                std::chrono::duration_cast<job::clock::duration>(
+                    std::chrono::duration<double>(parse_number(key, value)));
+        }
+        else if (key == "preview")
+        {
+            request.preview = value;
+        }
+        else if (key == "grid")
+        {
+            request.grid = value;
+        }
+        else if (key == "tile")
+        {
+            tile = value;
+        }
+        else if (key == "overlap")
+        {
+            overlap = static_cast<unsigned>(parse_number(key, value));
+        }
+        else if (key == "session")
+        {
+            request.session = value;
+        }
+        else if (key == "hide")
+        {
+            std::istringstream names(value);
+            std::string name;
+            while (std::getline(names, name, ','))
+            {
+                request.hidden.insert(name);
+            }
+        }
+        else
+        {
+            request.parameters += quote_parameter(token) + " ";
+        }
+    }
+    if (!tile.empty())
+    {
+        request.tile = parse_tile_region(tile, overlap);
+    }
+    return request;
+}
+
+// Path of a file a client names relative to the directory, which must
+// stay inside it: absolute paths and parent components are refused.
+inline std::string resolve_output_path(std::string const & directory, std::string const & path)
+{
+    boost::filesystem::path relative(path);
+    if (relative.has_root_path())
+    {
+        throw std::runtime_error("Output path must be relative: " + path);
+    }
+    for (boost::filesystem::path const & component : relative)
+    {
+        if (component == "..")
+        {
+            throw std::runtime_error("Output path must not leave the output directory: " + path);
+        }
+    }
+    return (boost::filesystem::path(directory) / relative).string();
+}
+
+// Long running render server keeping the loaded maps in memory.
+//
+// Each connection to the socket carries one request line:
+//
+// - A job: command parameters (see parse_command_spec) and optionally
+//   job=<id>, priority=interactive|normal|batch, deadline=<seconds> and
+//   preview=<path>. Jobs are queued by priority. A job with a preview
+//   first writes a low resolution PNG of it to the path and sends
+//   "PREVIEW <path>\n". Once rendered, the server answers with
+//   "OK\n" followed by the rendered document, or with "OK <path>\n" when
+//   the job names an output file. Otherwise it answers "ERROR <message>\n",
+//   for instance when the queue is full, the job is cancelled or its
+//   deadline passes, even while it renders. Output and preview paths are
+//   relative to the output directory of the server (see
+//   resolve_output_path), and answered as resolved.
+// - A job with grid=<path>, when the grid renderer is built in: also
+//   writes the UTFGrid of the interactivity layer of the map to the path
+//   from the features the output read, before answering "OK <path>\n"
+//   or, with the document sent, before closing the connection.
+// - A tile job of a raster command, as sent by render_distributed: the
+//   job parameters and tile=<x>,<y>,<width>,<height> overlap=<pixels>,
+//   the area of the command image to render. Answered as written by
+//   write_tile, or with "ERROR <message>\n".
+// - A job of an editing session, with session=<id> and optionally
+//   hide=<layer>,...: rendered by the agg renderer of the session without
+//   the hidden layers, reusing the layers of the previous job of the
+//   session (see incremental_renderer). Answered like other jobs.
+// - "status <id>": answered with "OK <state> layers=<n> stage=<stage>
+//   elapsed=<seconds>\n".
+// - "cancel <id>": answered with "OK\n", the job stopping before its next
+//   layer.
+// - "invalidate [<layer>]": drops the cached features of the layers of
+//   that name, or of all layers, and the layers kept by the sessions,
+//   answered with "OK\n".
+//
+// With several worker processes, each has its own job queue and caches:
+// status, cancel and invalidate only reach the worker accepting the
+// connection. Datasource connections opened while loading the maps are
+// inherited by all workers, unless the datasources were deferred (see
+// defer_datasources) and open in each worker on their first query.
+class render_server
+{
+    std::map<std::string, shared_map> const & maps;
+    const command_spec defaults;
+    const server_options options;
+
+public:
+    static constexpr std::size_t max_request_size = 64 * 1024;
+
+    render_server(std::map<std::string, shared_map> const & maps,
+                  command_spec const & defaults,
+                  server_options const & options)
+        : maps(maps), defaults(defaults), options(options)
+    {
+    }
+
+    // Serves jobs until SIGINT or SIGTERM is received. Free memory is
+    // returned to the system after every job, so that the resident size
+    // of the server does not creep up over time.
+    void run() const
+    {
+        std::signal(SIGPIPE, SIG_IGN);
+        std::signal(SIGINT, server_stop_handler);
+        std::signal(SIGTERM, server_stop_handler);
+
+        int listen_fd = listen_socket(options.socket_path);
+        if (options.workers > 1)
+        {
+            // The listening socket is non-blocking: workers woken for a
+            // connection accepted by another go back to polling.
+            std::vector<pid_t> children;
+            for (unsigned i = 0; i < options.workers; i++)
+            {
+                pid_t pid = ::fork();
+                if (pid == 0)
+                {
+                    serve(listen_fd);
+                    if (options.tracer)
+                    {
+                        std::ofstream file(options.trace_path + "." + std::to_string(::getpid()));
+                        options.tracer->write(file);
+                    }
+                    ::_exit(EXIT_SUCCESS);
+                }
+                if (pid < 0)
+                {
+                    std::clog << "Error: Cannot fork worker: " << std::strerror(errno) << std::endl;
+                    break;
+                }
+                children.push_back(pid);
+            }
+            while (!server_stop_requested() && !children.empty())
+            {
+                ::poll(nullptr, 0, 500);
+                pid_t pid;
+                while ((pid = ::waitpid(-1, nullptr, WNOHANG)) > 0)
+                {
+                    children.erase(std::remove(children.begin(), children.end(), pid), children.end());
+                }
+            }
+            for (pid_t pid : children)
+            {
+                ::kill(pid, SIGTERM);
+            }
+            for (pid_t pid : children)
+            {
+                ::waitpid(pid, nullptr, 0);
+            }
+        }
+        else
+        {
+            serve(listen_fd);
+        }
+
+        ::close(listen_fd);
+        if (!is_tcp_address(options.socket_path))
+        {
+            ::unlink(options.socket_path.c_str());
+        }
+    }
+
+private:
+    void serve(int listen_fd) const
+    {
+        std::unique_ptr<file_writer> writer;
+        if (options.writer)
+        {
+            writer.reset(new file_writer(*options.writer));
+        }
+        job_scheduler scheduler(options.threads, options.max_queued);
+        thread_pool connections(options.connection_threads);
+
+        while (!server_stop_requested())
+        {
+            pollfd pfd = { listen_fd, POLLIN, 0 };
+            int ready = ::poll(&pfd, 1, 500);
+            if (ready <= 0)
+            {
+                continue;
+            }
+            int fd = ::accept(listen_fd, nullptr, nullptr);
+            if (fd < 0)
+            {
+                continue;
+            }
+            connections.submit([this, fd, &scheduler, &writer] { handle(fd, scheduler, writer.get()); });
+        }
+    }
+
+    void handle(int fd, job_scheduler & scheduler, file_writer * writer) const
+    {
+        // Shared with the job once queued.
+        auto stream = std::make_shared<output_stream>(fd, true);
+        try
+        {
+            std::string line(read_line(fd, max_request_size));
+            std::istringstream tokens(line);
+            std::string word;
+            tokens >> word;
+            if (word == "invalidate")
+            {
+                if (!options.features && !options.sessions)
+                {
+                    throw std::runtime_error("No cache to invalidate");
+                }
+                std::string layer;
+                if (options.features)
+                {
+                    if (tokens >> layer)
+                    {
+                        options.features->invalidate(layer);
+                    }
+                    else
+                    {
+                        options.features->invalidate();
+                    }
+                }
+                if (options.sessions)
+                {
+                    options.sessions->invalidate();
+                }
+                *stream << "OK\n";
+                stream->flush();
+                return;
+            }
+            if (word == "status" || word == "cancel")
+            {
+                std::string id;
+                tokens >> id;
+                job_ptr j(scheduler.find(id));
+                if (!j)
+                {
+                    throw std::runtime_error("Unknown job: " + id);
+                }
+                if (word == "cancel")
+                {
+                    j->cancel();
+                    *stream << "OK\n";
+                }
+                else
+                {
+                    *stream << "OK " << j->status() << "\n";
+                }
+                stream->flush();
+                return;
+            }
+
+            job_request request(parse_job_request(line));
+            command_spec spec(parse_command_spec(request.parameters, defaults));
+            for (std::string * path : { &spec.output, &request.preview, &request.grid })
+            {
+                if (!path->empty())
+                {
+                    *path = resolve_output_path(options.output_directory, *path);
+                }
+            }
+            job_ptr j(scheduler.try_submit(request.id, request.priority, request.deadline,
+                                           options.listener,
+                                           [this, stream, spec, request, writer](job & j) {
+                                               if (request.tile)
+                                               {
+                                                   render_tile(j, spec, *request.tile, *stream);
+                                               }
+                                               else if (!request.session.empty())
+                                               {
+                                                   render_session(j, spec, request, *stream);
+                                               }
+                                               else
+                                               {
+                                                   render(j, spec, request.preview, request.grid, writer, *stream);
+                                               }
+                                           }));
+            if (!j)
+            {
+                throw std::runtime_error("Queue full");
+            }
+        }
+        catch (std::exception const & e)
+        {
+            std::clog << "Error: " << e.what() << std::endl;
+            *stream << "ERROR " << e.what() << "\n";
+            stream->flush();
+        }
+    }
+
+    void render_tile(job & j, command_spec const & spec, tile_region const & region,
+                     output_stream & stream) const
+    {
+        try
+        {
+            j.check();
+            shared_map map(find_map(maps, spec.map));
+            command cmd(spec.to_command(map->srs()));
+            dispatch_renderer(spec.renderer, [&](auto tag) {
+                using renderer_type = typename decltype(tag)::type;
+                if constexpr (renderer_type::support_tiles)
+                {
+                    renderer<renderer_type> r(map, options.tiles);
+                    r.set_listener(&j);
+                    r.set_image_pool(options.images);
+                    map_view view(r.view(cmd));
+                    if (region.x >= view.req.width() || region.y >= view.req.height())
+                    {
+                        throw std::runtime_error("Tile outside of the image");
+                    }
+                    tile t(make_tile(view.req.width(), view.req.height(), region.x, region.y,
+                                     region.width, region.height, region.overlap));
+                    mapnik::image_rgba8 image(r.render(cmd, t));
+                    {
+                        render_stage stage(&j, "encode");
+                        write_tile(image, t, stream);
+                    }
+                    if (options.images)
+                    {
+                        options.images->release(std::move(image));
+                    }
+                }
+                else
+                {
+                    throw std::runtime_error("Renderer does not support tiles: " + spec.renderer);
+                }
+            });
+        }
+        catch (std::exception const & e)
+        {
+            std::clog << "Error: job " << j.id << ": " << e.what() << std::endl;
+            stream << "ERROR " << e.what() << "\n";
+            stream.flush();
+            release_free_memory();
+            throw;
+        }
+        stream.flush();
+        release_free_memory();
+    }
+
+    void render_session(job & j, command_spec const & spec, job_request const & request,
+                        output_stream & stream) const
+    {
+        bool answered = false;
+        try
+        {
+            j.check();
+            if (!options.sessions)
+            {
+                throw std::runtime_error("No sessions");
+            }
+            if (spec.renderer != agg_renderer::name)
+            {
+                throw std::runtime_error("Sessions render with the agg renderer only");
+            }
+            shared_map map(find_map(maps, spec.map));
+            command cmd(spec.to_command(map->srs()));
+            session_cache::session s(options.sessions->get(request.session, map));
+            mapnik::image_rgba8 image;
+            {
+                std::lock_guard<std::mutex> lock(*s.mutex);
+                s.ren->set_listener(&j);
+                image = s.ren->render(cmd, request.hidden);
+            }
+            options.sessions->trim();
+            render_stage stage(&j, "encode");
+            if (spec.output.empty())
+            {
+                stream << "OK\n";
+                answered = true;
+                write_png(image, stream, options.png);
+            }
+            else
+            {
+                output_stream file(spec.output);
+                write_png(image, file, options.png);
+                if (!file.flush())
+                {
+                    throw std::runtime_error("Cannot write output: " + spec.output);
+                }
+                stream << "OK " << spec.output << "\n";
+            }
+        }
+        catch (std::exception const & e)
+        {
+            std::clog << "Error: job " << j.id << ": " << e.what() << std::endl;
+            if (!answered)
+            {
+                stream << "ERROR " << e.what() << "\n";
+            }
+            stream.flush();
+            release_free_memory();
+            throw;
+        }
+        stream.flush();
+        release_free_memory();
+    }
+
+    void render(job & j, command_spec const & spec, std::string const & preview,
+                std::string const & grid, file_writer * writer, output_stream & stream) const
+    {
+        bool answered = false;
+        try
+        {
+            j.check();
+            shared_map map(find_map(maps, spec.map));
+            command cmd(spec.to_command(map->srs()));
+            if (options.device)
+            {
+                map = options.device->for_renderer(spec.renderer, map, cmd.dpi);
+            }
+            if (options.scales)
+            {
+                map = options.scales->get(map, cmd);
+            }
+            // All jobs render from the same map, only the view of the job
+            // being specific to it.
+            auto configure = [&](auto & r) {
+                r.set_listener(&j);
+                r.set_png_options(options.png);
+                r.set_vector_options(options.vector);
+                r.set_cache(options.cache);
+                r.set_writer(writer);
+                r.set_image_pool(options.images);
+            };
+            auto render_output = [&](auto & r) {
+                if (spec.output.empty())
+                {
+                    stream << "OK\n";
+                    answered = true;
+                    r.render(cmd, stream);
+                }
+                else
+                {
+                    // Answered once the file is written.
+                    r.render(cmd, boost::filesystem::path(spec.output)).get();
+                    if (grid.empty())
+                    {
+                        stream << "OK " << spec.output << "\n";
+                    }
+                }
+            };
+
+            if (!grid.empty())
+            {
+#if defined(GRID_RENDERER)
+                if (!preview.empty())
+                {
+                    throw std::runtime_error("Jobs cannot have both a preview and a grid");
+                }
+                dispatch_renderer(spec.renderer, [&](auto tag) {
+                    render_with_grid<typename decltype(tag)::type>(map, cmd, options.tiles, grid,
+                                                                   configure, render_output);
+                });
+                if (!spec.output.empty())
+                {
+                    stream << "OK " << spec.output << "\n";
+                }
+#else
+                throw std::runtime_error("Grid renderer not built in");
+#endif
+            }
+            else if (preview.empty())
+            {
+                dispatch_renderer(spec.renderer, [&](auto tag) {
+                    renderer<typename decltype(tag)::type> r(map, options.tiles);
+                    configure(r);
+                    render_output(r);
+                });
+            }
+            else
+            {
+                progressive_options progressive(options.progressive);
+                progressive.preview_path = preview;
+                dispatch_renderer(spec.renderer, [&](auto tag) {
+                    render_progressive<typename decltype(tag)::type>(
+                        map, cmd, options.tiles, progressive, configure, [&] {
+                            stream << "PREVIEW " << preview << "\n";
+                            stream.flush();
+                        }, render_output);
+                });
+            }
+        }
+        catch (std::exception const & e)
+        {
+            std::clog << "Error: job " << j.id << ": " << e.what() << std::endl;
+            if (!answered)
+            {
+                stream << "ERROR " << e.what() << "\n";
+            }
+            stream.flush();
+            release_free_memory();
+            throw;
+        }
+        stream.flush();
+        release_free_memory();
+    }
+};
+
+}
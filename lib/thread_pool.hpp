@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+
+namespace mapnik_print
+{
+
+class thread_pool
+{
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+
+public:
+    // Zero threads means one per hardware core.
+    explicit thread_pool(unsigned threads)
+    {
+        if (threads == 0)
+        {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        workers.reserve(threads);
+        for (unsigned i = 0; i < threads; i++)
+        {
+            workers.emplace_back([this] { run(); });
+        }
+    }
+
+    thread_pool(thread_pool const &) = delete;
+    thread_pool & operator=(thread_pool const &) = delete;
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        for (std::thread & worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    unsigned size() const
+    {
+        return workers.size();
+    }
+
+    template <typename Function>
+    std::future<typename std::result_of<Function()>::type> submit(Function && function)
+    {
+        using result_type = typename std::result_of<Function()>::type;
+        auto task = std::make_shared<std::packaged_task<result_type()>>(
+            std::forward<Function>(function));
+        std::future<result_type> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace_back([task] { (*task)(); });
+        }
+        condition.notify_one();
+        return result;
+    }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <vector>
+#include <future>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <thread>
+
+#include <mapnik/map.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/request.hpp>
+
+#include "thread_pool.hpp"
+#include "image_pool.hpp"
+
+namespace mapnik_print
+{
+
+struct render_listener;
+
+struct tile_options
+{
+    // One thread disables tiling, zero means one thread per core.
+    unsigned threads = 1;
+    unsigned tile_size = 1024;
+    // Pixels rendered around each tile and cropped away when stitching,
+    // so that labels and symbols crossing a seam are placed the same way
+    // in both neighbouring tiles. Given at a scale factor of one, see
+    // scaled_overlap.
+    unsigned overlap = 256;
+    // Bytes of memory for raster output, zero for no limit. Larger
+    // outputs are rendered in horizontal strips encoded one at a time.
+    std::size_t memory_budget = 0;
+
+    bool enabled(mapnik::request const & req) const
+    {
+        return threads != 1 && tile_size > 0 &&
+            (req.width() > tile_size || req.height() > tile_size);
+    }
+
+    // Bytes of the tile images rendered at the same time, one per thread,
+    // when an image of the given size is tiled.
+    std::size_t tile_bytes(unsigned width, unsigned height) const
+    {
+        if (threads == 1 || tile_size == 0 || (width <= tile_size && height <= tile_size))
+        {
+            return 0;
+        }
+        std::size_t tile_width = std::min(width, tile_size + 2 * overlap);
+        std::size_t tile_height = std::min(height, tile_size + 2 * overlap);
+        unsigned tile_threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        return tile_threads * tile_width * tile_height * 4;
+    }
+
+    // Rows of the strips to render the image in, zero when it fits the
+    // memory budget as a whole. A strip is held twice, once rendered with
+    // its overlap and once being compressed, on top of the tile images it
+    // is rendered from and the bytes an image pool may hold.
+    unsigned strip_rows(unsigned width, unsigned height, std::size_t pooled = 0) const
+    {
+        std::size_t row_size = std::size_t(width) * 4;
+        std::size_t reserved = tile_bytes(width, height) + pooled;
+        if (memory_budget == 0 || 2 * row_size * height + reserved <= memory_budget)
+        {
+            return 0;
+        }
+        std::size_t rows = memory_budget > reserved ? (memory_budget - reserved) / (2 * row_size) : 0;
+        if (rows <= 2 * overlap)
+        {
+            throw std::runtime_error("Memory budget too small for an output " +
+                std::to_string(width) + " pixels wide");
+        }
+        return rows - 2 * overlap;
+    }
+};
+
+// Overlap in pixels of the tiles of the map drawn at the given scale
+// factor. Labels and symbols grow with the scale factor, and the buffers
+// of the map and of its layers are meant to hold the largest of them:
+// the overlap is the larger of the given one and the largest buffer,
+// scaled. Symbols larger than both may still be drawn differently on
+// both sides of a seam.
+inline unsigned scaled_overlap(mapnik::Map const & map, double scale_factor, unsigned overlap)
+{
+    int buffer = map.buffer_size();
+    for (mapnik::layer const & lyr : map.layers())
+    {
+        buffer = std::max(buffer, lyr.buffer_size().get_value_or(0));
+    }
+    return static_cast<unsigned>(std::ceil(std::max<double>(overlap, buffer) * scale_factor));
+}
+
+struct tile
+{
+    // Area of the final image covered by the tile.
+    unsigned x, y, width, height;
+    // Rendered area including the overlap.
+    unsigned render_x, render_y, render_width, render_height;
+};
+
+// Tile of the area [x, x + width) x [y, y + height) of an image, rendered
+// with the overlap around it. Tiles are not extended past the image
+// edges, where the full image would not have any content either.
+inline tile make_tile(unsigned image_width, unsigned image_height,
+                      unsigned x, unsigned y, unsigned width, unsigned height,
+                      unsigned overlap)
+{
+    tile t;
+    t.x = x;
+    t.y = y;
+    t.width = std::min(width, image_width - x);
+    t.height = std::min(height, image_height - y);
+    t.render_x = x - std::min(overlap, x);
+    t.render_y = y - std::min(overlap, y);
+    t.render_width = std::min(image_width, x + t.width + overlap) - t.render_x;
+    t.render_height = std::min(image_height, y + t.height + overlap) - t.render_y;
+    return t;
+}
+
+inline std::vector<tile> split_tiles(unsigned width, unsigned height,
+                                     unsigned tile_size, unsigned overlap)
+{
+    std::vector<tile> tiles;
+    for (unsigned y = 0; y < height; y += tile_size)
+    {
+        for (unsigned x = 0; x < width; x += tile_size)
+        {
+            tiles.push_back(make_tile(width, height, x, y, tile_size, tile_size, overlap));
+        }
+    }
+    return tiles;
+}
+
+// Full width strip of rows [y, y + rows) rendered with the overlap
+// above and below.
+inline tile strip_tile(unsigned width, unsigned height, unsigned y, unsigned rows, unsigned overlap)
+{
+    return make_tile(width, height, 0, y, width, rows, overlap);
+}
+
+inline mapnik::request tile_request(mapnik::request const & req, tile const & t)
+{
+    mapnik::box2d<double> const & extent = req.extent();
+    double pixel_width = extent.width() / req.width();
+    double pixel_height = extent.height() / req.height();
+    mapnik::box2d<double> tile_extent(
+        extent.minx() + t.render_x * pixel_width,
+        extent.maxy() - (t.render_y + t.render_height) * pixel_height,
+        extent.minx() + (t.render_x + t.render_width) * pixel_width,
+        extent.maxy() - t.render_y * pixel_height);
+    mapnik::request tile_req(t.render_width, t.render_height, tile_extent);
+    tile_req.set_buffer_size(req.buffer_size());
+    return tile_req;
+}
+
+template <typename Image>
+void copy_tile(Image & image, Image const & tile_image, tile const & t)
+{
+    for (unsigned row = 0; row < t.height; row++)
+    {
+        std::memcpy(image.get_row(t.y + row) + t.x,
+                    tile_image.get_row(t.y - t.render_y + row) + (t.x - t.render_x),
+                    t.width * Image::pixel_size);
+    }
+}
+
+// Renders the request in tiles on a thread pool and stitches them into
+// one image.
+template <typename Renderer>
+typename Renderer::image_type render_tiled(Renderer const & ren,
+                                           mapnik::Map const & map,
+                                           mapnik::request const & req,
+                                           double scale_factor,
+                                           tile_options const & options,
+                                           render_listener * listener = nullptr,
+                                           image_pool * pool = nullptr)
+{
+    static_assert(Renderer::support_tiles, "Renderer does not support tiles");
+    using image_type = typename Renderer::image_type;
+
+    std::vector<tile> tiles(split_tiles(req.width(), req.height(),
+                                        options.tile_size, options.overlap));
+    image_type image(pool ? pool->acquire(req.width(), req.height()) : image_type(req.width(), req.height()));
+    thread_pool threads(options.threads);
+    std::vector<std::future<bool>> results;
+    results.reserve(tiles.size());
+
+    for (tile const & t : tiles)
+    {
+        results.emplace_back(threads.submit([&, t] {
+            image_type tile_image(ren.render(map, tile_request(req, t), scale_factor, listener, pool));
+            copy_tile(image, tile_image, t);
+            bool premultiplied = tile_image.get_premultiplied();
+            if (pool)
+            {
+                pool->release(std::move(tile_image));
+            }
+            return premultiplied;
+        }));
+    }
+
+    bool premultiplied = false;
+    for (std::future<bool> & result : results)
+    {
+        // Rethrows the first failure once all tiles have finished.
+        result.wait();
+    }
+    for (std::future<bool> & result : results)
+    {
+        premultiplied = result.get();
+    }
+    image.set_premultiplied(premultiplied);
+    return image;
+}
+
+}
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <algorithm>
+#include <cstdio>
+
+#include <mapnik/map.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/datasource.hpp>
+#include <mapnik/feature.hpp>
+#include <mapnik/query.hpp>
+
+#include "renderer.hpp"
+
+namespace mapnik_print
+{
+
+// Collects timed events of one or more print jobs and writes them in the
+// Chrome trace event format, viewable in chrome://tracing or Perfetto.
+// Beyond max_events, the oldest events are dropped, so that long running
+// servers keep the most recent ones.
+class trace
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using arguments = std::vector<std::pair<std::string, double>>;
+
+private:
+    struct event
+    {
+        std::string name;
+        std::string category;
+        char phase;
+        double timestamp;
+        double duration;
+        unsigned thread;
+        arguments args;
+    };
+
+    const clock::time_point origin = clock::now();
+    const std::size_t max_events;
+    std::mutex mutex;
+    std::deque<event> events;
+    std::size_t dropped = 0;
+    std::map<std::thread::id, unsigned> threads;
+
+public:
+    explicit trace(std::size_t max_events = 1000000)
+        : max_events(std::max<std::size_t>(1, max_events))
+    {
+    }
+
+    double now() const
+    {
+        return std::chrono::duration<double, std::micro>(clock::now() - origin).count();
+    }
+
+    void begin(std::string const & name, std::string const & category)
+    {
+        add(name, category, 'B', now(), 0);
+    }
+
+    void end(std::string const & name, std::string const & category, arguments args = arguments())
+    {
+        add(name, category, 'E', now(), 0, std::move(args));
+    }
+
+    // Event which started at the given time and lasts until now.
+    void complete(std::string const & name, std::string const & category,
+                  double start, arguments args = arguments())
+    {
+        add(name, category, 'X', start, now() - start, std::move(args));
+    }
+
+    void counter(std::string const & name, double value)
+    {
+        add(name, "counter", 'C', now(), 0, { { name, value } });
+    }
+
+    void write(std::ostream & out)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (std::size_t i = 0; i < events.size(); i++)
+        {
+            event const & e = events[i];
+            out << (i ? "," : "") << "\n{\"name\":\"" << escape_json(e.name)
+                << "\",\"cat\":\"" << escape_json(e.category)
+                << "\",\"ph\":\"" << e.phase
+                << "\",\"ts\":" << e.timestamp;
+            if (e.phase == 'X')
+            {
+                out << ",\"dur\":" << e.duration;
+            }
+            out << ",\"pid\":1,\"tid\":" << e.thread;
+            if (!e.args.empty())
+            {
+                out << ",\"args\":{";
+                for (std::size_t j = 0; j < e.args.size(); j++)
+                {
+                    out << (j ? "," : "") << "\"" << escape_json(e.args[j].first)
+                        << "\":" << e.args[j].second;
+                }
+                out << "}";
+            }
+            out << "}";
+        }
+        out << "\n],\"otherData\":{\"dropped_events\":" << dropped << "}}\n";
+    }
+
+private:
+    void add(std::string const & name, std::string const & category, char phase,
+             double timestamp, double duration, arguments args = arguments())
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        unsigned thread = threads.emplace(std::this_thread::get_id(), threads.size()).first->second;
+        events.push_back({ name, category, phase, timestamp, duration, thread, std::move(args) });
+        if (events.size() > max_events)
+        {
+            events.pop_front();
+            dropped++;
+        }
+    }
+};
+
+class trace_span
+{
+    trace & t;
+    const std::string name;
+    const std::string category;
+    const double start;
+
+public:
+    trace_span(trace & t, std::string const & name, std::string const & category)
+        : t(t), name(name), category(category), start(t.now())
+    {
+    }
+
+    ~trace_span()
+    {
+        t.complete(name, category, start);
+    }
+};
+
+// Records render stages and layers of the renderers it is attached to.
+class trace_listener : public render_listener
+{
+    trace & t;
+
+public:
+    explicit trace_listener(trace & t)
+        : t(t)
+    {
+    }
+
+    void layer_begin(mapnik::layer const & lyr) override
+    {
+        t.begin(lyr.name(), "layer");
+    }
+
+    void layer_end(mapnik::layer const & lyr) override
+    {
+        t.end(lyr.name(), "layer");
+    }
+
+    void stage_begin(char const * stage) override
+    {
+        t.begin(stage, "stage");
+    }
+
+    void stage_end(char const * stage) override
+    {
+        t.end(stage, "stage");
+    }
+
+    void counter(char const * name, double value) override
+    {
+        t.counter(name, value);
+    }
+};
+
+// Featureset recording the number of features read and the time spent
+// reading them, reported when the renderer is done with it.
+class traced_featureset : public mapnik::Featureset
+{
+    const mapnik::featureset_ptr features;
+    trace & t;
+    const std::string layer_name;
+    const double start;
+    std::size_t count = 0;
+    double fetch_time = 0;
+
+public:
+    traced_featureset(mapnik::featureset_ptr const & features, trace & t,
+                      std::string const & layer_name, double start)
+        : features(features), t(t), layer_name(layer_name), start(start)
+    {
+    }
+
+    ~traced_featureset()
+    {
+        t.complete(layer_name, "features", start,
+                   { { "features", static_cast<double>(count) },
+                     { "fetch_ms", fetch_time / 1000.0 } });
+    }
+
+    mapnik::feature_ptr next() override
+    {
+        double fetch_start = t.now();
+        mapnik::feature_ptr feature(features->next());
+        fetch_time += t.now() - fetch_start;
+        if (feature)
+        {
+            count++;
+        }
+        return feature;
+    }
+};
+
+// Datasource proxy timing the queries of a layer.
+class traced_datasource : public mapnik::datasource
+{
+    const mapnik::datasource_ptr ds;
+    trace & t;
+    const std::string layer_name;
+
+public:
+    traced_datasource(mapnik::datasource_ptr const & ds, trace & t, std::string const & layer_name)
+        : mapnik::datasource(ds->params()), ds(ds), t(t), layer_name(layer_name)
+    {
+    }
+
+    datasource_t type() const override
+    {
+        return ds->type();
+    }
+
+    mapnik::featureset_ptr features(mapnik::query const & q) const override
+    {
+        return trace_query([&] { return ds->features(q); });
+    }
+
+    mapnik::featureset_ptr features_with_context(mapnik::query const & q,
+                                                 mapnik::processor_context_ptr ctx) const override
+    {
+        return trace_query([&] { return ds->features_with_context(q, ctx); });
+    }
+
+    mapnik::processor_context_ptr get_context(mapnik::feature_style_context_map & ctx) const override
+    {
+        return ds->get_context(ctx);
+    }
+
+    mapnik::featureset_ptr features_at_point(mapnik::coord2d const & pt, double tol) const override
+    {
+        return ds->features_at_point(pt, tol);
+    }
+
+    mapnik::box2d<double> envelope() const override
+    {
+        return ds->envelope();
+    }
+
+    boost::optional<mapnik::datasource_geometry_t> get_geometry_type() const override
+    {
+        return ds->get_geometry_type();
+    }
+
+    mapnik::layer_descriptor get_descriptor() const override
+    {
+        return ds->get_descriptor();
+    }
+
+private:
+    template <typename Query>
+    mapnik::featureset_ptr trace_query(Query query) const
+    {
+        double start = t.now();
+        mapnik::featureset_ptr features;
+        {
+            trace_span span(t, layer_name, "query");
+            features = query();
+        }
+        if (!features)
+        {
+            return features;
+        }
+        return std::make_shared<traced_featureset>(features, t, layer_name, start);
+    }
+};
+
+// Wraps the datasources of the map layers to record queries in the trace.
+inline void trace_datasources(mapnik::Map & map, trace & t)
+{
+    for (mapnik::layer & lyr : map.layers())
+    {
+        if (lyr.datasource())
+        {
+            lyr.set_datasource(std::make_shared<traced_datasource>(lyr.datasource(), t, lyr.name()));
+        }
+    }
+}
+
+}
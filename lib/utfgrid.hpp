@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <mapnik/grid/grid.hpp>
+#include <mapnik/feature.hpp>
+#include <mapnik/value.hpp>
+
+#include "output.hpp"
+
+namespace mapnik_print
+{
+
+namespace utfgrid_detail
+{
+
+// Character of the key of the given index: from the space on, skipping
+// the characters JSON escapes and the UTF-16 surrogates.
+inline std::uint32_t key_code(std::size_t index)
+{
+    std::uint32_t code = static_cast<std::uint32_t>(32 + index);
+    if (code >= 34)
+    {
+        code++;
+    }
+    if (code >= 92)
+    {
+        code++;
+    }
+    if (code >= 0xd800)
+    {
+        code += 0x800;
+    }
+    return code;
+}
+
+inline void append_utf8(std::string & out, std::uint32_t code)
+{
+    if (code < 0x80)
+    {
+        out.push_back(static_cast<char>(code));
+    }
+    else if (code < 0x800)
+    {
+        out.push_back(static_cast<char>(0xc0 | (code >> 6)));
+        out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+    }
+    else if (code < 0x10000)
+    {
+        out.push_back(static_cast<char>(0xe0 | (code >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+    }
+    else
+    {
+        out.push_back(static_cast<char>(0xf0 | (code >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+    }
+}
+
+inline void write_value(std::ostream & out, mapnik::value const & value)
+{
+    if (value.is_null())
+    {
+        out << "null";
+    }
+    else if (value.is<mapnik::value_bool>())
+    {
+        out << (value.to_bool() ? "true" : "false");
+    }
+    else if (value.is<mapnik::value_integer>() || value.is<mapnik::value_double>())
+    {
+        out << value.to_string();
+    }
+    else
+    {
+        out << "\"" << escape_json(value.to_string()) << "\"";
+    }
+}
+
+}
+
+// Writes the grid as UTFGrid JSON: one string per row with a character
+// per cell, the keys of the characters, and the fields of the feature of
+// each key. Features sharing a key share a character and their data is
+// written once; runs of cells of the same feature are looked up once.
+template <typename Grid>
+void write_utfgrid(Grid const & grid, std::ostream & out)
+{
+    using namespace utfgrid_detail;
+    using value_type = typename Grid::value_type;
+
+    typename Grid::feature_key_type const & feature_keys = grid.get_feature_keys();
+    // Cells without a feature have the empty key.
+    std::vector<std::string> keys{ "" };
+    std::map<std::string, std::size_t> key_indexes{ { "", 0 } };
+
+    out << "{\"grid\":[";
+    std::string line;
+    for (unsigned y = 0; y < grid.height(); y++)
+    {
+        value_type const * row = grid.get_row(y);
+        line.clear();
+        std::string code;
+        for (unsigned x = 0; x < grid.width(); x++)
+        {
+            if (x == 0 || row[x] != row[x - 1])
+            {
+                std::size_t index = 0;
+                auto feature_key = feature_keys.find(row[x]);
+                if (feature_key != feature_keys.end())
+                {
+                    auto inserted = key_indexes.emplace(feature_key->second, keys.size());
+                    if (inserted.second)
+                    {
+                        keys.push_back(feature_key->second);
+                    }
+                    index = inserted.first->second;
+                }
+                code.clear();
+                append_utf8(code, key_code(index));
+            }
+            line += code;
+        }
+        out << (y > 0 ? "," : "") << "\"" << line << "\"";
+    }
+
+    out << "],\"keys\":[";
+    for (std::size_t i = 0; i < keys.size(); i++)
+    {
+        out << (i > 0 ? "," : "") << "\"" << escape_json(keys[i]) << "\"";
+    }
+
+    out << "],\"data\":{";
+    typename Grid::feature_type const & features = grid.get_grid_features();
+    bool first_key = true;
+    for (std::size_t i = 1; i < keys.size(); i++)
+    {
+        auto feature = features.find(keys[i]);
+        if (feature == features.end() || !feature->second)
+        {
+            continue;
+        }
+        out << (first_key ? "" : ",") << "\"" << escape_json(keys[i]) << "\":{";
+        first_key = false;
+        bool first_field = true;
+        for (std::string const & field : grid.get_fields())
+        {
+            bool id = field == "__id__";
+            if (!id && !feature->second->has_key(field))
+            {
+                continue;
+            }
+            out << (first_field ? "" : ",") << "\"" << escape_json(field) << "\":";
+            first_field = false;
+            if (id)
+            {
+                out << feature->second->id();
+            }
+            else
+            {
+                write_value(out, feature->second->get(field));
+            }
+        }
+        out << "}";
+    }
+    out << "}}";
+}
+
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <type_traits>
+
+#include <mapnik/map.hpp>
+#include <mapnik/rule.hpp>
+#include <mapnik/symbolizer.hpp>
+#include <mapnik/feature_type_style.hpp>
+
+#include "renderer.hpp"
+
+namespace mapnik_print
+{
+
+// Symbolizers drawing geometries as paths, whose vertices closer than a
+// device pixel are invisible in print.
+template <typename Symbolizer>
+constexpr bool is_path_symbolizer =
+    std::is_same<Symbolizer, mapnik::line_symbolizer>::value ||
+    std::is_same<Symbolizer, mapnik::polygon_symbolizer>::value ||
+    std::is_same<Symbolizer, mapnik::line_pattern_symbolizer>::value ||
+    std::is_same<Symbolizer, mapnik::polygon_pattern_symbolizer>::value;
+
+// Copy of the map whose path symbolizers simplify geometries to the
+// device pixel of the given resolution and clip them to the view. Both
+// are set only where the style does not, vector renderers drawing at 72
+// units per inch.
+inline shared_map simplify_for_device(mapnik::Map const & map, double dpi)
+{
+    auto copy = std::make_shared<mapnik::Map>(map);
+    double tolerance = command::points_per_inch / dpi;
+    for (auto & style : copy->styles())
+    {
+        for (mapnik::rule & r : style.second.get_rules_nonconst())
+        {
+            for (mapnik::symbolizer & sym : r)
+            {
+                mapnik::util::apply_visitor([&](auto & s) {
+                    using symbolizer_type = typename std::decay<decltype(s)>::type;
+                    if constexpr (is_path_symbolizer<symbolizer_type>)
+                    {
+                        if (s.properties.find(mapnik::keys::simplify_tolerance) == s.properties.end())
+                        {
+                            mapnik::put(s, mapnik::keys::simplify_tolerance, tolerance);
+                        }
+                        if (s.properties.find(mapnik::keys::clip) == s.properties.end())
+                        {
+                            mapnik::put(s, mapnik::keys::clip, true);
+                        }
+                    }
+                }, sym);
+            }
+        }
+    }
+    return copy;
+}
+
+// Device simplified copies of the maps, one per map and resolution, so
+// that renders of the same resolution share one copy. Beyond max_maps
+// copies, the least recently used one is dropped.
+class device_maps
+{
+    struct entry
+    {
+        // The original is kept so that its address is not reused.
+        shared_map map;
+        double dpi;
+        shared_map simplified;
+    };
+
+    const std::size_t max_maps;
+    std::mutex mutex;
+    // Least recently used first.
+    std::list<entry> maps;
+
+public:
+    explicit device_maps(std::size_t max_maps = 16)
+        : max_maps(std::max<std::size_t>(1, max_maps))
+    {
+    }
+
+    shared_map get(shared_map const & map, double dpi)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = maps.begin(); it != maps.end(); ++it)
+        {
+            if (it->map == map && it->dpi == dpi)
+            {
+                maps.splice(maps.end(), maps, it);
+                return it->simplified;
+            }
+        }
+        maps.push_back({ map, dpi, simplify_for_device(*map, dpi) });
+        if (maps.size() > max_maps)
+        {
+            maps.pop_front();
+        }
+        return maps.back().simplified;
+    }
+
+    // The simplified map for the vector renderers, the map itself for the
+    // raster ones.
+    shared_map for_renderer(std::string const & renderer_name, shared_map const & map, double dpi)
+    {
+        return find_renderer(renderer_name).support_streaming ? get(map, dpi) : map;
+    }
+};
+
+}
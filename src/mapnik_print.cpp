@@ -1,10 +1,30 @@
 #include "../lib/renderer.hpp"
-//#include "config.hpp"
+#include "../lib/command_spec.hpp"
+#include "../lib/server.hpp"
+#include "../lib/benchmark.hpp"
+#include "../lib/load_test.hpp"
+#include "../lib/trace.hpp"
+#include "../lib/batch.hpp"
+#include "../lib/multi_output.hpp"
+#include "../lib/progressive.hpp"
+#include "../lib/feature_cache.hpp"
+#include "../lib/lazy_datasource.hpp"
+#include "../lib/fonts.hpp"
+#include "../lib/vector_quality.hpp"
+#include "../lib/scale_styles.hpp"
+#include "../lib/distributed.hpp"
+#include "../lib/incremental.hpp"
+#include "../lib/interactivity.hpp"
 
 #include <mapnik/datasource_cache.hpp>
-#include <mapnik/font_engine_freetype.hpp>
+#include <mapnik/load_map.hpp>
+#include <mapnik/debug.hpp>
 
 #include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+#include <iostream>
+#include <chrono>
 
 #ifdef MAPNIK_LOG
 using log_levels_map = std::map<std::string, mapnik::logger::severity_type>;
@@ -20,18 +40,259 @@ log_levels_map log_levels
 
 namespace po = boost::program_options;
 
+static const std::vector<std::string> command_parameters
+{
+    "renderer", "output", "srs", "center", "size", "scale", "zoom", "dpi"
+};
+
+static std::map<std::string, mapnik_print::shared_map> load_maps(std::vector<std::string> const & files,
+                                                                 mapnik_print::feature_cache * features,
+                                                                 bool lazy_datasources,
+                                                                 mapnik_print::trace * tracer)
+{
+    std::map<std::string, mapnik_print::shared_map> maps;
+    for (std::string const & file : files)
+    {
+        auto map = std::make_shared<mapnik::Map>();
+        if (tracer)
+        {
+            mapnik_print::trace_span span(*tracer, "load " + file, "stage");
+            mapnik::load_map(*map, file);
+        }
+        else
+        {
+            mapnik::load_map(*map, file);
+        }
+        if (lazy_datasources)
+        {
+            mapnik_print::defer_datasources(*map);
+        }
+        if (tracer)
+        {
+            mapnik_print::trace_datasources(*map, *tracer);
+        }
+        for (std::string const & face : mapnik_print::warm_fonts(*map))
+        {
+            std::clog << "Warning: " << file << ": Cannot open font " << face << std::endl;
+        }
+        if (features)
+        {
+            mapnik_print::cache_features(*map, *features);
+        }
+        maps.emplace(boost::filesystem::path(file).stem().string(), std::move(map));
+    }
+    return maps;
+}
+
+static mapnik_print::command make_command(mapnik_print::shared_map const & map,
+                                          mapnik_print::command_spec const & spec,
+                                          mapnik_print::trace * tracer)
+{
+    if (tracer)
+    {
+        mapnik_print::trace_span span(*tracer, "command", "stage");
+        return spec.to_command(map->srs());
+    }
+    return spec.to_command(map->srs());
+}
+
+// Writes the trace when the program is done, however it finishes.
+struct trace_writer
+{
+    mapnik_print::trace * tracer;
+    std::string path;
+
+    ~trace_writer()
+    {
+        if (tracer)
+        {
+            std::ofstream file(path);
+            tracer->write(file);
+        }
+    }
+};
+
+static std::vector<std::string> split(std::string const & list)
+{
+    std::vector<std::string> items;
+    std::istringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        items.push_back(item);
+    }
+    return items;
+}
+
+static std::vector<unsigned> parse_counts(std::string const & list)
+{
+    std::vector<unsigned> counts;
+    for (std::string const & item : split(list))
+    {
+        std::istringstream value(item);
+        unsigned count;
+        if (!(value >> count) || !value.eof())
+        {
+            throw std::runtime_error("Invalid count: " + item);
+        }
+        counts.push_back(count);
+    }
+    return counts;
+}
+
+// Format of the manifest at the path, given by --batch-format or its
+// extension.
+static mapnik_print::manifest_format manifest_format_of(po::variables_map const & vm, std::string const & path)
+{
+    std::string format(vm.count("batch-format") ? vm["batch-format"].as<std::string>() :
+        boost::filesystem::path(path).extension() == ".csv" ? "csv" : "jsonl");
+    if (format != "jsonl" && format != "csv")
+    {
+        throw std::runtime_error("Unknown manifest format: " + format);
+    }
+    return format == "csv" ? mapnik_print::manifest_format::csv : mapnik_print::manifest_format::json_lines;
+}
+
+static void render(mapnik_print::shared_map const & map,
+                   std::string const & map_name,
+                   mapnik_print::command_spec const & spec,
+                   mapnik_print::tile_options const & tiles,
+                   mapnik_print::vector_options const & vector,
+                   mapnik_print::png_options const & png,
+                   mapnik_print::output_cache * cache,
+                   mapnik_print::file_writer * writer,
+                   mapnik_print::image_pool * images,
+                   boost::optional<mapnik_print::progressive_options> const & progressive,
+                   boost::optional<std::string> const & grid,
+                   mapnik_print::device_maps * device,
+                   mapnik_print::scale_maps * scales,
+                   bool show_duration,
+                   mapnik_print::trace * tracer,
+                   mapnik_print::render_listener * listener)
+{
+    mapnik_print::command cmd(make_command(map, spec, tracer));
+    mapnik_print::shared_map render_map(device ? device->for_renderer(spec.renderer, map, cmd.dpi) : map);
+    if (scales)
+    {
+        render_map = scales->get(render_map, cmd);
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto configure = [&](auto & r) {
+        r.set_listener(listener);
+        r.set_png_options(png);
+        r.set_vector_options(vector);
+        r.set_cache(cache);
+        r.set_writer(writer);
+        r.set_image_pool(images);
+    };
+    auto render_output = [&](auto & r) {
+        using renderer_type = typename std::decay<decltype(r)>::type::renderer_type;
+        std::string output(spec.output.empty() ? map_name + renderer_type::ext : spec.output);
+        r.render(cmd, boost::filesystem::path(output));
+    };
+    if (progressive)
+    {
+        mapnik_print::progressive_options options(*progressive);
+        if (options.preview_path.empty())
+        {
+            options.preview_path = map_name + ".preview.png";
+        }
+        mapnik_print::dispatch_renderer(spec.renderer, [&](auto tag) {
+            mapnik_print::render_progressive<typename decltype(tag)::type>(
+                render_map, cmd, tiles, options, configure, [&] {
+                    if (show_duration)
+                    {
+                        std::chrono::duration<double, std::milli> duration =
+                            std::chrono::steady_clock::now() - start;
+                        std::clog << map_name << " preview: " << duration.count() << " ms" << std::endl;
+                    }
+                }, render_output);
+        });
+    }
+#if defined(GRID_RENDERER)
+    else if (grid)
+    {
+        std::string grid_path(grid->empty() ? map_name + ".grid" + mapnik_print::grid_renderer::ext : *grid);
+        mapnik_print::dispatch_renderer(spec.renderer, [&](auto tag) {
+            mapnik_print::render_with_grid<typename decltype(tag)::type>(
+                render_map, cmd, tiles, grid_path, configure, render_output);
+        });
+    }
+#endif
+    else
+    {
+        mapnik_print::dispatch_renderer(spec.renderer, [&](auto tag) {
+            mapnik_print::renderer<typename decltype(tag)::type> r(render_map, tiles);
+            configure(r);
+            render_output(r);
+        });
+    }
+    if (show_duration)
+    {
+        std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+        std::clog << map_name << " " << spec.renderer << ": " << duration.count() << " ms" << std::endl;
+    }
+}
+
+// With device simplification, vector renderers are benchmarked both on
+// the map and on its simplified copy, the latter named <renderer>+simplify.
+static std::vector<mapnik_print::benchmark_result> benchmark(mapnik_print::shared_map const & map,
+                                                             mapnik_print::command_spec const & spec,
+                                                             std::vector<std::string> const & renderers,
+                                                             std::size_t iterations,
+                                                             mapnik_print::tile_options const & tiles,
+                                                             mapnik_print::vector_options const & vector,
+                                                             mapnik_print::png_options const & png,
+                                                             mapnik_print::device_maps * device,
+                                                             mapnik_print::trace * tracer,
+                                                             mapnik_print::render_listener * listener)
+{
+    mapnik_print::command cmd(make_command(map, spec, tracer));
+    std::vector<mapnik_print::benchmark_result> results;
+    auto run = [&](std::string const & name, mapnik_print::shared_map const & benchmark_map) {
+        return mapnik_print::dispatch_renderer(name, [&](auto tag) {
+            mapnik_print::renderer<typename decltype(tag)::type> r(benchmark_map, tiles);
+            r.set_listener(listener);
+            r.set_png_options(png);
+            r.set_vector_options(vector);
+            return mapnik_print::run_benchmark(r, cmd, iterations);
+        });
+    };
+    for (std::string const & name : renderers)
+    {
+        results.push_back(run(name, map));
+        mapnik_print::shared_map simplified(device ? device->for_renderer(name, map, cmd.dpi) : map);
+        if (simplified != map)
+        {
+            results.push_back(run(name, simplified));
+            results.back().renderer += "+simplify";
+        }
+    }
+    return results;
+}
+
 int main(int argc, char** argv)
 {
-    mapnik_print::renderer<mapnik_print::cairo_pdf_renderer> renderer;
-    /*
-    po::options_description desc("mapnik-render");
+    po::options_description desc("mapnik-print");
     desc.add_options()
         ("help,h", "produce usage message")
-        ("verbose,v", "verbose output")
         ("duration,d", "output rendering duration")
         ("iterations,i", po::value<std::size_t>()->default_value(1), "number of iterations for benchmarking")
-        ("output-dir", po::value<std::string>()->default_value("./"), "directory for output files")
-        ("styles", po::value<std::vector<std::string>>(), "selected styles to test")
+        ("batch", po::value<std::string>(), "render every page of a JSON lines or CSV manifest of command parameters, - for standard input")
+        ("batch-format", po::value<std::string>(), "manifest format (jsonl, csv), default by extension")
+        ("output-prefix", po::value<std::string>()->default_value("page-"), "prefix of numbered batch page files")
+        ("document", po::value<std::string>(), "write all batch pages into a single multi-page document (cairo-pdf, cairo-ps)")
+        ("outputs", po::value<std::string>(), "render once and write every renderer[:file] of the comma separated list (cairo, cairo-svg, cairo-ps, cairo-pdf)")
+        ("trace", po::value<std::string>(), "write a Chrome trace of the stages and layers of each job to the given file, each server worker process writing its own to <file>.<pid>")
+        ("trace-events", po::value<std::size_t>()->default_value(1000000), "most recent events kept in the trace")
+        ("benchmark", po::value<std::string>(), "benchmark the renderers given as a comma separated list (default all) and write results as json or csv")
+        ("load-test", po::value<std::string>(), "replay the pages of a JSON lines or CSV manifest at each concurrency and thread count and write throughput, latency, CPU and memory use")
+        ("load-report", po::value<std::string>()->default_value("json"), "load test report format (json, csv)")
+        ("load-server", po::value<std::string>(), "send the load test pages to the render server at the given address instead of rendering them")
+        ("load-concurrency", po::value<std::string>()->default_value("1"), "comma separated numbers of load test pages in flight")
+        ("load-threads", po::value<std::string>(), "comma separated numbers of threads per load test page, default --threads")
+        ("load-renderers", po::value<std::string>(), "renderer[:weight] list given to the load test pages in turn, default the renderer of each page")
+        ("load-repeat", po::value<std::size_t>()->default_value(1), "passes over the load test pages at each level")
         ("fonts", po::value<std::string>()->default_value("fonts"), "font search path")
         ("plugins", po::value<std::string>()->default_value("plugins/input"), "input plugins search path")
 #ifdef MAPNIK_LOG
@@ -39,35 +300,68 @@ int main(int argc, char** argv)
              [](log_levels_map::value_type const & level) { return level.second == mapnik::logger::get_severity(); } )->first),
              "log level (debug, warn, error, none)")
 #endif
-        ("scale-factor,s", po::value<std::vector<double>>()->default_value({ 1.0 }, "1.0"), "scale factor")
-        ("envelope", po::value<std::string>(), "bounding box in map coordinates")
-        ("size", po::value<std::string>(), "size of output images")
-        (agg_renderer::name, "render with AGG renderer")
-#if defined(HAVE_CAIRO)
-        (cairo_renderer::name, "render with Cairo renderer")
-#ifdef CAIRO_HAS_SVG_SURFACE
-        (cairo_svg_renderer::name, "render with Cairo SVG renderer")
-#endif
-#ifdef CAIRO_HAS_PS_SURFACE
-        (cairo_ps_renderer::name, "render with Cairo PS renderer")
-#endif
-#ifdef CAIRO_HAS_PDF_SURFACE
-        (cairo_pdf_renderer::name, "render with Cairo PDF renderer")
-#endif
-#endif
-#if defined(SVG_RENDERER)
-        (svg_renderer::name, "render with SVG renderer")
-#endif
+        ("maps", po::value<std::vector<std::string>>(), "map style files")
+        ("renderer,r", po::value<std::string>(), "renderer (agg, cairo, cairo-svg, cairo-ps, cairo-pdf), default cairo-pdf")
+        ("output,o", po::value<std::string>(), "output file, - for standard output")
+        ("srs", po::value<std::string>(), "spatial reference of the center, default map srs")
+        ("center", po::value<std::string>(), "map center x,y")
+        ("size", po::value<std::string>(), "print size width,height in meters")
+        ("scale", po::value<std::string>(), "scale denominator")
+        ("zoom", po::value<std::string>(), "zoom level the style is designed for")
+        ("dpi", po::value<std::string>(), "output resolution, default 300")
+        ("threads,t", po::value<unsigned>()->default_value(1), "threads for tiled raster rendering, 0 for one per core")
+        ("tile-size", po::value<unsigned>()->default_value(1024), "tile size for tiled raster rendering")
+        ("parallel-layers", "draw the independent layers of vector output on the rendering threads")
+        ("hybrid", "draw the layers of vector output named by the raster_layers map parameter as embedded images, instead of drawing layers in parallel")
+        ("hybrid-features", po::value<std::size_t>()->default_value(0), "with --hybrid, also draw as images the layers with more features in the view and raster layers, 0 for none")
+        ("hybrid-dpi", po::value<double>()->default_value(0), "resolution of the images of hybrid output, 0 for the dpi of the command")
+        ("memory-budget", po::value<std::size_t>()->default_value(0), "memory for raster output in MiB, including the tile images and the image pool, larger outputs being rendered in strips, 0 for no limit")
+        ("png-compression", po::value<std::string>()->default_value("default"), "PNG compression: fast, default, small or a deflate level 0-9")
+        ("png-threads", po::value<unsigned>()->default_value(0), "threads compressing PNG output, 0 for one per core")
+        ("image-pool", po::value<std::size_t>()->default_value(0), "memory in MiB of raster images kept for reuse by the next renders of the same size, 0 for none")
+        ("async-write", "write output files on a background thread while rendering goes on")
+        ("write-buffer", po::value<std::size_t>()->default_value(64), "output in MiB waiting to be written in the background beyond which rendering waits")
+        ("preallocate", po::value<std::size_t>()->default_value(0), "disk space in MiB reserved ahead of background writes, 0 for none")
+        ("durability", po::value<std::string>()->default_value("none"), "sync background writes to disk: none, data or full")
+        ("cache", po::value<std::string>(), "directory caching outputs of repeated commands")
+        ("cache-size", po::value<std::size_t>()->default_value(1024), "size limit of the output cache in MiB")
+        ("feature-cache", po::value<std::size_t>()->default_value(0), "features of recent datasource queries kept in memory for overlapping queries, 0 for none")
+        ("feature-cache-ttl", po::value<double>()->default_value(0), "seconds after which cached features are queried again, 0 for never")
+        ("feature-cache-partial", "fetch only the parts of the queries the feature cache misses, telling features apart by their id, which the datasources must keep stable across queries")
+        ("lazy-datasources", "close the datasources opened while loading the maps and open them again on their first query")
+        ("simplify", "simplify and clip the geometries of vector output to the device pixel of the dpi where the style does not")
+        ("specialize-styles", po::value<std::size_t>()->default_value(0), "most recently printed scales whose copy of the styles, without the rules inactive at the scale and with constant expressions evaluated once, is kept for the prints at that scale, 0 for none")
+        ("preview", po::value<std::string>()->implicit_value(""), "first write a quick low resolution PNG preview to the given file, default <map>.preview.png")
+        ("preview-dpi", po::value<double>()->default_value(72), "resolution of the preview")
 #if defined(GRID_RENDERER)
-        (grid_renderer::name, "render with Grid renderer")
+        ("grid", po::value<std::string>()->implicit_value(""), "also write the UTFGrid of the interactivity layer of the map, one cell per 4 output pixels, from the features of the same pass, default <map>.grid.json")
 #endif
+        ("server", po::value<std::string>(), "serve print jobs on the given Unix socket path or host:port")
+        ("server-threads", po::value<unsigned>()->default_value(0), "jobs rendered at the same time by the server, 0 for one per core")
+        ("server-workers", po::value<unsigned>()->default_value(1), "server processes sharing the loaded maps and fonts")
+        ("server-queue", po::value<std::size_t>()->default_value(64), "jobs waiting in the server queue beyond which new ones are refused")
+        ("server-sessions", po::value<std::size_t>()->default_value(0), "editing sessions whose layer images the server keeps for incremental renders, 0 for none")
+        ("server-session-memory", po::value<std::size_t>()->default_value(1024), "memory for the layer images of the editing sessions in MiB, the least recently used sessions being dropped beyond, 0 for no limit")
+        ("server-output-dir", po::value<std::string>()->default_value("."), "directory the server writes the files named by the jobs to, their paths being relative to it")
+        ("distribute", po::value<std::string>(), "render raster output in tiles of --tile-size on the servers of the comma separated list of addresses")
+        ("distribute-connections", po::value<unsigned>()->default_value(2), "tiles rendered at the same time by each server")
+        ("distribute-timeout", po::value<double>()->default_value(600), "seconds without progress after which a tile is sent to another server, 0 for never")
         ;
 
     po::positional_options_description p;
-    p.add("styles", -1);
+    p.add("maps", -1);
     po::variables_map vm;
-    po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
-    po::notify(vm);
+
+    try
+    {
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+        po::notify(vm);
+    }
+    catch (std::exception & e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 
     if (vm.count("help"))
     {
@@ -89,49 +383,366 @@ int main(int argc, char** argv)
     }
 #endif
 
-    mapnik::freetype_engine::register_fonts(vm["fonts"].as<std::string>(), true);
-    mapnik::datasource_cache::instance().register_datasources(vm["plugins"].as<std::string>());
-
-    boost::filesystem::path output_dir(vm["output-dir"].as<std::string>());
-
-    config defaults;
-    defaults.scales = vm["scale-factor"].as<std::vector<double>>();
-
-    if (vm.count("envelope"))
+    if (!vm.count("maps"))
     {
-        mapnik::box2d<double> box;
-        box.from_string(vm["envelope"].as<std::string>());
-        defaults.envelopes.push_back(box);
+        std::cerr << "Error: no input maps." << std::endl;
+        return EXIT_FAILURE;
     }
-    */
 
-    /*
-    if (vm.count("size"))
+    try
     {
-        const map_sizes_grammar<std::string::const_iterator> map_sizes_parser;
-        std::string size(vm["size"].as<std::string>());
-        parse_map_sizes(map_sizes_parser, size, defaults.sizes);
-    }
+        if (!mapnik_print::register_fonts(vm["fonts"].as<std::string>()))
+        {
+            std::clog << "Warning: No font found in " << vm["fonts"].as<std::string>() << std::endl;
+        }
+        mapnik::datasource_cache::instance().register_datasources(vm["plugins"].as<std::string>());
 
-    runner run(defaults,
-               vm["iterations"].as<std::size_t>(),
-               create_renderers(vm, output_dir));
+        mapnik_print::command_spec defaults;
+        for (std::string const & key : command_parameters)
+        {
+            if (vm.count(key))
+            {
+                mapnik_print::set_command_parameter(defaults, key, vm[key].as<std::string>());
+            }
+        }
 
-    bool show_duration = vm.count("duration");
-    report_type report(vm.count("verbose") ?
-        report_type((console_report(show_duration))) :
-        report_type((console_short_report(show_duration))));
-    result_list results;
+        mapnik_print::tile_options tiles;
+        tiles.threads = vm["threads"].as<unsigned>();
+        tiles.tile_size = vm["tile-size"].as<unsigned>();
+        tiles.memory_budget = vm["memory-budget"].as<std::size_t>() << 20;
 
-    if (!vm.count("styles"))
-    {
-        std::cerr << "Error: no input styles." << std::endl;
-        return EXIT_FAILURE;
-    }
+        mapnik_print::vector_options vector;
+        vector.parallel_layers = vm.count("parallel-layers");
+        vector.hybrid.enabled = vm.count("hybrid");
+        vector.hybrid.max_features = vm["hybrid-features"].as<std::size_t>();
+        vector.hybrid.dpi = vm["hybrid-dpi"].as<double>();
 
-    try
-    {
-        results = run.test(vm["styles"].as<std::vector<std::string>>(), report);
+        mapnik_print::png_options png(mapnik_print::parse_png_options(vm["png-compression"].as<std::string>()));
+        png.threads = vm["png-threads"].as<unsigned>();
+
+        std::unique_ptr<mapnik_print::output_cache> cache;
+        if (vm.count("cache"))
+        {
+            cache.reset(new mapnik_print::output_cache(vm["cache"].as<std::string>(),
+                                                       vm["cache-size"].as<std::size_t>() << 20));
+        }
+
+        std::unique_ptr<mapnik_print::image_pool> images;
+        if (vm["image-pool"].as<std::size_t>() > 0)
+        {
+            images.reset(new mapnik_print::image_pool(vm["image-pool"].as<std::size_t>() << 20));
+        }
+
+        boost::optional<mapnik_print::writer_options> writing;
+        if (vm.count("async-write"))
+        {
+            writing = mapnik_print::writer_options();
+            writing->max_pending = vm["write-buffer"].as<std::size_t>() << 20;
+            writing->preallocate = vm["preallocate"].as<std::size_t>() << 20;
+            writing->sync = mapnik_print::parse_durability(vm["durability"].as<std::string>());
+        }
+        // Server workers start their own writer once forked.
+        std::unique_ptr<mapnik_print::file_writer> writer;
+        if (writing && !vm.count("server"))
+        {
+            writer.reset(new mapnik_print::file_writer(*writing));
+        }
+
+        std::unique_ptr<mapnik_print::feature_cache> features;
+        if (vm["feature-cache"].as<std::size_t>() > 0)
+        {
+            mapnik_print::feature_cache_options options;
+            options.max_features = vm["feature-cache"].as<std::size_t>();
+            options.ttl = vm["feature-cache-ttl"].as<double>();
+            options.partial = vm.count("feature-cache-partial");
+            features.reset(new mapnik_print::feature_cache(options));
+        }
+
+        std::unique_ptr<mapnik_print::device_maps> device;
+        if (vm.count("simplify"))
+        {
+            device.reset(new mapnik_print::device_maps());
+        }
+
+        std::unique_ptr<mapnik_print::scale_maps> scales;
+        if (vm["specialize-styles"].as<std::size_t>() > 0)
+        {
+            scales.reset(new mapnik_print::scale_maps(vm["specialize-styles"].as<std::size_t>()));
+        }
+
+        boost::optional<mapnik_print::progressive_options> progressive;
+        if (vm.count("preview"))
+        {
+            progressive = mapnik_print::progressive_options();
+            progressive->preview_path = vm["preview"].as<std::string>();
+            progressive->preview_dpi = vm["preview-dpi"].as<double>();
+        }
+
+        boost::optional<std::string> grid;
+        if (vm.count("grid"))
+        {
+            if (progressive)
+            {
+                std::cerr << "Error: --grid cannot be combined with --preview" << std::endl;
+                return EXIT_FAILURE;
+            }
+            grid = vm["grid"].as<std::string>();
+        }
+
+        std::unique_ptr<mapnik_print::trace> tracer;
+        std::unique_ptr<mapnik_print::trace_listener> listener;
+        if (vm.count("trace"))
+        {
+            tracer.reset(new mapnik_print::trace(vm["trace-events"].as<std::size_t>()));
+            listener.reset(new mapnik_print::trace_listener(*tracer));
+        }
+        trace_writer write_trace{ tracer.get(), vm.count("trace") ? vm["trace"].as<std::string>() : "" };
+
+        std::map<std::string, mapnik_print::shared_map> maps(
+            load_maps(vm["maps"].as<std::vector<std::string>>(), features.get(), vm.count("lazy-datasources"),
+                      tracer.get()));
+
+        if (vm.count("server"))
+        {
+            mapnik_print::server_options options;
+            options.socket_path = vm["server"].as<std::string>();
+            options.threads = vm["server-threads"].as<unsigned>();
+            options.workers = vm["server-workers"].as<unsigned>();
+            options.max_queued = vm["server-queue"].as<std::size_t>();
+            options.output_directory = vm["server-output-dir"].as<std::string>();
+            options.tiles = tiles;
+            options.vector = vector;
+            options.png = png;
+            options.cache = cache.get();
+            options.writer = writing;
+            options.images = images.get();
+            options.features = features.get();
+            options.device = device.get();
+            options.scales = scales.get();
+            options.progressive.preview_dpi = vm["preview-dpi"].as<double>();
+            options.listener = listener.get();
+            options.tracer = tracer.get();
+            options.trace_path = vm.count("trace") ? vm["trace"].as<std::string>() : "";
+            std::unique_ptr<mapnik_print::session_cache> sessions;
+            if (vm["server-sessions"].as<std::size_t>() > 0)
+            {
+                mapnik_print::session_options session_options;
+                session_options.max_sessions = vm["server-sessions"].as<std::size_t>();
+                session_options.max_bytes = vm["server-session-memory"].as<std::size_t>() << 20;
+                sessions.reset(new mapnik_print::session_cache(session_options));
+            }
+            options.sessions = sessions.get();
+            mapnik_print::render_server server(maps, defaults, options);
+            server.run();
+            return EXIT_SUCCESS;
+        }
+
+        if (vm.count("batch"))
+        {
+            std::string manifest_path(vm["batch"].as<std::string>());
+            std::ifstream manifest_file;
+            if (manifest_path != "-")
+            {
+                manifest_file.open(manifest_path);
+                if (!manifest_file)
+                {
+                    std::cerr << "Error: Cannot open manifest: " << manifest_path << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+            mapnik_print::manifest_reader manifest(manifest_path == "-" ? std::cin : manifest_file,
+                                                   manifest_format_of(vm, manifest_path), defaults);
+
+            mapnik_print::batch_options options;
+            options.output_prefix = vm["output-prefix"].as<std::string>();
+            options.document = vm.count("document") ? vm["document"].as<std::string>() : "";
+            options.tiles = tiles;
+            options.vector = vector;
+            options.png = png;
+            options.cache = cache.get();
+            options.writer = writer.get();
+            options.images = images.get();
+            options.listener = listener.get();
+            options.device = device.get();
+            options.scales = scales.get();
+            std::ostream & progress = options.document == "-" ? std::clog : std::cout;
+
+            mapnik_print::dispatch_renderer(defaults.renderer, [&](auto tag) {
+                return mapnik_print::run_batch<typename decltype(tag)::type>(maps, manifest, options, progress);
+            });
+            return EXIT_SUCCESS;
+        }
+
+        if (vm.count("load-test"))
+        {
+            std::string manifest_path(vm["load-test"].as<std::string>());
+            std::string format(vm["load-report"].as<std::string>());
+            if (format != "json" && format != "csv")
+            {
+                std::cerr << "Error: Unknown load test report format: " << format << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::ifstream manifest_file(manifest_path);
+            if (!manifest_file)
+            {
+                std::cerr << "Error: Cannot open manifest: " << manifest_path << std::endl;
+                return EXIT_FAILURE;
+            }
+            mapnik_print::manifest_reader manifest(manifest_file, manifest_format_of(vm, manifest_path), defaults);
+            std::vector<mapnik_print::command_spec> pages;
+            mapnik_print::command_spec spec;
+            while (manifest.next(spec))
+            {
+                pages.push_back(spec);
+            }
+
+            mapnik_print::load_test_options options;
+            options.server = vm.count("load-server") ? vm["load-server"].as<std::string>() : "";
+            options.concurrency = parse_counts(vm["load-concurrency"].as<std::string>());
+            if (vm.count("load-threads"))
+            {
+                options.threads = parse_counts(vm["load-threads"].as<std::string>());
+            }
+            if (vm.count("load-renderers"))
+            {
+                options.renderers = mapnik_print::parse_renderer_mix(vm["load-renderers"].as<std::string>());
+            }
+            options.repeat = vm["load-repeat"].as<std::size_t>();
+            options.tiles = tiles;
+            options.vector = vector;
+            options.png = png;
+            options.device = device.get();
+            options.scales = scales.get();
+
+            std::vector<mapnik_print::load_test_result> results(
+                mapnik_print::load_test(maps, pages, options).run());
+            if (format == "json")
+            {
+                mapnik_print::write_json(std::cout, results);
+            }
+            else
+            {
+                mapnik_print::write_csv(std::cout, results);
+            }
+            return EXIT_SUCCESS;
+        }
+
+        if (vm.count("benchmark"))
+        {
+            std::string format(vm["benchmark"].as<std::string>());
+            if (format != "json" && format != "csv")
+            {
+                std::cerr << "Error: Unknown benchmark format: " << format << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::vector<std::string> renderers(vm.count("renderer") ?
+                split(vm["renderer"].as<std::string>()) : mapnik_print::renderer_names());
+            std::vector<mapnik_print::benchmark_result> results;
+            for (auto const & map : maps)
+            {
+                for (auto & result : benchmark(map.second, defaults, renderers,
+                                               vm["iterations"].as<std::size_t>(), tiles, vector, png,
+                                               device.get(), tracer.get(), listener.get()))
+                {
+                    result.renderer = map.first + ":" + result.renderer;
+                    results.push_back(std::move(result));
+                }
+            }
+            if (format == "json")
+            {
+                mapnik_print::write_json(std::cout, results);
+            }
+            else
+            {
+                mapnik_print::write_csv(std::cout, results);
+            }
+            return EXIT_SUCCESS;
+        }
+
+        if (vm.count("outputs"))
+        {
+            for (char const * option : { "threads", "simplify", "cache" })
+            {
+                if (vm.count(option) && !vm[option].defaulted())
+                {
+                    std::cerr << "Error: --outputs cannot be combined with --" << option << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+            for (auto const & map : maps)
+            {
+                std::vector<mapnik_print::output_target> targets;
+                for (std::string const & target : split(vm["outputs"].as<std::string>()))
+                {
+                    targets.push_back(mapnik_print::parse_output_target(target, map.first));
+                }
+                mapnik_print::command cmd(make_command(map.second, defaults, tracer.get()));
+                mapnik_print::shared_map render_map(scales ? scales->get(map.second, cmd) : map.second);
+                auto start = std::chrono::steady_clock::now();
+                mapnik_print::render_outputs(render_map, cmd, targets, listener.get(), png);
+                if (vm.count("duration"))
+                {
+                    std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+                    std::clog << map.first << " " << vm["outputs"].as<std::string>() << ": "
+                              << duration.count() << " ms" << std::endl;
+                }
+            }
+            return EXIT_SUCCESS;
+        }
+
+        if (vm.count("distribute"))
+        {
+            mapnik_print::distributed_options options;
+            options.workers = split(vm["distribute"].as<std::string>());
+            options.connections = vm["distribute-connections"].as<unsigned>();
+            options.timeout = vm["distribute-timeout"].as<double>();
+            options.tile_size = tiles.tile_size;
+            options.overlap = tiles.overlap;
+            for (auto const & map : maps)
+            {
+                mapnik_print::command_spec spec(defaults);
+                spec.map = map.first;
+                std::string output(spec.output.empty() ? map.first + ".png" : spec.output);
+                auto start = std::chrono::steady_clock::now();
+                mapnik_print::output_stream stream(output);
+                mapnik_print::dispatch_renderer(spec.renderer, [&](auto tag) {
+                    using renderer_type = typename decltype(tag)::type;
+                    if constexpr (renderer_type::support_tiles)
+                    {
+                        mapnik_print::render_distributed<renderer_type>(map.second, spec, stream, options,
+                                                                        png, listener.get());
+                    }
+                    else
+                    {
+                        throw std::runtime_error("Renderer does not support tiles: " + spec.renderer);
+                    }
+                });
+                if (!stream.flush())
+                {
+                    throw std::runtime_error("Cannot write output: " + output);
+                }
+                if (vm.count("duration"))
+                {
+                    std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+                    std::clog << map.first << " distributed: " << duration.count() << " ms" << std::endl;
+                }
+            }
+            return EXIT_SUCCESS;
+        }
+
+        for (auto const & map : maps)
+        {
+            for (std::size_t i = 0; i < vm["iterations"].as<std::size_t>(); i++)
+            {
+                render(map.second, map.first, defaults, tiles, vector, png, cache.get(), writer.get(), images.get(),
+                       progressive, grid, device.get(), scales.get(), vm.count("duration"), tracer.get(),
+                       listener.get());
+            }
+        }
+        if (writer)
+        {
+            writer->wait();
+        }
     }
     catch (std::exception & e)
     {
@@ -139,8 +750,5 @@ int main(int argc, char** argv)
         return EXIT_FAILURE;
     }
 
-    unsigned failed_count = mapnik::util::apply_visitor(summary_visitor(results), report);
-
-    return failed_count;
-    */
+    return EXIT_SUCCESS;
 }
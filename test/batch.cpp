@@ -0,0 +1,133 @@
+// Reads JSON lines and CSV manifests, their quoting, skipped lines and
+// the line numbers of their errors.
+
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../lib/batch.hpp"
+
+using namespace mapnik_print;
+
+namespace
+{
+
+bool check(std::string const & name, bool condition)
+{
+    if (!condition)
+    {
+        std::cerr << "FAIL " << name << std::endl;
+    }
+    return condition;
+}
+
+// Whether the function throws an error whose message contains the text.
+bool check_throws(std::string const & name, std::string const & text, std::function<void()> function)
+{
+    try
+    {
+        function();
+    }
+    catch (std::runtime_error const & e)
+    {
+        if (std::string(e.what()).find(text) != std::string::npos)
+        {
+            return true;
+        }
+        std::cerr << "FAIL " << name << ": " << e.what() << std::endl;
+        return false;
+    }
+    std::cerr << "FAIL " << name << ": no error" << std::endl;
+    return false;
+}
+
+std::vector<command_spec> read_manifest(std::string const & text, manifest_format format,
+                                        command_spec const & defaults = command_spec())
+{
+    std::istringstream input(text);
+    manifest_reader manifest(input, format, defaults);
+    std::vector<command_spec> specs;
+    command_spec spec;
+    while (manifest.next(spec))
+    {
+        specs.push_back(spec);
+    }
+    return specs;
+}
+
+}
+
+int main()
+{
+    bool ok = true;
+
+    ok &= check("csv fields", parse_csv_line("a,b,,c") == std::vector<std::string>{ "a", "b", "", "c" });
+    ok &= check("csv quoted comma", parse_csv_line("\"1,2\",x") == std::vector<std::string>{ "1,2", "x" });
+    ok &= check("csv doubled quote",
+                parse_csv_line("\"say \"\"hi\"\"\"") == std::vector<std::string>{ "say \"hi\"" });
+    ok &= check("csv carriage return", parse_csv_line("a,b\r") == std::vector<std::string>{ "a", "b" });
+    ok &= check("csv empty", parse_csv_line("") == std::vector<std::string>{ "" });
+
+    command_spec spec;
+    parse_json_spec("{ \"map\": \"a \\\"b\\\"\", \"center\": [1823000, 6140000], \"size\":[0.42,0.297],"
+                    "\"scale\": 25000, \"zoom\": \"15\" }", spec);
+    ok &= check("json string", spec.map == "a \"b\"");
+    ok &= check("json pair", spec.center && spec.center->x == 1823000 && spec.center->y == 6140000);
+    ok &= check("json compact pair", spec.size && spec.size->width == 0.42 && spec.size->height == 0.297);
+    ok &= check("json number", spec.scale_denom && *spec.scale_denom == 25000);
+    ok &= check("json quoted number", spec.zoom && *spec.zoom == 15);
+
+    command_spec empty;
+    parse_json_spec(" {  } ", empty);
+    ok &= check("json empty object", empty.map.empty() && !empty.center);
+    for (std::string line : { "", "[1]", "{\"map\" \"a\"}", "{\"map\": \"a\"", "{\"center\": [1]}", "{map: 1}" })
+    {
+        ok &= check_throws("json invalid " + line, "Invalid manifest line",
+                           [&] { command_spec s; parse_json_spec(line, s); });
+    }
+    ok &= check_throws("json unknown parameter", "Unknown command parameter",
+                       [] { command_spec s; parse_json_spec("{\"colour\": 1}", s); });
+
+    command_spec defaults;
+    defaults.map = "default";
+    defaults.dpi = 150;
+    std::vector<command_spec> json(read_manifest(
+        "# pages\n"
+        "{\"zoom\": 3}\n"
+        "\n"
+        "   \t\n"
+        "{\"map\": \"other\", \"output\": \"b.pdf\"}\n", manifest_format::json_lines, defaults));
+    ok &= check("json lines pages", json.size() == 2);
+    ok &= check("json lines defaults", json.size() == 2 && json[0].map == "default" && json[0].dpi == 150 &&
+                                       json[0].zoom && *json[0].zoom == 3);
+    ok &= check("json lines reset", json.size() == 2 && json[1].map == "other" && !json[1].zoom &&
+                                    json[1].output == "b.pdf");
+
+    std::vector<command_spec> csv(read_manifest(
+        "map,center,zoom,output\r\n"
+        "# comment\n"
+        "a,\"10,20\",4,a.png\n"
+        ",\"30,40\",,\n", manifest_format::csv, defaults));
+    ok &= check("csv pages", csv.size() == 2);
+    ok &= check("csv fields", csv.size() == 2 && csv[0].map == "a" && csv[0].center && csv[0].center->x == 10 &&
+                              csv[0].center->y == 20 && *csv[0].zoom == 4 && csv[0].output == "a.png");
+    ok &= check("csv empty fields", csv.size() == 2 && csv[1].map == "default" && csv[1].center->x == 30 &&
+                                    !csv[1].zoom && csv[1].output.empty());
+    ok &= check("csv header only", read_manifest("map,zoom\n", manifest_format::csv).empty());
+
+    ok &= check_throws("error line number", "Manifest line 3:", [] {
+        read_manifest("{\"zoom\": 1}\n\n{\"zoom\": -1}\n", manifest_format::json_lines);
+    });
+    ok &= check_throws("csv error line number", "Manifest line 2:", [] {
+        read_manifest("zoom\nx\n", manifest_format::csv);
+    });
+
+    if (ok)
+    {
+        std::cout << "batch: OK" << std::endl;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+// Parses command parameters, quoted values and invalid values, and reads
+// back the parameters format_command_spec writes.
+
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../lib/command_spec.hpp"
+
+using namespace mapnik_print;
+
+namespace
+{
+
+bool check(std::string const & name, bool condition)
+{
+    if (!condition)
+    {
+        std::cerr << "FAIL " << name << std::endl;
+    }
+    return condition;
+}
+
+bool check_throws(std::string const & name, std::function<void()> function)
+{
+    try
+    {
+        function();
+    }
+    catch (std::runtime_error const &)
+    {
+        return true;
+    }
+    std::cerr << "FAIL " << name << ": no error" << std::endl;
+    return false;
+}
+
+bool same_spec(command_spec const & a, command_spec const & b)
+{
+    return a.map == b.map && a.renderer == b.renderer && a.srs == b.srs &&
+           bool(a.center) == bool(b.center) &&
+           (!a.center || (a.center->x == b.center->x && a.center->y == b.center->y)) &&
+           bool(a.size) == bool(b.size) &&
+           (!a.size || (a.size->width == b.size->width && a.size->height == b.size->height)) &&
+           a.scale_denom == b.scale_denom && a.zoom == b.zoom && a.dpi == b.dpi;
+}
+
+}
+
+int main()
+{
+    bool ok = true;
+
+    ok &= check("split", split_parameters("  a=1\tb=2  ") == std::vector<std::string>{ "a=1", "b=2" });
+    ok &= check("split empty", split_parameters(" \t ").empty());
+    ok &= check("split quoted", split_parameters("srs=\"+proj=merc +units=m\" zoom=3") ==
+                                std::vector<std::string>{ "srs=+proj=merc +units=m", "zoom=3" });
+    ok &= check("split escaped", split_parameters("map=a\\ b\\\"c") == std::vector<std::string>{ "map=a b\"c" });
+    ok &= check("split empty quotes", split_parameters("output=\"\"") == std::vector<std::string>{ "output=" });
+    ok &= check_throws("split unterminated quote", [] { split_parameters("srs=\"+proj=merc"); });
+
+    for (std::string value : { "plain", "with space", "tab\there", "quote\"inside", "back\\slash", "" })
+    {
+        std::vector<std::string> tokens(split_parameters(quote_parameter(value)));
+        ok &= check("quote " + value, value.empty() ? tokens.empty() : tokens == std::vector<std::string>{ value });
+    }
+    ok &= check("quote plain unchanged", quote_parameter("map=a.xml") == "map=a.xml");
+
+    command_spec defaults;
+    defaults.map = "default";
+    command_spec spec(parse_command_spec(
+        "map=\"My Map\" renderer=agg srs=\"+proj=merc +units=m\" center=1823000,6140000 size=0.42,0.297 "
+        "scale=25000 zoom=15 dpi=150 output=out.png", defaults));
+    ok &= check("parse map", spec.map == "My Map");
+    ok &= check("parse renderer", spec.renderer == "agg");
+    ok &= check("parse srs", spec.srs == "+proj=merc +units=m");
+    ok &= check("parse center", spec.center && spec.center->x == 1823000 && spec.center->y == 6140000);
+    ok &= check("parse size", spec.size && spec.size->width == 0.42 && spec.size->height == 0.297);
+    ok &= check("parse scale", spec.scale_denom && *spec.scale_denom == 25000);
+    ok &= check("parse zoom", spec.zoom && *spec.zoom == 15);
+    ok &= check("parse dpi", spec.dpi == 150);
+    ok &= check("parse output", spec.output == "out.png");
+    ok &= check("parse defaults", parse_command_spec("zoom=2", defaults).map == "default");
+
+    command_spec formatted(parse_command_spec(format_command_spec(spec), command_spec()));
+    spec.output.clear();
+    ok &= check("format round trip", same_spec(formatted, spec));
+
+    for (std::string line : { "size=0,0.297", "size=0.42,-1", "size=0.42", "size=nan,1", "scale=0", "scale=-5",
+                              "scale=inf", "scale=1e400", "zoom=31", "zoom=-1", "zoom=1.5", "zoom=x",
+                              "center=inf,0", "center=0,nan", "center=1", "dpi=0", "dpi=", "unknown=1",
+                              "zoom", "=1" })
+    {
+        ok &= check_throws("invalid " + line, [&] { parse_command_spec(line, defaults); });
+    }
+    ok &= check("zoom bounds", *parse_command_spec("zoom=0", defaults).zoom == 0 &&
+                               *parse_command_spec("zoom=30", defaults).zoom == 30);
+
+    if (ok)
+    {
+        std::cout << "command_spec: OK" << std::endl;
+    }
+    return ok ? 0 : 1;
+}
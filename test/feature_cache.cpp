@@ -0,0 +1,229 @@
+// Subtracts boxes and serves queries from cached features, whole or
+// merged from several queries, counting the queries reaching the
+// datasource.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <mapnik/datasource.hpp>
+#include <mapnik/feature.hpp>
+#include <mapnik/feature_factory.hpp>
+#include <mapnik/geometry.hpp>
+#include <mapnik/query.hpp>
+
+#include "../lib/feature_cache.hpp"
+
+using namespace mapnik_print;
+
+namespace
+{
+
+// Points of ids 1 to 10 at x from 0 to 9 on the y = 0 line, keeping the
+// boxes of its queries.
+class point_datasource : public mapnik::datasource
+{
+    std::vector<mapnik::feature_ptr> points;
+
+public:
+    mutable std::vector<mapnik::box2d<double>> queries;
+
+    point_datasource()
+        : mapnik::datasource(mapnik::parameters())
+    {
+        mapnik::context_ptr ctx(std::make_shared<mapnik::context_type>());
+        for (int x = 0; x < 10; x++)
+        {
+            mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx, x + 1));
+            feature->set_geometry(mapnik::geometry::point<double>(x, 0));
+            points.push_back(feature);
+        }
+    }
+
+    datasource_t type() const override
+    {
+        return Vector;
+    }
+
+    mapnik::featureset_ptr features(mapnik::query const & q) const override
+    {
+        queries.push_back(q.get_bbox());
+        auto found = std::make_shared<std::vector<mapnik::feature_ptr>>();
+        for (mapnik::feature_ptr const & feature : points)
+        {
+            if (q.get_bbox().intersects(feature->envelope()))
+            {
+                found->push_back(feature);
+            }
+        }
+        return std::make_shared<feature_list_featureset>(found);
+    }
+
+    mapnik::featureset_ptr features_at_point(mapnik::coord2d const &, double) const override
+    {
+        return mapnik::featureset_ptr();
+    }
+
+    mapnik::box2d<double> envelope() const override
+    {
+        return mapnik::box2d<double>(0, 0, 9, 0);
+    }
+
+    boost::optional<mapnik::datasource_geometry_t> get_geometry_type() const override
+    {
+        return boost::optional<mapnik::datasource_geometry_t>();
+    }
+
+    mapnik::layer_descriptor get_descriptor() const override
+    {
+        return mapnik::layer_descriptor("points", "utf-8");
+    }
+};
+
+mapnik::query make_query(double minx, double maxx, double scale_denom = 25000)
+{
+    return mapnik::query(mapnik::box2d<double>(minx, -1, maxx, 1), mapnik::query::resolution_type(1, 1),
+                         scale_denom);
+}
+
+std::vector<mapnik::value_integer> ids(mapnik::featureset_ptr const & features)
+{
+    std::vector<mapnik::value_integer> result;
+    while (mapnik::feature_ptr feature = features->next())
+    {
+        result.push_back(feature->id());
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+std::vector<mapnik::value_integer> range(mapnik::value_integer first, mapnik::value_integer last)
+{
+    std::vector<mapnik::value_integer> result;
+    for (mapnik::value_integer id = first; id <= last; id++)
+    {
+        result.push_back(id);
+    }
+    return result;
+}
+
+double area(mapnik::box2d<double> const & box)
+{
+    return box.width() * box.height();
+}
+
+double overlap(mapnik::box2d<double> const & a, mapnik::box2d<double> const & b)
+{
+    return a.intersects(b) ? area(a.intersect(b)) : 0;
+}
+
+bool check(std::string const & name, bool condition)
+{
+    if (!condition)
+    {
+        std::cerr << "FAIL " << name << std::endl;
+    }
+    return condition;
+}
+
+// The pieces cover the box outside of the hole without overlapping.
+bool check_subtract(std::string const & name, mapnik::box2d<double> const & box,
+                    mapnik::box2d<double> const & hole, std::size_t expected_pieces)
+{
+    std::vector<mapnik::box2d<double>> pieces(subtract(box, hole));
+    double total = 0;
+    bool inside = true;
+    for (std::size_t i = 0; i < pieces.size(); i++)
+    {
+        total += area(pieces[i]);
+        inside &= box.contains(pieces[i]) && overlap(pieces[i], hole) == 0;
+        for (std::size_t j = i + 1; j < pieces.size(); j++)
+        {
+            inside &= overlap(pieces[i], pieces[j]) == 0;
+        }
+    }
+    return check(name, pieces.size() == expected_pieces && inside &&
+                       std::abs(total - (area(box) - overlap(box, hole))) < 1e-9);
+}
+
+}
+
+int main()
+{
+    bool ok = true;
+
+    mapnik::box2d<double> box(0, 0, 10, 10);
+    ok &= check_subtract("subtract disjoint", box, mapnik::box2d<double>(20, 20, 30, 30), 1);
+    ok &= check_subtract("subtract inside", box, mapnik::box2d<double>(2, 3, 5, 7), 4);
+    ok &= check_subtract("subtract covering", box, mapnik::box2d<double>(-1, -1, 11, 11), 0);
+    ok &= check_subtract("subtract side", box, mapnik::box2d<double>(5, -1, 11, 11), 1);
+    ok &= check_subtract("subtract corner", box, mapnik::box2d<double>(5, 5, 15, 15), 2);
+    ok &= check_subtract("subtract band", box, mapnik::box2d<double>(-1, 4, 11, 6), 2);
+
+    {
+        // Without partial queries, only a query covered by a cached one is
+        // served from the cache.
+        feature_cache_options options;
+        options.max_features = 100;
+        feature_cache cache(options);
+        auto points = std::make_shared<point_datasource>();
+        cached_datasource cached(points, cache, "points");
+
+        ok &= check("whole first", ids(cached.features(make_query(-0.5, 4.5))) == range(1, 5));
+        ok &= check("whole covered", ids(cached.features(make_query(0.5, 3.5))) == range(2, 4));
+        ok &= check("whole covered queries", points->queries.size() == 1);
+        ok &= check("whole overlapping", ids(cached.features(make_query(3.5, 9.5))) == range(5, 10));
+        ok &= check("whole overlapping queries", points->queries.size() == 2 &&
+                                                 points->queries.back() == mapnik::box2d<double>(3.5, -1, 9.5, 1));
+        ok &= check("other scale", ids(cached.features(make_query(0.5, 3.5, 50000))) == range(2, 4));
+        ok &= check("other scale queries", points->queries.size() == 3);
+    }
+
+    {
+        // Partial queries fetch only the missing area and features are
+        // merged once each.
+        feature_cache_options options;
+        options.max_features = 100;
+        options.partial = true;
+        feature_cache cache(options);
+        auto points = std::make_shared<point_datasource>();
+        cached_datasource cached(points, cache, "points");
+
+        ok &= check("partial first", ids(cached.features(make_query(-0.5, 4.5))) == range(1, 5));
+        ok &= check("partial overlapping", ids(cached.features(make_query(2.5, 9.5))) == range(4, 10));
+        ok &= check("partial missing piece", points->queries.size() == 2 &&
+                                             points->queries.back() == mapnik::box2d<double>(4.5, -1, 9.5, 1));
+        ok &= check("partial merged", ids(cached.features(make_query(0, 9))) == range(1, 10));
+        ok &= check("partial merged queries", points->queries.size() == 2);
+        ok &= check("partial size", cache.size() == 10);
+    }
+
+    {
+        // Queries of more features than the cache holds are not kept.
+        feature_cache_options options;
+        options.max_features = 3;
+        feature_cache cache(options);
+        auto points = std::make_shared<point_datasource>();
+        cached_datasource cached(points, cache, "points");
+
+        ok &= check("too large", ids(cached.features(make_query(-0.5, 4.5))) == range(1, 5));
+        ok &= check("too large again", ids(cached.features(make_query(-0.5, 4.5))) == range(1, 5));
+        ok &= check("too large queries", points->queries.size() == 2 && cache.size() == 0);
+        cached.features(make_query(-0.5, 1.5));
+        cached.features(make_query(2.5, 4.5));
+        ok &= check("evicted", cache.size() == 2);
+        ok &= check("evicted served", ids(cached.features(make_query(2.5, 4.5))) == range(4, 5) &&
+                                      points->queries.size() == 4);
+        ok &= check("evicted queried", ids(cached.features(make_query(-0.5, 1.5))) == range(1, 2) &&
+                                       points->queries.size() == 5);
+    }
+
+    if (ok)
+    {
+        std::cout << "feature_cache: OK" << std::endl;
+    }
+    return ok ? 0 : 1;
+}
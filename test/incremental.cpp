@@ -0,0 +1,114 @@
+// Finds the pixel offsets of panned views, moves images by them and
+// lists the areas they expose.
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <mapnik/box2d.hpp>
+#include <mapnik/image.hpp>
+
+#include "../lib/incremental.hpp"
+
+using namespace mapnik_print;
+
+namespace
+{
+
+bool check(std::string const & name, bool condition)
+{
+    if (!condition)
+    {
+        std::cerr << "FAIL " << name << std::endl;
+    }
+    return condition;
+}
+
+// Whether the offset is found, as expected, for the view panned from the
+// kept one of 100 x 80 pixels of 10 units.
+bool check_offset(std::string const & name, mapnik::box2d<double> const & extent, bool found,
+                  long ox = 0, long oy = 0)
+{
+    mapnik::box2d<double> kept(1000, 2000, 2000, 2800);
+    long x = 0, y = 0;
+    bool result = pan_offset(kept, extent, 100, 80, x, y);
+    return check(name, result == found && (!found || (x == ox && y == oy)));
+}
+
+// Pixel value telling the position of the pixel.
+std::uint32_t pixel_at(unsigned x, unsigned y)
+{
+    return 0xff000000u | (y << 12) | x;
+}
+
+// The moved image holds the source pixels within the source, the others
+// cleared, and the exposed tiles cover exactly the cleared pixels.
+bool check_pan(std::string const & name, long ox, long oy)
+{
+    unsigned width = 40, height = 30;
+    mapnik::image_rgba8 source(width, height);
+    for (unsigned y = 0; y < height; y++)
+    {
+        for (unsigned x = 0; x < width; x++)
+        {
+            source.get_row(y)[x] = pixel_at(x, y);
+        }
+    }
+    mapnik::image_rgba8 image(pan_image(source, ox, oy));
+    std::vector<unsigned> exposed(std::size_t(width) * height, 0);
+    for (tile const & t : exposed_tiles(width, height, ox, oy))
+    {
+        for (unsigned y = t.y; y < t.y + t.height; y++)
+        {
+            for (unsigned x = t.x; x < t.x + t.width; x++)
+            {
+                exposed[std::size_t(y) * width + x]++;
+            }
+        }
+    }
+    bool moved = image.width() == width && image.height() == height;
+    for (unsigned y = 0; y < height && moved; y++)
+    {
+        for (unsigned x = 0; x < width; x++)
+        {
+            long sx = long(x) + ox;
+            long sy = long(y) + oy;
+            bool inside = sx >= 0 && sx < long(width) && sy >= 0 && sy < long(height);
+            std::uint32_t expected = inside ? pixel_at(unsigned(sx), unsigned(sy)) : 0;
+            moved &= image.get_row(y)[x] == expected && exposed[std::size_t(y) * width + x] == (inside ? 0u : 1u);
+        }
+    }
+    return check(name, moved);
+}
+
+}
+
+int main()
+{
+    bool ok = true;
+
+    ok &= check_offset("same view", mapnik::box2d<double>(1000, 2000, 2000, 2800), true, 0, 0);
+    ok &= check_offset("panned", mapnik::box2d<double>(1370, 1790, 2370, 2590), true, 37, 21);
+    ok &= check_offset("panned back", mapnik::box2d<double>(900, 2050, 1900, 2850), true, -10, -5);
+    ok &= check_offset("almost whole pixels", mapnik::box2d<double>(1370.001, 1790, 2370.001, 2590), true, 37, 21);
+    ok &= check_offset("part of a pixel", mapnik::box2d<double>(1375, 1790, 2375, 2590), false);
+    ok &= check_offset("other scale", mapnik::box2d<double>(1000, 2000, 2100, 2880), false);
+    ok &= check_offset("beyond the view", mapnik::box2d<double>(2000, 2000, 3000, 2800), false);
+    ok &= check_offset("beyond the view height", mapnik::box2d<double>(1000, 1200, 2000, 2000), false);
+
+    ok &= check_pan("not moved", 0, 0);
+    ok &= check_pan("moved right down", 7, 5);
+    ok &= check_pan("moved left up", -7, -5);
+    ok &= check_pan("moved sideways", 12, 0);
+    ok &= check_pan("moved across", 0, -29);
+    ok &= check_pan("moved mixed", -39, 3);
+    ok &= check("nothing exposed", exposed_tiles(40, 30, 0, 0).empty());
+    ok &= check("rows and columns", exposed_tiles(40, 30, 7, 5).size() == 2);
+
+    if (ok)
+    {
+        std::cout << "incremental: OK" << std::endl;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+// Encodes images one after the other on the same thread and checks that
+// each decodes to its own pixels, whatever the thread encoded before.
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+#include <zlib.h>
+
+#include <mapnik/image.hpp>
+
+#include "../lib/png_writer.hpp"
+
+using namespace mapnik_print;
+
+namespace
+{
+
+std::uint32_t get_uint32(std::string const & data, std::size_t offset)
+{
+    return std::uint32_t(std::uint8_t(data[offset])) << 24 | std::uint32_t(std::uint8_t(data[offset + 1])) << 16 |
+           std::uint32_t(std::uint8_t(data[offset + 2])) << 8 | std::uint32_t(std::uint8_t(data[offset + 3]));
+}
+
+// Pixels of an 8 bit RGBA PNG, rows of straight alpha one after the other.
+std::vector<std::uint8_t> decode_png(std::string const & png, unsigned & width, unsigned & height)
+{
+    std::string compressed;
+    for (std::size_t offset = 8; offset + 12 <= png.size();)
+    {
+        std::size_t length = get_uint32(png, offset);
+        std::string type(png, offset + 4, 4);
+        if (type == "IHDR")
+        {
+            width = get_uint32(png, offset + 8);
+            height = get_uint32(png, offset + 12);
+        }
+        else if (type == "IDAT")
+        {
+            compressed.append(png, offset + 8, length);
+        }
+        offset += length + 12;
+    }
+
+    std::size_t row_size = std::size_t(width) * 4;
+    std::vector<std::uint8_t> filtered(height * (row_size + 1));
+    uLongf filtered_size = filtered.size();
+    if (uncompress(filtered.data(), &filtered_size, reinterpret_cast<Bytef const *>(compressed.data()),
+                   compressed.size()) != Z_OK || filtered_size != filtered.size())
+    {
+        throw std::runtime_error("Cannot decompress PNG");
+    }
+
+    std::vector<std::uint8_t> pixels(height * row_size);
+    std::vector<std::uint8_t> zero(row_size);
+    for (unsigned y = 0; y < height; y++)
+    {
+        std::uint8_t const * in = &filtered[y * (row_size + 1)];
+        std::uint8_t * row = &pixels[y * row_size];
+        std::uint8_t const * prev = y > 0 ? row - row_size : zero.data();
+        for (std::size_t i = 0; i < row_size; i++)
+        {
+            int a = i >= 4 ? row[i - 4] : 0;
+            int b = prev[i];
+            int c = i >= 4 ? prev[i - 4] : 0;
+            int predictor = 0;
+            switch (in[0])
+            {
+                case 0: predictor = 0; break;
+                case 1: predictor = a; break;
+                case 2: predictor = b; break;
+                case 3: predictor = (a + b) >> 1; break;
+                case 4:
+                {
+                    int pa = std::abs(b - c);
+                    int pb = std::abs(a - c);
+                    int pc = std::abs(a + b - 2 * c);
+                    predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                    break;
+                }
+                default:
+                    throw std::runtime_error("Invalid PNG filter");
+            }
+            row[i] = static_cast<std::uint8_t>(in[i + 1] + predictor);
+        }
+    }
+    return pixels;
+}
+
+mapnik::image_rgba8 make_image(unsigned width, unsigned height, unsigned seed)
+{
+    mapnik::image_rgba8 image(width, height);
+    std::uint8_t * bytes = image.bytes();
+    for (std::size_t i = 0; i < image.size(); i++)
+    {
+        bytes[i] = static_cast<std::uint8_t>((i * 7 + seed) * (seed | 1) >> 3);
+    }
+    return image;
+}
+
+bool check(std::string const & name, mapnik::image_rgba8 const & image, png_options const & options)
+{
+    std::ostringstream out;
+    write_png(image, out, options);
+    unsigned width = 0, height = 0;
+    std::vector<std::uint8_t> pixels(decode_png(out.str(), width, height));
+    std::uint8_t const * bytes = image.bytes();
+    if (width != image.width() || height != image.height() ||
+        !std::equal(pixels.begin(), pixels.end(), bytes, bytes + image.size()))
+    {
+        std::cerr << "FAIL " << name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}
+
+int main()
+{
+    bool ok = true;
+    for (png_filter filter : { png_filter::none, png_filter::sub, png_filter::up,
+                               png_filter::average, png_filter::paeth, png_filter::adaptive })
+    {
+        std::string name = "filter " + std::to_string(static_cast<int>(filter));
+
+        png_options options;
+        options.filter = filter;
+        options.threads = 1;
+        ok &= check(name + ", first image", make_image(64, 32, 1), options);
+        ok &= check(name + ", second image", make_image(64, 32, 2), options);
+        ok &= check(name + ", narrower image", make_image(48, 16, 3), options);
+
+        // Strips compressed in parallel.
+        options.threads = 2;
+        options.strip_size = 1024;
+        ok &= check(name + ", first strips", make_image(64, 64, 4), options);
+        ok &= check(name + ", second strips", make_image(64, 64, 5), options);
+    }
+    if (ok)
+    {
+        std::cout << "png_writer: OK" << std::endl;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+// Runs jobs on the scheduler, reuses the id of a finished job and checks
+// that the finished job ageing out later does not forget the new one.
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "../lib/scheduler.hpp"
+
+using namespace mapnik_print;
+
+namespace
+{
+
+bool check(std::string const & name, bool condition)
+{
+    if (!condition)
+    {
+        std::cerr << "FAIL " << name << std::endl;
+    }
+    return condition;
+}
+
+void wait(job_ptr const & j)
+{
+    while (j->get_state() == job_state::queued || j->get_state() == job_state::running)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+job_ptr submit(job_scheduler & scheduler, std::string const & id, std::function<void(job &)> run = [](job &) {})
+{
+    job_ptr j(scheduler.try_submit(id, job_priority::normal, boost::none, nullptr, std::move(run)));
+    if (!j)
+    {
+        throw std::runtime_error("Queue full");
+    }
+    return j;
+}
+
+// Returns once a job submitted now runs: the jobs before it then have
+// finished, the scheduler having a single thread.
+void settle(job_scheduler & scheduler)
+{
+    std::atomic<bool> running{ false };
+    submit(scheduler, "", [&](job &) { running = true; });
+    while (!running)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+}
+
+int main()
+{
+    bool ok = true;
+    job_scheduler scheduler(1, 2048);
+
+    std::atomic<bool> release{ false };
+    job_ptr first(submit(scheduler, "a", [&](job &) {
+        while (!release)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }));
+    bool refused = false;
+    try
+    {
+        submit(scheduler, "a");
+    }
+    catch (std::runtime_error const &)
+    {
+        refused = true;
+    }
+    ok &= check("active id refused", refused);
+    release = true;
+    wait(first);
+    ok &= check("first done", first->get_state() == job_state::done);
+
+    // Enough jobs finish between the two jobs of id "a" for the first one
+    // alone to age out of the 1024 finished jobs kept.
+    for (int i = 0; i < 1000; i++)
+    {
+        submit(scheduler, "");
+    }
+    settle(scheduler);
+    job_ptr second(submit(scheduler, "a", [](job &) { throw std::runtime_error("broken"); }));
+    wait(second);
+    ok &= check("id reused", scheduler.find("a") == second);
+    ok &= check("second failed", second->get_state() == job_state::failed &&
+                                 second->status().find("error=broken") != std::string::npos);
+
+    job_ptr cancelled(submit(scheduler, "c", [&](job & j) {
+        while (true)
+        {
+            j.check();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }));
+    scheduler.cancel("c");
+    wait(cancelled);
+    ok &= check("cancelled", cancelled->get_state() == job_state::cancelled);
+
+    // Finished so far: the first "a", 1000 jobs, the settling one, the
+    // second "a" and "c". The last settling job may have finished too.
+    for (int i = 0; i < 21; i++)
+    {
+        submit(scheduler, "");
+    }
+    settle(scheduler);
+    ok &= check("aged out keeps reused id", scheduler.find("a") == second);
+    ok &= check("generated ids", scheduler.find("2") && scheduler.find("2")->get_state() == job_state::done);
+    settle(scheduler);
+    ok &= check("generated id aged out", !scheduler.find("1") && scheduler.find("3"));
+
+    if (ok)
+    {
+        std::cout << "scheduler: OK" << std::endl;
+    }
+    return ok ? 0 : 1;
+}
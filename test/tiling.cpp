@@ -0,0 +1,137 @@
+// Splits images into tiles and strips, sizes strips to the memory budget
+// and scales the overlap to the map buffers.
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <mapnik/map.hpp>
+#include <mapnik/layer.hpp>
+
+#include "../lib/tiling.hpp"
+
+using namespace mapnik_print;
+
+namespace
+{
+
+bool check(std::string const & name, bool condition)
+{
+    if (!condition)
+    {
+        std::cerr << "FAIL " << name << std::endl;
+    }
+    return condition;
+}
+
+// The tiles cover every pixel of the image once, and render the overlap
+// around them within the image.
+bool check_tiles(std::string const & name, std::vector<tile> const & tiles,
+                 unsigned width, unsigned height, unsigned overlap)
+{
+    std::vector<unsigned> covered(std::size_t(width) * height, 0);
+    bool inside = true;
+    for (tile const & t : tiles)
+    {
+        for (unsigned y = t.y; y < t.y + t.height; y++)
+        {
+            for (unsigned x = t.x; x < t.x + t.width; x++)
+            {
+                covered[std::size_t(y) * width + x]++;
+            }
+        }
+        inside &= t.x + t.width <= width && t.y + t.height <= height &&
+                  t.render_x == (t.x > overlap ? t.x - overlap : 0) &&
+                  t.render_y == (t.y > overlap ? t.y - overlap : 0) &&
+                  t.render_x + t.render_width == std::min(width, t.x + t.width + overlap) &&
+                  t.render_y + t.render_height == std::min(height, t.y + t.height + overlap);
+    }
+    bool once = true;
+    for (unsigned count : covered)
+    {
+        once &= count == 1;
+    }
+    return check(name, inside && once);
+}
+
+bool check_throws(std::string const & name, tile_options const & options, unsigned width, unsigned height,
+                  std::size_t pooled = 0)
+{
+    try
+    {
+        options.strip_rows(width, height, pooled);
+    }
+    catch (std::runtime_error const &)
+    {
+        return true;
+    }
+    std::cerr << "FAIL " << name << ": no error" << std::endl;
+    return false;
+}
+
+}
+
+int main()
+{
+    bool ok = true;
+
+    std::vector<tile> tiles(split_tiles(1000, 700, 256, 32));
+    ok &= check("tile count", tiles.size() == 4 * 3);
+    ok &= check_tiles("tiles", tiles, 1000, 700, 32);
+    ok &= check_tiles("tiles without overlap", split_tiles(300, 200, 64, 0), 300, 200, 0);
+    ok &= check_tiles("single tile", split_tiles(100, 50, 256, 32), 100, 50, 32);
+    ok &= check_tiles("overlap beyond tiles", split_tiles(500, 300, 100, 250), 500, 300, 250);
+
+    tile strip(strip_tile(1000, 700, 300, 100, 32));
+    ok &= check("strip", strip.x == 0 && strip.width == 1000 && strip.render_x == 0 &&
+                         strip.render_width == 1000 && strip.render_y == 268 && strip.render_height == 164);
+    tile last(strip_tile(1000, 700, 600, 200, 32));
+    ok &= check("last strip", last.height == 100 && last.render_y == 568 && last.render_height == 132);
+
+    // Rows of 4000 bytes, the whole image is held twice in 8000000 bytes.
+    tile_options options;
+    options.overlap = 32;
+    ok &= check("no budget", options.strip_rows(1000, 1000) == 0);
+    options.memory_budget = 8000000;
+    ok &= check("fits", options.strip_rows(1000, 1000) == 0);
+    options.memory_budget = 4000000;
+    ok &= check("strips", options.strip_rows(1000, 1000) == 500 - 64);
+    ok &= check("pooled", options.strip_rows(1000, 1000, 1000000) == 375 - 64);
+    ok &= check_throws("pool beyond budget", options, 1000, 1000, 4000000);
+    options.overlap = 256;
+    ok &= check_throws("overlap beyond budget", options, 1000, 1000);
+
+    // Four tile images of 320 x 320 pixels with their overlap.
+    options.overlap = 32;
+    options.threads = 4;
+    options.tile_size = 256;
+    ok &= check("tile bytes", options.tile_bytes(1000, 1000) == 4 * 320 * 320 * 4);
+    ok &= check("tile bytes of narrow images", options.tile_bytes(100, 1000) == 4 * 100 * 320 * 4);
+    ok &= check("untiled", options.tile_bytes(256, 256) == 0);
+    ok &= check("tiled strips", options.strip_rows(1000, 1000) == (4000000 - 1638400) / 8000 - 64);
+    options.memory_budget = 8000000;
+    ok &= check("tiles beyond whole image", options.strip_rows(1000, 1000) > 0);
+    options.threads = 1;
+    ok &= check("single thread", options.tile_bytes(1000, 1000) == 0 && options.strip_rows(1000, 1000) == 0);
+    options.threads = 0;
+    ok &= check("thread per core", options.tile_bytes(1000, 1000) >= 320 * 320 * 4 &&
+                                   options.tile_bytes(1000, 1000) % (320 * 320 * 4) == 0);
+
+    mapnik::Map map(256, 256);
+    ok &= check("overlap", scaled_overlap(map, 1, 256) == 256);
+    ok &= check("scaled overlap", scaled_overlap(map, 300 / 72.0, 256) == 1067);
+    ok &= check("reduced overlap", scaled_overlap(map, 0.5, 256) == 128);
+    map.set_buffer_size(300);
+    ok &= check("map buffer", scaled_overlap(map, 2, 256) == 600);
+    mapnik::layer lyr("labels");
+    lyr.set_buffer_size(512);
+    map.add_layer(lyr);
+    ok &= check("layer buffer", scaled_overlap(map, 2, 256) == 1024);
+
+    if (ok)
+    {
+        std::cout << "tiling: OK" << std::endl;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,172 @@
+// Encodes the keys of UTFGrid cells and writes a small grid, its shared
+// keys and the data of its features.
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <mapnik/value.hpp>
+
+#include "../lib/utfgrid.hpp"
+
+using namespace mapnik_print;
+using namespace mapnik_print::utfgrid_detail;
+
+namespace
+{
+
+// Feature with the members write_utfgrid reads.
+struct test_feature
+{
+    mapnik::value_integer feature_id;
+    std::map<std::string, mapnik::value> fields;
+
+    mapnik::value_integer id() const
+    {
+        return feature_id;
+    }
+
+    bool has_key(std::string const & key) const
+    {
+        return fields.count(key) > 0;
+    }
+
+    mapnik::value get(std::string const & key) const
+    {
+        return fields.at(key);
+    }
+};
+
+// Grid with the interface of mapnik::hit_grid that write_utfgrid uses.
+struct test_grid
+{
+    using value_type = std::int64_t;
+    using feature_key_type = std::map<value_type, std::string>;
+    using feature_type = std::map<std::string, std::shared_ptr<test_feature>>;
+
+    unsigned grid_width;
+    std::vector<value_type> cells;
+    feature_key_type feature_keys;
+    feature_type features;
+    std::set<std::string> fields;
+
+    unsigned width() const
+    {
+        return grid_width;
+    }
+
+    unsigned height() const
+    {
+        return static_cast<unsigned>(cells.size() / grid_width);
+    }
+
+    value_type const * get_row(unsigned y) const
+    {
+        return &cells[y * grid_width];
+    }
+
+    feature_key_type const & get_feature_keys() const
+    {
+        return feature_keys;
+    }
+
+    feature_type const & get_grid_features() const
+    {
+        return features;
+    }
+
+    std::set<std::string> const & get_fields() const
+    {
+        return fields;
+    }
+};
+
+bool check(std::string const & name, bool condition)
+{
+    if (!condition)
+    {
+        std::cerr << "FAIL " << name << std::endl;
+    }
+    return condition;
+}
+
+// Code point of the UTF-8 sequence, which must be the whole text.
+std::uint32_t decode_utf8(std::string const & text)
+{
+    std::uint8_t first = static_cast<std::uint8_t>(text[0]);
+    std::size_t length = first < 0x80 ? 1 : first < 0xe0 ? 2 : first < 0xf0 ? 3 : 4;
+    if (text.size() != length)
+    {
+        return 0xffffffff;
+    }
+    std::uint32_t code = length == 1 ? first : first & (0x7f >> length);
+    for (std::size_t i = 1; i < length; i++)
+    {
+        std::uint8_t next = static_cast<std::uint8_t>(text[i]);
+        if ((next & 0xc0) != 0x80)
+        {
+            return 0xffffffff;
+        }
+        code = code << 6 | (next & 0x3f);
+    }
+    return code;
+}
+
+}
+
+int main()
+{
+    bool ok = true;
+
+    ok &= check("first keys", key_code(0) == ' ' && key_code(1) == '!' && key_code(2) == '#');
+    ok &= check("backslash skipped", key_code(58) == '[' && key_code(59) == ']');
+    ok &= check("surrogates skipped", key_code(0xd7dd) == 0xd7ff && key_code(0xd7de) == 0xe000);
+    bool increasing = true;
+    for (std::size_t i = 1; i < 0x10000; i++)
+    {
+        std::uint32_t code = key_code(i);
+        increasing &= code > key_code(i - 1) && code != '"' && code != '\\' && (code < 0xd800 || code > 0xdfff);
+    }
+    ok &= check("keys increasing and valid", increasing);
+
+    for (std::uint32_t code : { 0x41u, 0x7fu, 0x80u, 0xe9u, 0x7ffu, 0x800u, 0x20acu, 0xffffu, 0x10000u, 0x1f600u })
+    {
+        std::string text;
+        append_utf8(text, code);
+        ok &= check("utf8 " + std::to_string(code), decode_utf8(text) == code);
+    }
+
+    // Features 1 and 3 share their key, cells of -1 have no feature and
+    // the feature of the second key has no data.
+    test_grid grid;
+    grid.grid_width = 3;
+    grid.cells = { 1, 1, 2,
+                   -1, 2, 3 };
+    grid.feature_keys = { { 1, "a" }, { 2, "b\"q" }, { 3, "a" } };
+    auto feature = std::make_shared<test_feature>();
+    feature->feature_id = 7;
+    feature->fields = { { "name", mapnik::value(mapnik::value_integer(5)) }, { "flag", mapnik::value(true) } };
+    grid.features = { { "a", feature }, { "b\"q", nullptr } };
+    grid.fields = { "__id__", "flag", "missing", "name" };
+
+    std::ostringstream out;
+    write_utfgrid(grid, out);
+    std::string expected("{\"grid\":[\"!!#\",\" #!\"],\"keys\":[\"\",\"a\",\"b\\\"q\"],"
+                         "\"data\":{\"a\":{\"__id__\":7,\"flag\":true,\"name\":5}}}");
+    ok &= check("grid", out.str() == expected);
+    if (out.str() != expected)
+    {
+        std::cerr << out.str() << std::endl;
+    }
+
+    if (ok)
+    {
+        std::cout << "utfgrid: OK" << std::endl;
+    }
+    return ok ? 0 : 1;
+}